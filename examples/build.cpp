@@ -0,0 +1,135 @@
+#include <fat16/builder.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+static void to_fat_time(const std::time_t stamp, std::uint16_t &date, std::uint16_t &time) {
+    const std::tm *local = std::localtime(&stamp);
+
+    if (!local || local->tm_year < 80) {
+        date = 0;
+        time = 0;
+        return;
+    }
+
+    date = static_cast<std::uint16_t>(((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday);
+    time = static_cast<std::uint16_t>((local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2));
+}
+
+static bool add_tree(Fat16::ImageBuilder &builder, const fs::path &host_root, const bool keep_times) {
+    std::error_code error;
+
+    for (fs::recursive_directory_iterator it(host_root, error), end; it != end; it.increment(error)) {
+        if (error) {
+            return false;
+        }
+
+        const std::string image_path = it->path().lexically_relative(host_root).generic_u8string();
+
+        std::uint16_t date = 0;
+        std::uint16_t time = 0;
+
+        struct stat info;
+
+        if (stat(it->path().string().c_str(), &info) != 0) {
+            return false;
+        }
+
+        if (keep_times) {
+            to_fat_time(info.st_mtime, date, time);
+        }
+
+        bool added = true;
+
+        if (it->is_directory()) {
+            added = builder.add_directory(image_path, date, time);
+        } else if (it->is_regular_file()) {
+            // FAT keeps 32-bit sizes
+            if (static_cast<std::uint64_t>(info.st_size) > 0xFFFFFFFF) {
+                std::fprintf(stderr, "%s is too large for FAT16\n", image_path.c_str());
+                return false;
+            }
+
+            added = builder.add_file(image_path, it->path().string(), static_cast<std::uint32_t>(info.st_size), date, time);
+        }
+
+        if (!added) {
+            std::fprintf(stderr, "Can't add %s\n", image_path.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "Usage: %s <host directory> <output image> [-j threads] [-c blocks per cluster] "
+            "[-s size in MiB] [-l label] [-t]\n", argv[0]);
+        return 1;
+    }
+
+    Fat16::BuilderOptions options;
+    bool keep_times = false;
+
+    for (int i = 3; i < argc; i++) {
+        const bool has_value = (i + 1 < argc);
+
+        if (std::strcmp(argv[i], "-j") == 0 && has_value) {
+            options.reader_threads = static_cast<std::uint32_t>(std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "-c") == 0 && has_value) {
+            options.blocks_per_cluster = static_cast<std::uint8_t>(std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "-s") == 0 && has_value) {
+            options.total_blocks = static_cast<std::uint32_t>(std::atoi(argv[++i]) * (1024 * 1024 / options.bytes_per_block));
+        } else if (std::strcmp(argv[i], "-l") == 0 && has_value) {
+            options.volume_label = argv[++i];
+        } else if (std::strcmp(argv[i], "-t") == 0) {
+            keep_times = true;
+        }
+    }
+
+    Fat16::ImageBuilder builder(options);
+
+    if (!add_tree(builder, argv[1], keep_times)) {
+        return 1;
+    }
+
+    if (!builder.plan()) {
+        std::fprintf(stderr, "Content doesn't fit a FAT16 image with these options\n");
+        return 1;
+    }
+
+    FILE *f = std::fopen(argv[2], "wb");
+    if (!f) {
+        return 1;
+    }
+
+    const bool written = builder.write(f,
+        [](void *userdata, const void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(std::fwrite(buffer, 1, size, (FILE*)userdata));
+        },
+        // Free space at the end becomes a hole
+        [](void *userdata, std::uint32_t size) -> bool {
+            return std::fflush((FILE*)userdata) == 0 && ftruncate(fileno((FILE*)userdata), size) == 0;
+        });
+
+    // A write error may only show when the last buffer goes out
+    const bool closed = std::fclose(f) == 0;
+
+    if (!written || !closed) {
+        std::fprintf(stderr, "Failed to write the image\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <fat16/carve.h>
+
+#include <cstdio>
+
+static bool print_match(void *userdata, const Fat16::CarveMatch &match) {
+    const Fat16::Image &img = *static_cast<const Fat16::Image*>(userdata);
+    const Fat16::CarveSignature &signature = Fat16::get_default_signatures()[match.signature];
+
+    std::printf("%-5s cluster %5u  offset 0x%08x  up to %u bytes free\n", signature.name.c_str(), match.cluster,
+        img.cluster_offset(match.cluster), match.free_run * img.bytes_per_cluster());
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    const bool scanned = Fat16::carve_free_clusters(img, Fat16::get_default_signatures(), print_match, &img);
+
+    fclose(f);
+
+    if (!scanned) {
+        std::fprintf(stderr, "Scan failed\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <fat16/check.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+static const char *describe(const Fat16::CheckIssueType type) {
+    switch (type) {
+    case Fat16::CheckIssueType::CROSS_LINKED:
+        return "cross-linked at cluster";
+
+    case Fat16::CheckIssueType::BAD_CHAIN:
+        return "broken chain at cluster";
+
+    case Fat16::CheckIssueType::SIZE_MISMATCH:
+        return "size does not fit chain from cluster";
+
+    case Fat16::CheckIssueType::LOST_CHAIN:
+        return "lost chain from cluster";
+
+    case Fat16::CheckIssueType::FAT_COPY_MISMATCH:
+        return "FAT copy differs from entry";
+
+    case Fat16::CheckIssueType::UNREADABLE_DIRECTORY:
+        return "unreadable directory";
+    }
+
+    return "unknown issue";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [threads, all if omitted]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    // Lets directories be read from several threads at once
+    img.read_at_func = [](void *userdata, void *buffer, std::uint32_t offset, std::uint32_t size) -> std::uint32_t {
+        const ssize_t bytes_read = pread(fileno((FILE*)userdata), buffer, size, offset);
+        return bytes_read < 0 ? 0 : static_cast<std::uint32_t>(bytes_read);
+    };
+
+    Fat16::CheckOptions options;
+
+    if (argc >= 3) {
+        options.threads = static_cast<std::uint32_t>(std::strtoul(argv[2], nullptr, 10));
+    }
+
+    Fat16::CheckReport report;
+    const bool checked = Fat16::check_image(img, report, options);
+
+    fclose(f);
+
+    if (!checked) {
+        std::fprintf(stderr, "Can't read the FAT\n");
+        return 1;
+    }
+
+    for (const Fat16::CheckIssue &issue : report.issues) {
+        const std::string path = Fat16::utf16_to_utf8(issue.path);
+
+        if (issue.type == Fat16::CheckIssueType::FAT_COPY_MISMATCH) {
+            std::printf("FAT %u: %s %u, %u entries\n", issue.detail >> 16, describe(issue.type), issue.cluster,
+                issue.detail & 0xFFFF);
+        } else if (issue.type == Fat16::CheckIssueType::LOST_CHAIN) {
+            std::printf("%s %u, %u clusters\n", describe(issue.type), issue.cluster, issue.detail);
+        } else if (issue.type == Fat16::CheckIssueType::SIZE_MISMATCH) {
+            std::printf("%s: %s %u, %u clusters\n", path.c_str(), describe(issue.type), issue.cluster, issue.detail);
+        } else {
+            std::printf("%s: %s %u\n", path.c_str(), describe(issue.type), issue.cluster);
+        }
+    }
+
+    std::printf("%u files, %u directories, %u/%u clusters reached, %u lost, %zu issues\n", report.files,
+        report.directories, report.reached_clusters, report.allocated_clusters, report.lost_clusters, report.issues.size());
+
+    return report.is_clean() ? 0 : 2;
+}
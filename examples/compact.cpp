@@ -0,0 +1,61 @@
+#include <fat16/compact.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [spare clusters]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "r+b");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    },
+        // Write hook
+        [](void *userdata, const void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fwrite(buffer, 1, size, (FILE*)userdata));
+        });
+
+    img.truncate_func = [](void *userdata, std::uint32_t size) -> bool {
+        return fflush((FILE*)userdata) == 0 && ftruncate(fileno((FILE*)userdata), size) == 0;
+    };
+
+    Fat16::CompactOptions options;
+
+    if (argc >= 3) {
+        options.spare_clusters = static_cast<std::uint32_t>(std::strtoul(argv[2], nullptr, 10));
+    }
+
+    Fat16::CompactResult result;
+    const bool done = Fat16::compact(img, result, options);
+
+    fclose(f);
+
+    if (!done) {
+        std::fprintf(stderr, "Compaction failed\n");
+        return 1;
+    }
+
+    std::printf("Moved %u clusters. %u -> %u clusters, FAT %u -> %u blocks, %u -> %u bytes\n", result.clusters_moved,
+        result.old_clusters, result.new_clusters, result.old_blocks_per_fat, result.new_blocks_per_fat,
+        result.old_size, result.new_size);
+
+    return 0;
+}
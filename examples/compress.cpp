@@ -0,0 +1,103 @@
+#include <fat16/compressed.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static int pack(const char *image_path, const char *output_path) {
+    FILE *in = std::fopen(image_path, "rb");
+    FILE *out = std::fopen(output_path, "wb");
+
+    if (!in || !out) {
+        return 1;
+    }
+
+    Fat16::CompressedImageWriter writer(out,
+        [](void *userdata, const void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(std::fwrite(buffer, 1, size, (FILE*)userdata));
+        });
+
+    std::vector<std::uint8_t> chunk(0x100000);
+    std::size_t size = 0;
+
+    while ((size = std::fread(chunk.data(), 1, chunk.size(), in)) != 0) {
+        if (!writer.write(chunk.data(), static_cast<std::uint32_t>(size))) {
+            break;
+        }
+    }
+
+    const bool done = writer.finish();
+
+    std::fclose(in);
+    std::fclose(out);
+
+    if (!done) {
+        std::fprintf(stderr, "Failed to write the container\n");
+        return 1;
+    }
+
+    std::printf("%llu bytes compressed\n", (unsigned long long)writer.compressed_size());
+    return 0;
+}
+
+/**
+ * \brief Print a file of a compressed image to stdout, going down the path one directory at a time.
+ */
+static int cat(const char *container_path, const char *path) {
+    const auto start = std::chrono::steady_clock::now();
+
+    Fat16::CompressedImage container;
+    if (!container.open(container_path)) {
+        std::fprintf(stderr, "Not a seekable gzip container\n");
+        return 1;
+    }
+
+    Fat16::Image img(&container, Fat16::CompressedImage::read_hook, Fat16::CompressedImage::seek_hook);
+    container.attach(img);
+
+    Fat16::Entry entry;
+    Fat16::ClusterID directory = 0;
+    std::string rest(path);
+
+    while (!rest.empty()) {
+        const std::size_t separator = rest.find('/');
+        const std::string name = rest.substr(0, separator);
+
+        rest = (separator == std::string::npos) ? std::string() : rest.substr(separator + 1);
+
+        if (!img.find_entry(directory, Fat16::utf8_to_utf16(name), entry)) {
+            std::fprintf(stderr, "%s not found\n", name.c_str());
+            return 1;
+        }
+
+        directory = entry.entry.starting_cluster;
+    }
+
+    std::vector<std::uint8_t> content(entry.entry.file_size);
+
+    if (img.read_from_cluster(content.data(), 0, entry.entry.starting_cluster, entry.entry.file_size) != content.size()) {
+        std::fprintf(stderr, "Can't read the file\n");
+        return 1;
+    }
+
+    std::fwrite(content.data(), 1, content.size(), stdout);
+
+    const Fat16::CompressedReadStats stats = container.get_stats();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    std::fprintf(stderr, "%llu reads, %llu frames inflated, %llu cache hits, %lld us\n", (unsigned long long)stats.reads,
+        (unsigned long long)stats.frames_inflated, (unsigned long long)stats.cache_hits, (long long)elapsed.count());
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4 || (std::strcmp(argv[1], "pack") != 0 && std::strcmp(argv[1], "cat") != 0)) {
+        std::fprintf(stderr, "Usage: %s pack <image> <container>\n       %s cat <container> <path in image>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    return std::strcmp(argv[1], "pack") == 0 ? pack(argv[2], argv[3]) : cat(argv[2], argv[3]);
+}
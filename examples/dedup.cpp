@@ -0,0 +1,76 @@
+#include <fat16/dedup.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+static int add(const char *store_path, int count, char **images) {
+    // The store may not exist yet
+    mkdir(store_path, 0755);
+
+    Fat16::DedupStore store;
+    if (!store.open(store_path)) {
+        std::fprintf(stderr, "Can't open the store\n");
+        return 1;
+    }
+
+    std::vector<Fat16::DedupSource> sources;
+
+    for (int i = 0; i < count; i++) {
+        const std::string path(images[i]);
+        const std::size_t separator = path.find_last_of('/');
+
+        sources.push_back({ path, separator == std::string::npos ? path : path.substr(separator + 1) });
+    }
+
+    Fat16::DedupStats stats;
+    const bool added = store.add_images(sources, stats);
+
+    std::printf("%u images added, %u failed. %llu bytes, %llu zeros, %llu chunks of which %llu new, %llu bytes stored\n",
+        stats.images_added, stats.images_failed, (unsigned long long)stats.bytes, (unsigned long long)stats.zero_bytes,
+        (unsigned long long)stats.chunks, (unsigned long long)stats.new_chunks, (unsigned long long)stats.new_bytes);
+    std::printf("Store: %u chunks, %llu bytes\n", store.chunk_count(), (unsigned long long)store.stored_bytes());
+
+    return added ? 0 : 1;
+}
+
+static int restore(const char *store_path, const char *name, const char *output_path) {
+    Fat16::DedupStore store;
+    if (!store.open(store_path)) {
+        std::fprintf(stderr, "Can't open the store\n");
+        return 1;
+    }
+
+    FILE *f = std::fopen(output_path, "wb");
+    if (!f) {
+        return 1;
+    }
+
+    const bool restored = store.restore(name, f,
+        [](void *userdata, const void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(std::fwrite(buffer, 1, size, (FILE*)userdata));
+        });
+
+    if (std::fclose(f) != 0 || !restored) {
+        std::fprintf(stderr, "Failed to restore %s\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 4 && std::strcmp(argv[1], "add") == 0) {
+        return add(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 5 && std::strcmp(argv[1], "restore") == 0) {
+        return restore(argv[2], argv[3], argv[4]);
+    }
+
+    std::fprintf(stderr, "Usage: %s add <store> <image>...\n       %s restore <store> <image name> <output>\n", argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,63 @@
+#include <fat16/defrag.h>
+#include <fat16/sparse.h>
+
+#include <cstdio>
+
+static bool print_progress(void *userdata, const Fat16::DefragProgress &progress) {
+    (void)userdata;
+
+    if (progress.path) {
+        std::printf("[%u/%u] %s\n", progress.files_moved, progress.files_planned,
+            Fat16::utf16_to_utf8(*progress.path).c_str());
+    }
+
+    return true;
+}
+
+static void print_stats(const char *title, const Fat16::FragmentationStats &stats) {
+    std::printf("%s: %u files, %u fragmented, %llu extents over %llu clusters, %llu extra seeks\n", title,
+        stats.files, stats.fragmented_files, (unsigned long long)stats.extents, (unsigned long long)stats.clusters,
+        (unsigned long long)stats.extra_seeks());
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+        return 1;
+    }
+
+    // Clusters freed by moving files are punched out of the image file
+    Fat16::SparseFile file;
+    if (!file.open(argv[1], true)) {
+        return 1;
+    }
+
+    Fat16::Image img(&file, Fat16::SparseFile::read_hook, Fat16::SparseFile::seek_hook, Fat16::SparseFile::write_hook);
+    file.attach(img);
+
+    Fat16::DefragResult result;
+    const bool done = Fat16::defragment(img, result, print_progress, nullptr);
+
+    file.close();
+
+    if (!done) {
+        std::fprintf(stderr, "Defragmentation failed\n");
+        return 1;
+    }
+
+    print_stats("Before", result.before);
+    print_stats("After", result.after);
+
+    std::printf("Moved %u files, %llu clusters", result.files_moved, (unsigned long long)result.clusters_moved);
+
+    if (result.files_left != 0) {
+        std::printf(", %u fragmented files had no free run large enough", result.files_left);
+    }
+
+    if (result.files_stopped != 0) {
+        std::printf(", stopped with %u fragmented files to go", result.files_stopped);
+    }
+
+    std::printf("\n");
+    return 0;
+}
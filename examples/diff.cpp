@@ -0,0 +1,95 @@
+#include <fat16/diff.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+static std::uint32_t read_hook(void *userdata, void *buffer, std::uint32_t size) {
+    return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+}
+
+static std::uint32_t seek_hook(void *userdata, std::uint32_t offset, int mode) {
+    fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+        (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+    return ftell((FILE*)userdata);
+}
+
+// Lets files be compared from several threads at once
+static std::uint32_t read_at_hook(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t size) {
+    const ssize_t bytes_read = pread(fileno((FILE*)userdata), buffer, size, offset);
+    return bytes_read < 0 ? 0 : static_cast<std::uint32_t>(bytes_read);
+}
+
+static char kind_mark(const Fat16::DiffKind kind) {
+    switch (kind) {
+    case Fat16::DiffKind::ADDED:
+        return '+';
+
+    case Fat16::DiffKind::REMOVED:
+        return '-';
+
+    case Fat16::DiffKind::MODIFIED:
+        return 'M';
+
+    default:
+        return 'm';
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "Usage: %s <old image> <new image> [threads, all if omitted]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *old_file = fopen(argv[1], "rb");
+    if (!old_file) {
+        return 1;
+    }
+
+    FILE *new_file = fopen(argv[2], "rb");
+    if (!new_file) {
+        fclose(old_file);
+        return 1;
+    }
+
+    Fat16::Image old_img(old_file, read_hook, seek_hook);
+    Fat16::Image new_img(new_file, read_hook, seek_hook);
+
+    old_img.read_at_func = read_at_hook;
+    new_img.read_at_func = read_at_hook;
+
+    Fat16::DiffOptions options;
+
+    if (argc >= 4) {
+        options.threads = static_cast<std::uint32_t>(std::strtoul(argv[3], nullptr, 10));
+    }
+
+    Fat16::DiffResult result;
+    const bool compared = Fat16::diff_images(old_img, new_img, result, options);
+
+    fclose(old_file);
+    fclose(new_file);
+
+    if (!compared) {
+        std::fprintf(stderr, "Can't read both trees whole, the comparison is partial\n");
+    }
+
+    std::uint32_t counts[4] = {};
+
+    for (const Fat16::DiffEntry &change : result.changes) {
+        counts[static_cast<int>(change.kind)]++;
+
+        std::printf("%c %s%s\n", kind_mark(change.kind), Fat16::utf16_to_utf8(change.path).c_str(),
+            change.is_directory ? "/" : "");
+    }
+
+    std::printf("\n%u added, %u removed, %u modified, %u with other metadata\n", counts[0], counts[1], counts[2], counts[3]);
+    std::printf("%u directories, %u files compared: %u in place, %u by digest, %llu bytes read\n", result.stats.directories,
+        result.stats.files_compared, result.stats.same_extents, result.stats.hashed,
+        (unsigned long long)result.stats.bytes_read);
+
+    return compared ? 0 : 1;
+}
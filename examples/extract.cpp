@@ -1,4 +1,5 @@
 #include <fat16/fat16.h>
+#include <fat16/zerocopy.h>
 
 #include <algorithm>
 #include <cassert>
@@ -15,6 +16,15 @@ static void extract_file(Fat16::Image &img, Fat16::Entry &entry, const std::stri
 
     FILE *f = fopen(filename.c_str(), "wb");
 
+    // Let the kernel copy it if it can
+    if (Fat16::copy_file_to_fd(img, entry.entry, fileno((FILE*)img.userdata), fileno(f))) {
+        fclose(f);
+        return;
+    }
+
+    // Start over, through a buffer
+    f = freopen(filename.c_str(), "wb", f);
+
     static constexpr std::uint32_t CHUNK_SIZE = 0x10000;
 
     std::vector<std::uint8_t> temp_buf;
@@ -39,7 +49,9 @@ static void extract_file(Fat16::Image &img, Fat16::Entry &entry, const std::stri
 }
 
 static void traverse_directory(Fat16::Image &img, Fat16::Entry mee, std::string dir_path) {
-    fs::create_directories(dir_path);
+    if (!dir_path.empty()) {
+        fs::create_directories(dir_path);
+    }
 
     while (img.get_next_entry(mee)) {
         if (mee.entry.file_attributes & (int)Fat16::EntryAttribute::DIRECTORY) {
@@ -52,7 +64,7 @@ static void traverse_directory(Fat16::Image &img, Fat16::Entry mee, std::string
 
                 auto dir_name = mee.get_filename();
 
-                traverse_directory(img, baby, dir_path + std::string(dir_name.begin(), dir_name.end()) + "\\");
+                traverse_directory(img, baby, dir_path + std::string(dir_name.begin(), dir_name.end()) + "/");
             }
         }
 
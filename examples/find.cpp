@@ -0,0 +1,65 @@
+#include <fat16/glob.h>
+
+#include <cstdio>
+
+static bool print_match(void *userdata, const Fat16::EntryView &view) {
+    (void)userdata;
+
+    std::string path = Fat16::utf16_to_utf8(view.parent->to_string());
+
+    if (!path.empty()) {
+        path += '/';
+    }
+
+    path += Fat16::utf16_to_utf8(view.get_filename());
+
+    if (view.is_directory()) {
+        path += '/';
+    }
+
+    std::printf("%s\n", path.c_str());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "Usage: %s <image> <pattern, such as \"**/*.txt\">\n", argv[0]);
+        return 1;
+    }
+
+    Fat16::GlobPattern pattern;
+
+    if (!pattern.compile(argv[2])) {
+        std::fprintf(stderr, "Invalid pattern\n");
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    const bool found = Fat16::find(img, pattern, print_match, nullptr);
+
+    fclose(f);
+
+    if (!found) {
+        std::fprintf(stderr, "Search failed\n");
+        return 1;
+    }
+
+    return 0;
+}
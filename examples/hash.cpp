@@ -0,0 +1,76 @@
+#include <fat16/hash.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+static bool print_digest(void *userdata, const Fat16::HashedFile &file) {
+    std::uint32_t &failed = *static_cast<std::uint32_t*>(userdata);
+    const std::string path = Fat16::utf16_to_utf8(file.path);
+
+    if (!file.valid) {
+        std::fprintf(stderr, "Can't read %s\n", path.c_str());
+        failed++;
+        return true;
+    }
+
+    char sha256[65];
+
+    for (int i = 0; i < 32; i++) {
+        std::snprintf(sha256 + i * 2, 3, "%02x", file.digest.sha256[i]);
+    }
+
+    // sha256sum style, with the CRC and the size in between
+    std::printf("%s %08x %10u  %s\n", sha256, file.digest.crc32, file.entry.file_size, path.c_str());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [threads, all if omitted]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    // Lets the files be hashed from several threads at once
+    img.read_at_func = [](void *userdata, void *buffer, std::uint32_t offset, std::uint32_t size) -> std::uint32_t {
+        const ssize_t bytes_read = pread(fileno((FILE*)userdata), buffer, size, offset);
+        return bytes_read < 0 ? 0 : static_cast<std::uint32_t>(bytes_read);
+    };
+
+    Fat16::HashOptions options;
+
+    if (argc >= 3) {
+        options.threads = static_cast<std::uint32_t>(std::strtoul(argv[2], nullptr, 10));
+    }
+
+    std::uint32_t failed = 0;
+    const bool hashed = Fat16::hash_files(img, print_digest, &failed, options);
+
+    fclose(f);
+
+    if (!hashed) {
+        std::fprintf(stderr, "Hashing failed\n");
+        return 1;
+    }
+
+    return failed == 0 ? 0 : 2;
+}
@@ -0,0 +1,143 @@
+#include <fat16/layout.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+static constexpr std::uint32_t MAP_COLUMNS = 64;
+static constexpr std::uint32_t MAP_ROWS = 16;
+
+static void print_stats(const char *title, const Fat16::LayoutStats &stats) {
+    std::printf("%s: %u, %u fragmented, %llu clusters in %llu extents, %.1f clusters per extent, "
+        "%.2f seeks per read, worst %u\n", title, stats.chains, stats.fragmented, (unsigned long long)stats.clusters,
+        (unsigned long long)stats.extents, stats.average_run(), stats.average_seeks(), stats.max_extents);
+}
+
+/**
+ * \brief Draw the usage map, each character standing for a range of clusters.
+ *
+ * 'D' if it holds some directory, 'L' some lost cluster, 'B' some bad one. Otherwise '#' if
+ * mostly file data, '+' if some, '.' if all free.
+ */
+static void print_map(const std::vector<Fat16::ClusterUsage> &usage) {
+    const std::uint32_t first = Fat16::CLUSTER_FIRST_VALID;
+    const std::uint32_t count = static_cast<std::uint32_t>(usage.size()) - std::min<std::uint32_t>(first,
+        static_cast<std::uint32_t>(usage.size()));
+    const std::uint32_t per_cell = std::max<std::uint32_t>(1, (count + MAP_COLUMNS * MAP_ROWS - 1) / (MAP_COLUMNS * MAP_ROWS));
+
+    std::printf("\nCluster map, %u clusters per character:\n", per_cell);
+
+    for (std::uint32_t cell = 0; cell * per_cell < count; cell++) {
+        const std::uint32_t start = first + cell * per_cell;
+        const std::uint32_t end = std::min<std::uint32_t>(start + per_cell, static_cast<std::uint32_t>(usage.size()));
+
+        std::uint32_t files = 0;
+        char mark = 0;
+
+        for (std::uint32_t cluster = start; cluster < end; cluster++) {
+            switch (usage[cluster]) {
+            case Fat16::ClusterUsage::DIRECTORY:
+                mark = 'D';
+                break;
+
+            case Fat16::ClusterUsage::LOST:
+                mark = (mark == 'D' ? mark : 'L');
+                break;
+
+            case Fat16::ClusterUsage::BAD:
+                mark = (mark ? mark : 'B');
+                break;
+
+            case Fat16::ClusterUsage::FILE:
+                files++;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        if (!mark) {
+            mark = (files * 2 >= end - start ? '#' : (files != 0 ? '+' : '.'));
+        }
+
+        std::putchar(mark);
+
+        if ((cell + 1) % MAP_COLUMNS == 0) {
+            std::putchar('\n');
+        }
+    }
+
+    std::putchar('\n');
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [threads, all if omitted]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    // Lets directories be read from several threads at once
+    img.read_at_func = [](void *userdata, void *buffer, std::uint32_t offset, std::uint32_t size) -> std::uint32_t {
+        const ssize_t bytes_read = pread(fileno((FILE*)userdata), buffer, size, offset);
+        return bytes_read < 0 ? 0 : static_cast<std::uint32_t>(bytes_read);
+    };
+
+    Fat16::LayoutOptions options;
+
+    if (argc >= 3) {
+        options.threads = static_cast<std::uint32_t>(std::strtoul(argv[2], nullptr, 10));
+    }
+
+    Fat16::LayoutReport report;
+    const bool analyzed = Fat16::analyze_layout(img, report, options);
+
+    fclose(f);
+
+    if (!analyzed) {
+        std::fprintf(stderr, "Can't read the whole tree, the report is partial\n");
+    }
+
+    std::printf("extents  clusters/extent  span  path\n");
+
+    for (const Fat16::ChainLayout &file : report.files) {
+        std::printf("%7u  %15.1f  %4u  %s\n", file.extents, file.average_run(), file.span,
+            Fat16::utf16_to_utf8(file.path).c_str());
+    }
+
+    for (const Fat16::ChainLayout &directory : report.directories) {
+        std::printf("%7u  %15.1f  %4u  %s/\n", directory.extents, directory.average_run(), directory.span,
+            Fat16::utf16_to_utf8(directory.path).c_str());
+    }
+
+    std::printf("\n");
+    print_stats("Files", report.file_stats);
+    print_stats("Directories", report.directory_stats);
+
+    std::printf("Free: %u clusters in %u runs, largest %u. Lost: %u. Bad: %u.\n", report.free_clusters, report.free_runs,
+        report.largest_free_run, report.lost_clusters, report.bad_clusters);
+
+    print_map(report.usage);
+
+    return analyzed ? 0 : 1;
+}
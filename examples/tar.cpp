@@ -0,0 +1,76 @@
+#include <fat16/tar.h>
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static std::uint32_t write_to_fd(void *userdata, const void *buffer, std::uint32_t size) {
+    const int fd = *static_cast<int*>(userdata);
+    const char *cursor = static_cast<const char*>(buffer);
+    std::uint32_t size_left = size;
+
+    while (size_left != 0) {
+        const ssize_t written = write(fd, cursor, size_left);
+
+        if (written <= 0) {
+            break;
+        }
+
+        cursor += written;
+        size_left -= static_cast<std::uint32_t>(written);
+    }
+
+    return size - size_left;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [output tar, stdout if omitted]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    int out_fd = STDOUT_FILENO;
+
+    if (argc >= 3) {
+        out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (out_fd < 0) {
+            fclose(f);
+            return 1;
+        }
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    const bool exported = Fat16::export_tar(img, &out_fd, write_to_fd);
+
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+
+    fclose(f);
+
+    if (!exported) {
+        std::fprintf(stderr, "Export failed\n");
+        return 1;
+    }
+
+    return 0;
+}
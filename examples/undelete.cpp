@@ -0,0 +1,117 @@
+#include <fat16/undelete.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace {
+    struct UndeleteContext {
+        Fat16::Image *img;
+        const char *output_dir;                     ///< Null to only list.
+        std::uint32_t recovered;
+    };
+}
+
+static const char *describe(const Fat16::RecoveryConfidence confidence) {
+    switch (confidence) {
+    case Fat16::RecoveryConfidence::HIGH:
+        return "high";
+
+    case Fat16::RecoveryConfidence::MEDIUM:
+        return "medium";
+
+    case Fat16::RecoveryConfidence::LOW:
+        return "low";
+
+    case Fat16::RecoveryConfidence::NONE:
+        return "none";
+    }
+
+    return "unknown";
+}
+
+static void save_file(UndeleteContext &context, const Fat16::DeletedFile &file, const std::string &path) {
+    // Flattened, so deleted directories don't have to be recreated
+    std::string filename = path;
+    std::replace(filename.begin(), filename.end(), '/', '_');
+    filename = std::string(context.output_dir) + "/" + filename;
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        return;
+    }
+
+    static constexpr std::uint32_t CHUNK_SIZE = 0x10000;
+
+    std::vector<std::uint8_t> buffer(CHUNK_SIZE);
+    std::uint32_t offset = 0;
+
+    while (offset < file.entry.file_size) {
+        const std::uint32_t bytes_read = Fat16::read_deleted_file(*context.img, file, buffer.data(), offset, CHUNK_SIZE);
+
+        if (bytes_read == 0) {
+            break;
+        }
+
+        fwrite(buffer.data(), 1, bytes_read, f);
+        offset += bytes_read;
+    }
+
+    fclose(f);
+    context.recovered++;
+}
+
+static bool report_file(void *userdata, const Fat16::DeletedFile &file) {
+    UndeleteContext &context = *static_cast<UndeleteContext*>(userdata);
+    const std::string path = Fat16::utf16_to_utf8(file.path);
+
+    std::printf("%-6s %10u  %s%s%s\n", describe(file.confidence), file.entry.file_size, path.c_str(),
+        file.is_directory() ? "/" : "", file.name_restored ? "" : " (first character unknown)");
+
+    if (context.output_dir && !file.is_directory() && file.confidence != Fat16::RecoveryConfidence::NONE) {
+        save_file(context, file, path);
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <image> [directory to recover files to]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        return 1;
+    }
+
+    Fat16::Image img(f,
+        // Read hook
+        [](void *userdata, void *buffer, std::uint32_t size) -> std::uint32_t {
+            return static_cast<std::uint32_t>(fread(buffer, 1, size, (FILE*)userdata));
+        },
+        // Seek hook
+        [](void *userdata, std::uint32_t offset, int mode) -> std::uint32_t {
+        fseek((FILE*)userdata, offset, (mode == Fat16::IMAGE_SEEK_MODE_BEG ? SEEK_SET :
+            (mode == Fat16::IMAGE_SEEK_MODE_CUR ? SEEK_CUR : SEEK_END)));
+
+        return ftell((FILE*)userdata);
+    });
+
+    UndeleteContext context = { &img, argc >= 3 ? argv[2] : nullptr, 0 };
+    const bool complete = Fat16::find_deleted_files(img, report_file, &context);
+
+    fclose(f);
+
+    if (context.output_dir) {
+        std::printf("%u files recovered\n", context.recovered);
+    }
+
+    if (!complete) {
+        std::fprintf(stderr, "Some directories could not be read\n");
+        return 1;
+    }
+
+    return 0;
+}
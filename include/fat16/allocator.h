@@ -0,0 +1,98 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief Free space tracker for the data region of an image.
+     *
+     * The FAT is scanned only once, when the allocator is built. After that, free clusters
+     * are tracked by a bitmap, and free runs are indexed both by their first cluster and by
+     * their length, so best-fit lookups and coalescing on release never rescan the FAT.
+     *
+     * The allocator only does bookkeeping. Linking the returned clusters into a chain
+     * is up to the caller.
+     */
+    struct ClusterAllocator {
+    private:
+        std::vector<std::uint64_t> bitmap;                              ///< Bit set means the cluster is free.
+        std::map<ClusterID, std::uint32_t> runs_by_start;               ///< First cluster -> run length.
+        std::set<std::pair<std::uint32_t, ClusterID>> runs_by_length;   ///< (Run length, first cluster).
+        std::uint32_t cluster_limit;                                    ///< One past the last valid cluster ID.
+        std::uint32_t free_count;
+
+        void set_free_bits(const Extent &extent, const bool free);
+        void insert_run(const ClusterID first, const std::uint32_t count);
+        void erase_run(const ClusterID first, const std::uint32_t count);
+        void take_from_run(const ClusterID run_first, const std::uint32_t run_count, const std::uint32_t count);
+
+    public:
+        explicit ClusterAllocator();
+
+        /**
+         * \brief   Build the allocator from the FAT of the given image.
+         *
+         * The FAT is cached on the image if it was not already.
+         *
+         * \returns True on success.
+         */
+        bool build(Image &img);
+
+        /**
+         * \brief   Build the allocator from a FAT table already in memory.
+         *
+         * \param   fat             The FAT entries, indexed by cluster ID.
+         * \param   total_clusters  Number of clusters in the data region.
+         */
+        void build(const std::vector<ClusterID> &fat, const std::uint32_t total_clusters);
+
+        /**
+         * \brief   Allocate a single contiguous run, using the smallest free run that fits.
+         *
+         * \param   count   Number of clusters wanted.
+         * \param   result  The allocated run.
+         *
+         * \returns True on success. False if no free run is large enough.
+         */
+        bool allocate_contiguous(const std::uint32_t count, Extent &result);
+
+        /**
+         * \brief   Allocate the given number of clusters with as few runs as possible.
+         *
+         * A single best-fit run is used when one exists. Otherwise the largest free runs are
+         * taken first, and the remainder is best-fit.
+         *
+         * \returns True on success. On failure nothing is allocated.
+         */
+        bool allocate(const std::uint32_t count, std::vector<Extent> &result);
+
+        /**
+         * \brief   Mark a run of clusters as used, regardless of where free runs start.
+         *
+         * \returns True if every cluster of the run was free.
+         */
+        bool reserve(const Extent &extent);
+
+        /**
+         * \brief   Return a run of clusters to the free pool, merging it with its neighbours.
+         */
+        void release(const Extent &extent);
+
+        bool is_free(const ClusterID cluster) const;
+
+        std::uint32_t free_clusters() const {
+            return free_count;
+        }
+
+        /**
+         * \brief Get length of the largest free run, in clusters.
+         */
+        std::uint32_t largest_free_run() const;
+    };
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    struct BuilderOptions {
+        std::uint16_t bytes_per_block;
+        std::uint8_t blocks_per_cluster;            ///< Zero to pick the smallest one that fits.
+        std::uint8_t num_fat;
+        std::uint16_t num_root_dirs;
+        std::uint32_t total_blocks;                 ///< Zero to make the image just large enough.
+        std::uint32_t volume_serial;
+        std::string volume_label;                   ///< Up to 11 characters. Empty for none.
+        std::uint16_t default_date;                 ///< FAT date used for entries given no date.
+        std::uint16_t default_time;                 ///< FAT time used for entries given no time.
+        std::uint32_t reader_threads;               ///< Threads reading host files ahead of the writer.
+        std::uint32_t read_ahead_bytes;             ///< Memory budget for files read ahead.
+
+        explicit BuilderOptions()
+            : bytes_per_block(512)
+            , blocks_per_cluster(0)
+            , num_fat(2)
+            , num_root_dirs(512)
+            , total_blocks(0)
+            , volume_serial(0)
+            , default_date(0x21)                    // 1980-01-01
+            , default_time(0)
+            , reader_threads(1)
+            , read_ahead_bytes(64 * 1024 * 1024) {
+        }
+    };
+
+    /**
+     * \brief Build a FAT16 image from a tree of host files, in one sequential pass.
+     *
+     * The whole layout is planned before anything is written: every directory gets one
+     * contiguous run right after the root directory, followed by every file's data, also
+     * contiguous. The image is then streamed out front to back through a write callback,
+     * so the output never needs to be seekable.
+     *
+     * Paths inside the image use '/' as separator and are UTF-8. Parent directories
+     * are created implicitly.
+     */
+    struct ImageBuilder {
+    private:
+        struct Node;
+
+        BuilderOptions options;
+        std::unique_ptr<Node> root;
+        std::vector<Node*> directories;             ///< In layout order, root excluded.
+        std::vector<Node*> files;                   ///< In layout order.
+        BootBlock boot_block;
+        bool planned;
+
+        Node *make_path(const std::string &image_path, const bool is_directory);
+        bool plan_directory(Node *dir);
+        bool choose_geometry(const std::uint32_t needed_clusters);
+        void generate_directory(const Node *dir, std::vector<std::uint8_t> &dest) const;
+
+    public:
+        explicit ImageBuilder(const BuilderOptions &options);
+        ~ImageBuilder();
+
+        /**
+         * \brief   Add an empty directory.
+         * \returns True on success. False if a file already uses that path.
+         */
+        bool add_directory(const std::string &image_path, const std::uint16_t date = 0, const std::uint16_t time = 0);
+
+        /**
+         * \brief   Add a file whose content is read from the host when the image is written.
+         *
+         * \param   image_path      Path of the file inside the image.
+         * \param   host_path       Path of the file to copy on the host.
+         * \param   size            Size of the host file, in bytes.
+         *
+         * \returns True on success.
+         */
+        bool add_file(const std::string &image_path, const std::string &host_path, const std::uint32_t size,
+            const std::uint16_t date = 0, const std::uint16_t time = 0);
+
+        /**
+         * \brief   Add a file with its content given in memory.
+         * \returns True on success.
+         */
+        bool add_file(const std::string &image_path, std::vector<std::uint8_t> content,
+            const std::uint16_t date = 0, const std::uint16_t time = 0);
+
+        /**
+         * \brief   Compute geometry, short names and cluster layout for everything added.
+         *
+         * Called by write() if needed. Any add after this invalidates the plan.
+         *
+         * \returns True on success. False if the content can't fit a FAT16 image
+         *          with the requested options.
+         */
+        bool plan();
+
+        /**
+         * \brief   Get the boot block of the planned image.
+         */
+        const BootBlock &get_boot_block() const {
+            return boot_block;
+        }
+
+        /**
+         * \brief   Get size of the planned image in bytes.
+         */
+        std::uint64_t image_size() const;
+
+        /**
+         * \brief   Write the planned image, front to back.
+         *
+         * \param   userdata        Passed to the write callback.
+         * \param   write_func      Called with large, sequential chunks of the image.
+         * \param   truncate_func   Optional. If set, the free space at the end is not written, the
+         *                          image is grown to its full size with it instead, which leaves a
+         *                          hole on filesystems with sparse files. Zeros are written if it fails.
+         *
+         * \returns True on success. False on a write or host read failure.
+         */
+        bool write(void *userdata, ImageWriteFunc write_func, ImageTruncateFunc truncate_func = nullptr);
+    };
+}
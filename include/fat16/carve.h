@@ -0,0 +1,55 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief Magic number a file type starts with.
+     */
+    struct CarveSignature {
+        std::string name;
+        std::vector<std::uint8_t> magic;            ///< From 2 to 16 bytes, matched at the start of a cluster.
+    };
+
+    /**
+     * \brief   Get the built-in signatures: JPEG, PNG, GIF, ZIP, PDF, ELF and gzip.
+     */
+    const std::vector<CarveSignature> &get_default_signatures();
+
+    struct CarveMatch {
+        ClusterID cluster;                          ///< Free cluster the signature was found at.
+        std::uint32_t signature;                    ///< Index in the signature list.
+        std::uint32_t free_run;                     ///< Free clusters from this one on, an upper bound of the size.
+    };
+
+    /**
+     * \brief   Called for every free cluster a signature starts in, in cluster order. Return false to stop.
+     */
+    typedef bool (*CarveMatchFunc)(void *userdata, const CarveMatch &match);
+
+    struct CarveOptions {
+        std::uint32_t batch_size;                   ///< Bytes of free clusters read at once.
+
+        explicit CarveOptions()
+            : batch_size(0x400000) {
+        }
+    };
+
+    /**
+     * \brief   Look for file signatures at the start of every free cluster.
+     *
+     * Free clusters come from the cached FAT, and runs of them are read in large batches,
+     * so allocated space is never read. Files start on a cluster boundary, so only the first
+     * bytes of each cluster are matched. The first two bytes of 16 clusters at a time are
+     * looked up in nibble tables with SIMD shuffles, which filters every signature at once,
+     * and only the clusters that pass are compared in full.
+     *
+     * \returns True if the scan went through. False on a read error, or an invalid signature.
+     */
+    bool carve_free_clusters(Image &img, const std::vector<CarveSignature> &signatures, CarveMatchFunc match_func,
+        void *userdata, const CarveOptions &options = CarveOptions());
+}
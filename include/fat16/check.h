@@ -0,0 +1,84 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    enum class CheckIssueType {
+        CROSS_LINKED,                               ///< The cluster is reached by a second chain, or twice by one.
+        BAD_CHAIN,                                  ///< The chain runs into a free, bad or out of range cluster, or loops.
+        SIZE_MISMATCH,                              ///< The chain length does not fit the file size.
+        LOST_CHAIN,                                 ///< Allocated clusters no entry leads to.
+        FAT_COPY_MISMATCH,                          ///< A FAT copy differs from the first one.
+        UNREADABLE_DIRECTORY                        ///< Part of the tree could not be read, so not everything was checked.
+    };
+
+    struct CheckIssue {
+        CheckIssueType type;
+        std::u16string path;                        ///< The entry at fault, '/' separated. Empty when no entry is.
+
+        /**
+         * \brief Where it went wrong.
+         *
+         * For CROSS_LINKED and BAD_CHAIN, the cluster met. For SIZE_MISMATCH and LOST_CHAIN, the
+         * first cluster of the chain. For FAT_COPY_MISMATCH, the first entry that differs.
+         */
+        ClusterID cluster;
+
+        /**
+         * \brief More on the issue.
+         *
+         * For SIZE_MISMATCH, the chain length in clusters. For LOST_CHAIN, its length. For
+         * FAT_COPY_MISMATCH, the copy number, from 1, in the high 16 bits and the number of
+         * entries that differ in the low ones. 0 otherwise.
+         */
+        std::uint32_t detail;
+    };
+
+    struct CheckReport {
+        std::vector<CheckIssue> issues;
+        std::uint32_t files;
+        std::uint32_t directories;
+        std::uint32_t allocated_clusters;           ///< Clusters in use in the FAT, bad ones excepted.
+        std::uint32_t reached_clusters;             ///< Clusters some entry leads to.
+        std::uint32_t lost_clusters;                ///< Allocated and not reached.
+
+        explicit CheckReport()
+            : files(0)
+            , directories(0)
+            , allocated_clusters(0)
+            , reached_clusters(0)
+            , lost_clusters(0) {
+        }
+
+        bool is_clean() const {
+            return issues.empty();
+        }
+    };
+
+    struct CheckOptions {
+        std::uint32_t threads;                      ///< For the directory walk. 0 to use one per hardware thread.
+
+        explicit CheckOptions()
+            : threads(0) {
+        }
+    };
+
+    /**
+     * \brief   Check the FAT and the directory tree for consistency. Nothing is repaired.
+     *
+     * The FAT is cached, and a linear pass over it counts how many links lead into each
+     * cluster. The tree is walked in parallel, each entry following its chain in the cached
+     * FAT and claiming its clusters, so a cluster claimed twice is cross-linked. Clusters left
+     * unclaimed are lost, and the ones nothing links into start a lost chain. The other FAT
+     * copies are compared with the first one block by block.
+     *
+     * Issues are sorted by type, then path.
+     *
+     * \returns True if the check ran. False if the FAT could not be read.
+     */
+    bool check_image(Image &img, CheckReport &report, const CheckOptions &options = CheckOptions());
+}
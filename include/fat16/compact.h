@@ -0,0 +1,61 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+
+namespace Fat16 {
+    struct CompactOptions {
+        std::uint32_t buffer_size;                  ///< Bytes read then written at once when moving data.
+        std::uint32_t min_clusters;                 ///< Never go below this many clusters. Below 4085 tools take it for FAT12.
+        std::uint32_t spare_clusters;               ///< Free clusters to keep after the data.
+
+        explicit CompactOptions()
+            : buffer_size(0x400000)
+            , min_clusters(4085)
+            , spare_clusters(0) {
+        }
+    };
+
+    struct CompactResult {
+        std::uint32_t old_size;                     ///< Size of the image before, in bytes.
+        std::uint32_t new_size;                     ///< Size the image was, or has to be, truncated to.
+        std::uint32_t old_clusters;
+        std::uint32_t new_clusters;
+        std::uint16_t old_blocks_per_fat;
+        std::uint16_t new_blocks_per_fat;
+        std::uint32_t clusters_moved;
+        bool truncated;                             ///< False if the image has no truncate hook, the caller has to cut it.
+
+        explicit CompactResult()
+            : old_size(0)
+            , new_size(0)
+            , old_clusters(0)
+            , new_clusters(0)
+            , old_blocks_per_fat(0)
+            , new_blocks_per_fat(0)
+            , clusters_moved(0)
+            , truncated(false) {
+        }
+    };
+
+    /**
+     * \brief   Slide every used cluster toward the start of the data region, then shrink the image.
+     *
+     * Clusters keep their order, so all data moves down in a single ascending pass of large
+     * sequential reads and writes, and nothing is overwritten before it was read. The FAT is
+     * resized to the clusters left, which moves the root directory and the data region down
+     * as well, then rewritten from the cached copy, one sequential write per FAT copy. Chains
+     * and starting clusters, dot entries included, are renumbered, and the boot block gets the
+     * new block count.
+     *
+     * The image is then cut through Image::truncate_func, if set. Clusters marked bad stay
+     * where they are and data goes around them, those past the new end are dropped. So that
+     * they keep pointing at the same sectors, the FAT is not shrunk on a volume that has any.
+     *
+     * Runs in place and is not crash safe: an image whose compaction was interrupted is lost.
+     *
+     * \returns True on success. False on a read or write error, or if the image is read-only.
+     */
+    bool compact(Image &img, CompactResult &result, const CompactOptions &options = CompactOptions());
+}
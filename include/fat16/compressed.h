@@ -0,0 +1,161 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Fat16 {
+    /*
+     * Seekable gzip container
+     *
+     * The image is cut into frames of a fixed size, each compressed as its own gzip member, so
+     * any frame can be inflated without the ones before it. After the frames come empty gzip
+     * members whose extra field ('F', 'I' subfields) lists the compressed size of every frame,
+     * then a last empty member, always COMPRESSED_TAIL_SIZE bytes, whose 'F', 'T' subfield gives
+     * where that table starts, the frame count, the frame size and the image size.
+     *
+     * Empty members add nothing to the output, so plain gunzip still gives back the image.
+     */
+    static constexpr std::uint32_t COMPRESSED_TAIL_SIZE = 50;
+
+    struct CompressOptions {
+        std::uint32_t frame_size;                   ///< Bytes of image per frame. Smaller is faster to seek, but compresses worse.
+        int level;                                  ///< zlib compression level, 1 to 9.
+
+        explicit CompressOptions()
+            : frame_size(0x40000)
+            , level(6) {
+        }
+    };
+
+    /**
+     * \brief Write an image to a seekable gzip container, as a stream.
+     *
+     * The output only goes forward, so it can be a pipe. Bytes are taken in any chunk size,
+     * including from ImageBuilder::write() through write_hook.
+     */
+    struct CompressedImageWriter {
+    private:
+        void *userdata;
+        ImageWriteFunc write_func;
+        CompressOptions options;
+
+        std::vector<std::uint8_t> frame;
+        std::uint32_t filled;
+        std::vector<std::uint8_t> output;
+        std::vector<std::uint32_t> frame_sizes;     ///< Compressed size of every frame written.
+        std::uint64_t written;
+        std::uint64_t image_size;
+        bool failed;
+
+        bool put(const void *data, const std::uint32_t bytes);
+        bool compress_frame();
+
+    public:
+        explicit CompressedImageWriter(void *userdata, ImageWriteFunc write_func, const CompressOptions &options = CompressOptions());
+
+        /**
+         * \brief   Append image bytes.
+         * \returns True on success.
+         */
+        bool write(const void *data, std::uint32_t bytes);
+
+        /**
+         * \brief   Compress what's left and write the frame table. Nothing can be written after.
+         * \returns True if the whole container was written. Always false when built without zlib.
+         */
+        bool finish();
+
+        /**
+         * \brief   Get the number of bytes written to the output so far.
+         */
+        std::uint64_t compressed_size() const {
+            return written;
+        }
+
+        static std::uint32_t write_hook(void *userdata, const void *buffer, std::uint32_t bytes);
+    };
+
+    struct CompressedReadOptions {
+        std::uint32_t cache_frames;                 ///< Inflated frames kept, most recently used first.
+
+        explicit CompressedReadOptions()
+            : cache_frames(64) {
+        }
+    };
+
+    struct CompressedReadStats {
+        std::uint64_t reads;
+        std::uint64_t frames_inflated;
+        std::uint64_t cache_hits;                   ///< Frames a read found already inflated.
+    };
+
+    /**
+     * \brief Read-only image backend over a seekable gzip container.
+     *
+     * Only the tail and the frame table are read when it is opened. A read then inflates just
+     * the frames covering it, and keeps them in a small LRU cache, so reading one file out of
+     * a large image touches a handful of frames. Compressed bytes are read with pread, and
+     * reads may come from several threads at once.
+     */
+    struct CompressedImage {
+    private:
+        struct CachedFrame {
+            std::uint32_t index;
+            std::shared_ptr<const std::vector<std::uint8_t>> data;
+        };
+
+        int fd;
+        std::uint32_t cursor;
+        std::uint32_t frame_size;
+        std::uint32_t image_size;
+        std::vector<std::uint64_t> frame_offsets;   ///< Where each frame starts in the container, plus the end of the last one.
+
+        CompressedReadOptions options;
+        std::mutex lock;
+        std::list<CachedFrame> cache;               ///< Most recently used first.
+        std::unordered_map<std::uint32_t, std::list<CachedFrame>::iterator> cache_index;
+        CompressedReadStats stats;
+
+        bool read_index(const std::uint64_t file_size);
+        std::shared_ptr<const std::vector<std::uint8_t>> get_frame(const std::uint32_t index);
+
+    public:
+        explicit CompressedImage(const CompressedReadOptions &options = CompressedReadOptions());
+        ~CompressedImage();
+
+        CompressedImage(const CompressedImage&) = delete;
+        CompressedImage &operator=(const CompressedImage&) = delete;
+
+        /**
+         * \brief   Open a container and load its frame table.
+         * \returns True on success. False if the file is not a seekable gzip container, or
+         *          always when built without zlib or POSIX file descriptors.
+         */
+        bool open(const char *path);
+
+        void close();
+
+        /**
+         * \brief   Set the positional read hook of an image using this container.
+         */
+        void attach(Image &img);
+
+        std::uint32_t get_size() const {
+            return image_size;
+        }
+
+        std::uint32_t read(void *dest, const std::uint32_t offset, const std::uint32_t bytes);
+
+        CompressedReadStats get_stats();
+
+        static std::uint32_t read_hook(void *userdata, void *buffer, std::uint32_t bytes);
+        static std::uint32_t seek_hook(void *userdata, std::uint32_t offset, int mode);
+        static std::uint32_t read_at_hook(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t bytes);
+    };
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Fat16 {
+    #pragma pack(push, 1)
+    struct ChunkDigest {
+        std::uint8_t bytes[32];                     ///< SHA-256 of the chunk.
+
+        bool operator==(const ChunkDigest &other) const;
+    };
+
+    /**
+     * \brief One chunk in the store, as listed in its chunk table file.
+     */
+    struct ChunkRecord {
+        ChunkDigest digest;
+        std::uint64_t offset;                       ///< Where its bytes are in the pack file.
+        std::uint32_t size;
+        std::uint32_t reserved;
+    };
+
+    struct RecipeHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entry_count;
+        std::uint64_t image_size;
+    };
+
+    /**
+     * \brief A piece of an image: a chunk of the store, or zeros.
+     */
+    struct RecipeEntry {
+        std::uint32_t chunk;                        ///< Index in the chunk table. DEDUP_ZEROS for zeros.
+        std::uint32_t size;
+    };
+    #pragma pack(pop)
+
+    static constexpr std::uint32_t DEDUP_ZEROS = 0xFFFFFFFF;
+
+    struct ChunkDigestHash {
+        std::size_t operator()(const ChunkDigest &digest) const;
+    };
+
+    struct DedupSource {
+        std::string image_path;
+        std::string name;                           ///< Recipe name, used as a file name in the store.
+    };
+
+    struct DedupOptions {
+        std::uint32_t threads;                      ///< Images worked on at once. 0 for one per hardware thread.
+        std::uint32_t batch_size;                   ///< Bytes of an image read, then hashed, at once.
+        bool keep_free_space;                       ///< Store free clusters too. Otherwise they come back as zeros.
+
+        explicit DedupOptions()
+            : threads(0)
+            , batch_size(0x400000)
+            , keep_free_space(false) {
+        }
+    };
+
+    struct DedupStats {
+        std::uint32_t images_added;
+        std::uint32_t images_failed;                ///< Could not be opened or read. No recipe is written for them.
+        std::uint64_t chunks;                       ///< Chunks met, zeros excepted.
+        std::uint64_t new_chunks;                   ///< Chunks the store did not hold yet.
+        std::uint64_t bytes;                        ///< Image bytes covered, zeros included.
+        std::uint64_t zero_bytes;
+        std::uint64_t new_bytes;                    ///< Bytes added to the pack file.
+
+        explicit DedupStats()
+            : images_added(0)
+            , images_failed(0)
+            , chunks(0)
+            , new_chunks(0)
+            , bytes(0)
+            , zero_bytes(0)
+            , new_bytes(0) {
+        }
+    };
+
+    /**
+     * \brief Content addressed store of image chunks, with one recipe per image to rebuild it.
+     *
+     * Images are cut into chunks the size of their clusters, aligned on their clusters in the
+     * data region: the same file data in two images makes the same chunks. Every distinct chunk
+     * is kept once in an append-only pack file, and known by its SHA-256. A recipe lists the
+     * chunks of an image in order, with zeros and free clusters as runs of zeros.
+     *
+     * The store is a directory holding the pack, the chunk table, and one file per recipe.
+     * The chunk table is read whole when the store is opened.
+     */
+    struct DedupStore {
+    private:
+        struct PendingChunk;
+
+        std::string directory;
+        FILE *pack;
+        FILE *table;
+        std::uint64_t pack_size;
+
+        std::mutex lock;
+        std::vector<ChunkRecord> chunks;
+        std::unordered_map<ChunkDigest, std::uint32_t, ChunkDigestHash> chunk_ids;
+
+        bool add_image(const DedupSource &source, const DedupOptions &options, DedupStats &stats);
+        bool store_chunks(const std::uint8_t *data, const std::vector<PendingChunk> &pending, std::vector<RecipeEntry> &recipe,
+            DedupStats &stats);
+
+    public:
+        explicit DedupStore();
+        ~DedupStore();
+
+        DedupStore(const DedupStore&) = delete;
+        DedupStore &operator=(const DedupStore&) = delete;
+
+        /**
+         * \brief   Open the store in an existing directory, starting an empty one if there is none.
+         * \returns True on success.
+         */
+        bool open(const std::string &directory);
+
+        void close();
+
+        /**
+         * \brief   Add images to the store and write their recipes, several images at once.
+         *
+         * Each worker reads an image in large sequential batches (holes of sparse files and free
+         * clusters without I/O) and hashes a batch while the other workers read theirs. Only new
+         * chunks are appended to the pack, under a lock taken once per batch.
+         *
+         * \returns True if every image was added.
+         */
+        bool add_images(const std::vector<DedupSource> &sources, DedupStats &stats, const DedupOptions &options = DedupOptions());
+
+        /**
+         * \brief   Rebuild an image from its recipe, front to back.
+         *
+         * Chunks stored next to each other in the pack are read at once. Not to be called while
+         * add_images() runs.
+         *
+         * \returns True on success. False if there is no such recipe, or on a read or write failure.
+         */
+        bool restore(const std::string &name, void *userdata, ImageWriteFunc write_func);
+
+        std::uint32_t chunk_count() const {
+            return static_cast<std::uint32_t>(chunks.size());
+        }
+
+        std::uint64_t stored_bytes() const {
+            return pack_size;
+        }
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+
+namespace Fat16 {
+    struct FragmentationStats {
+        std::uint32_t files;                        ///< Files with data.
+        std::uint32_t fragmented_files;             ///< Files in more than one run.
+        std::uint64_t extents;                      ///< Runs over every file. One per file when nothing is fragmented.
+        std::uint64_t clusters;
+
+        explicit FragmentationStats()
+            : files(0)
+            , fragmented_files(0)
+            , extents(0)
+            , clusters(0) {
+        }
+
+        /**
+         * \brief Get the number of seeks a full read of every file takes, beyond one per file.
+         */
+        std::uint64_t extra_seeks() const {
+            return extents - files;
+        }
+    };
+
+    /**
+     * \brief   Measure how fragmented the files of an image are.
+     *
+     * Taken from the file stats of analyze_layout().
+     *
+     * \returns True on success.
+     */
+    bool get_fragmentation_stats(Image &img, FragmentationStats &stats);
+
+    struct DefragProgress {
+        std::uint32_t files_moved;
+        std::uint32_t files_planned;                ///< Fragmented files, each moved at most once.
+        std::uint64_t clusters_moved;
+        std::uint64_t clusters_planned;
+        const std::u16string *path;                 ///< The file just moved. Null for the last report.
+    };
+
+    /**
+     * \brief   Called after every file moved. Return false to stop after it, the image stays consistent.
+     */
+    typedef bool (*DefragProgressFunc)(void *userdata, const DefragProgress &progress);
+
+    struct DefragOptions {
+        std::uint32_t buffer_size;                  ///< Bytes read then written at once when copying.
+
+        explicit DefragOptions()
+            : buffer_size(0x100000) {
+        }
+    };
+
+    struct DefragResult {
+        FragmentationStats before;
+        FragmentationStats after;
+        std::uint32_t files_moved;
+        std::uint64_t clusters_moved;
+        std::uint32_t files_left;                   ///< Fragmented files no free run was large enough for.
+        std::uint32_t files_stopped;                ///< Fragmented files not moved because the progress callback stopped the run.
+
+        explicit DefragResult()
+            : files_moved(0)
+            , clusters_moved(0)
+            , files_left(0)
+            , files_stopped(0) {
+        }
+    };
+
+    /**
+     * \brief   Rewrite fragmented files into contiguous runs, offline.
+     *
+     * Files already in one run are left where they are, and each fragmented file is moved at
+     * most once, into the smallest free run that holds it, biggest files first. Its data is
+     * copied with large sequential reads and writes, then its chain and starting cluster are
+     * updated, then its old clusters are freed.
+     *
+     * Metadata is flushed after every pass, and clusters freed in a pass are only reused in
+     * the next one, so the image on disk is consistent at all times. Passes go on while files
+     * keep fitting in the space freed. Directories are not moved.
+     *
+     * \returns True on success. False on a read or write error, or if the image is read-only.
+     */
+    bool defragment(Image &img, DefragResult &result, DefragProgressFunc progress_func = nullptr, void *userdata = nullptr,
+        const DefragOptions &options = DefragOptions());
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    enum class DiffKind {
+        ADDED = 0,
+        REMOVED = 1,
+        MODIFIED = 2,                               ///< Content differs.
+        METADATA = 3                                ///< Same content, other date, time or attributes.
+    };
+
+    struct DiffEntry {
+        std::u16string path;                        ///< '/' separated, without a leading '/'.
+        DiffKind kind;
+        bool is_directory;
+        FundamentalEntry old_entry;                 ///< Zeroed for an added entry.
+        FundamentalEntry new_entry;                 ///< Zeroed for a removed entry.
+    };
+
+    struct DiffOptions {
+        std::uint32_t threads;                      ///< 0 to use one per hardware thread.
+        std::uint32_t chunk_size;                   ///< Bytes read at once when comparing, per image and thread.
+        bool trust_extents;                         ///< Take files with the same size and runs as equal, without reading them.
+
+        explicit DiffOptions()
+            : threads(0)
+            , chunk_size(0x100000)
+            , trust_extents(false) {
+        }
+    };
+
+    struct DiffStats {
+        std::uint32_t directories;                  ///< Directory pairs, or lone directories, looked at.
+        std::uint32_t files_compared;               ///< Files in both images with the same size.
+        std::uint32_t same_extents;                 ///< Of those, stored in the same runs, compared in place.
+        std::uint32_t hashed;                       ///< Of those, stored elsewhere, compared by digest.
+        std::uint64_t bytes_read;                   ///< File bytes read, over both images.
+
+        explicit DiffStats()
+            : directories(0)
+            , files_compared(0)
+            , same_extents(0)
+            , hashed(0)
+            , bytes_read(0) {
+        }
+    };
+
+    struct DiffResult {
+        std::vector<DiffEntry> changes;             ///< Sorted by path. Everything under an added or removed directory is listed.
+        DiffStats stats;
+    };
+
+    /**
+     * \brief   Compare two images, file by file.
+     *
+     * Both trees are walked in lockstep: each directory of one is read whole together with its
+     * counterpart in the other, entries are matched by case folded name, and matching
+     * subdirectories are handed to a pool of threads as new pairs.
+     *
+     * Files of different sizes differ without reading anything. Files stored in the same runs
+     * of two images with the same geometry, as after an image is patched in place, are compared
+     * cluster against cluster, stopping at the first difference. Other files are hashed from
+     * both images with SHA-256 and their digests compared.
+     *
+     * Without Image::read_at_func on both images everything runs on the calling thread. The
+     * images must not be written to meanwhile.
+     *
+     * \returns True on success. False if a directory could not be read.
+     */
+    bool diff_images(Image &old_img, Image &new_img, DiffResult &result, const DiffOptions &options = DiffOptions());
+}
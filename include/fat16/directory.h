@@ -0,0 +1,102 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief What a 32 byte directory slot holds.
+     */
+    enum SlotClass : std::uint8_t {
+        SLOT_END = 0,                               ///< Unused, and so is every slot after it.
+        SLOT_DELETED = 1,
+        SLOT_LONG_NAME = 2,                         ///< A part of a long name, deleted or not.
+        SLOT_VOLUME_LABEL = 3,
+        SLOT_DOT = 4,                               ///< The . and .. entries.
+        SLOT_ENTRY = 5                              ///< A live file or directory.
+    };
+
+    /**
+     * \brief Classify directory slots, several at a time with SIMD where the CPU has it.
+     *
+     * \param   slots       The slots, 32 bytes each.
+     * \param   count       Number of slots.
+     * \param   classes     Receives one SlotClass per slot.
+     */
+    void classify_slots(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes);
+
+    /**
+     * \brief Slots one entry takes in a directory.
+     */
+    struct DirectoryRecord {
+        std::uint32_t slot;                         ///< Index of the 8.3 record.
+        std::uint32_t long_name_slot;               ///< Index of the first LFN slot, which holds the end of the name.
+        std::uint32_t long_name_count;              ///< 0 if the entry has no long name.
+        std::uint32_t discarded_long_name_slots;    ///< LFN slots right before the name that belong to nothing.
+    };
+
+    /**
+     * \brief A whole directory read into memory, so its records can be looked at in place.
+     */
+    struct DirectoryBuffer {
+        std::vector<std::uint8_t> data;
+        std::vector<std::uint8_t> classes;          ///< SlotClass of every slot, filled by read().
+        std::vector<Extent> extents;                ///< Runs the directory is stored in. Empty for the root.
+        std::uint32_t root_offset;                  ///< Offset of the root directory in the image. 0 for others.
+
+        explicit DirectoryBuffer()
+            : root_offset(0) {
+        }
+
+        /**
+         * \brief   Read a directory with as few reads as its layout allows, then classify its slots.
+         *
+         * \param   cluster     First cluster of the directory. 0 for the root.
+         *
+         * \returns True on success.
+         */
+        bool read(Image &img, const ClusterID cluster);
+
+        std::uint32_t slot_count() const {
+            return static_cast<std::uint32_t>(data.size() / sizeof(FundamentalEntry));
+        }
+
+        const FundamentalEntry *get_record(const std::uint32_t slot) const {
+            return reinterpret_cast<const FundamentalEntry*>(data.data() + slot * sizeof(FundamentalEntry));
+        }
+
+        const LongFileNameEntry *get_long_name(const DirectoryRecord &record) const {
+            return record.long_name_count ? reinterpret_cast<const LongFileNameEntry*>(data.data()
+                + record.long_name_slot * sizeof(FundamentalEntry)) : nullptr;
+        }
+
+        /**
+         * \brief   Get offset in the image of a slot.
+         */
+        std::uint32_t get_slot_offset(const Image &img, const std::uint32_t slot) const;
+
+        /**
+         * \brief   Find the next entry, skipping deleted ones, dot entries and volume labels.
+         *
+         * \param   slot    Slot to look from. Moved past the entry found.
+         *
+         * \returns True if an entry was found. False at the end of the directory.
+         */
+        bool next_record(std::uint32_t &slot, DirectoryRecord &record) const;
+    };
+
+    /**
+     * \brief   Get offset in the image of a byte of data stored in the given runs.
+     * \returns The offset, or 0 past the end of the runs.
+     */
+    std::uint32_t get_extent_offset(const Image &img, const std::vector<Extent> &extents, const std::uint32_t position);
+
+    /**
+     * \brief Append the name of an entry: its long name if it has one, its 8.3 name otherwise.
+     */
+    void append_filename(const FundamentalEntry &entry, const LongFileNameEntry *long_name, const std::uint32_t long_name_count,
+        std::u16string &dest);
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <map>
 #include <string>
-
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace Fat16 {
@@ -33,6 +36,11 @@ namespace Fat16 {
         std::uint32_t fat_region_start() const;
         std::uint32_t root_directory_region_start() const;
         std::uint32_t data_region_start() const;
+
+        /**
+         * \brief Get total number of blocks in the image, from whichever option is filled.
+         */
+        std::uint32_t total_blocks() const;
     };
     #pragma pack(pop)
     
@@ -86,6 +94,22 @@ namespace Fat16 {
     // Numbered from 2
     using ClusterID = std::uint16_t;
 
+    enum ClusterMarker : ClusterID {
+        CLUSTER_FREE = 0x0000,
+        CLUSTER_FIRST_VALID = 0x0002,
+        CLUSTER_BAD = 0xFFF7,
+        CLUSTER_END_OF_CHAIN_MIN = 0xFFF8,     ///< Any value from this one up ends a chain.
+        CLUSTER_END_OF_CHAIN = 0xFFFF
+    };
+
+    /**
+     * \brief A run of physically contiguous clusters.
+     */
+    struct Extent {
+        ClusterID first;
+        std::uint32_t count;                    ///< Number of clusters in the run.
+    };
+
     struct Entry {
     private:
         friend struct Image;
@@ -96,17 +120,46 @@ namespace Fat16 {
         FundamentalEntry entry;
         std::vector<LongFileNameEntry> extended_entries;
 
+        /**
+         * \brief LFN slots found right before this entry that were not a valid long name for it.
+         * 
+         * They are left out of extended_entries. Non zero points at a damaged directory.
+         */
+        std::uint32_t discarded_long_name_slots;
+
         explicit Entry()
             : cursor_record(0)
-            , root(0) {
+            , root(0)
+            , discarded_long_name_slots(0) {
         }
 
         std::u16string get_filename();
+
+        /**
+         * \brief Check if the entry has the given name, long or 8.3, case insensitive.
+         * 
+         * Compared in place against the slots, nothing is allocated.
+         */
+        bool matches_name(const char16_t *name, const std::size_t length) const;
+
+        bool matches_name(const std::u16string_view name) const {
+            return matches_name(name.data(), name.length());
+        }
     };
 
     // These functions all required return value to be little-endian.
     typedef std::uint32_t (*ImageReadFunc)(void *userdata, void *buffer, std::uint32_t bytes);
     typedef std::uint32_t (*ImageSeekFunc)(void *userdata, std::uint32_t offset, int mode);
+    typedef std::uint32_t (*ImageWriteFunc)(void *userdata, const void *buffer, std::uint32_t bytes);
+
+    // Positional read, like pread. Must not move the cursor used by the read and seek hooks.
+    typedef std::uint32_t (*ImageReadAtFunc)(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t bytes);
+
+    // Resize the image, like ftruncate. Returns true on success.
+    typedef bool (*ImageTruncateFunc)(void *userdata, std::uint32_t size);
+
+    // Drop the content of a range, which then reads as zeros, like punching a hole. Returns true on success.
+    typedef bool (*ImageDiscardFunc)(void *userdata, std::uint32_t offset, std::uint32_t bytes);
 
     enum ImageSeekMode {
         IMAGE_SEEK_MODE_BEG,
@@ -118,9 +171,37 @@ namespace Fat16 {
         BootBlock boot_block;
         ImageReadFunc read_func;
         ImageSeekFunc seek_func;
+        ImageWriteFunc write_func;                  ///< Null if the image is read-only.
+
+        /**
+         * \brief Optional positional read hook. Null to seek then read.
+         * 
+         * When set, reads no longer share a cursor, so several threads can read the image
+         * at once, as long as nothing writes to it.
+         */
+        ImageReadAtFunc read_at_func;
+
+        /**
+         * \brief Optional hook to cut or grow the image. Null if its size is fixed.
+         */
+        ImageTruncateFunc truncate_func;
+
+        /**
+         * \brief Optional hook to drop the content of clusters once they are free. Null to leave it.
+         * 
+         * Clusters freed by free_chain() are handed to it by the flush() that writes their FAT
+         * entries, if they are still free by then.
+         */
+        ImageDiscardFunc discard_func;
         void *userdata;
 
-        explicit Image(void *userdata, ImageReadFunc read_func, ImageSeekFunc seek_func);
+        /**
+         * \brief In-memory copy of the first FAT. Empty until cache_fat() is called.
+         */
+        std::vector<ClusterID> fat_cache;
+
+        explicit Image(void *userdata, ImageReadFunc read_func, ImageSeekFunc seek_func,
+            ImageWriteFunc write_func = nullptr);
 
         /**
          * \brief Get the next entry to given entry.
@@ -135,11 +216,57 @@ namespace Fat16 {
          */
         bool get_first_entry_dir(Entry &parent, Entry &first);
 
+        /**
+         * \brief   Get offset in the image of the 8.3 record of the entry last returned by get_next_entry().
+         * \returns The offset, or 0 if it can't be located.
+         */
+        std::uint32_t get_entry_offset(const Entry &entry);
+
         /**
          * \brief Get total of bytes a cluster consists of.
          */
         std::uint32_t bytes_per_cluster() const;
 
+        /**
+         * \brief Get number of clusters in the data region.
+         * 
+         * Valid cluster IDs go from 2 to total_clusters() + 1.
+         */
+        std::uint32_t total_clusters() const;
+
+        /**
+         * \brief Get one past the last valid cluster ID, total_clusters() + 2.
+         * 
+         * Never more than the FAT has entries, so fat_cache can be indexed below it.
+         */
+        std::uint32_t cluster_limit() const {
+            return total_clusters() + CLUSTER_FIRST_VALID;
+        }
+
+        /**
+         * \brief   Read the whole first FAT into fat_cache with a single read.
+         * 
+         * Once cached, successor lookups no longer touch the image.
+         * 
+         * \returns True on success.
+         */
+        bool cache_fat();
+
+        /**
+         * \brief   Get offset of the first byte of a cluster in the image.
+         */
+        std::uint32_t cluster_offset(const ClusterID cluster) const;
+
+        /**
+         * \brief   Collect the runs of physically contiguous clusters a chain is made of.
+         * 
+         * \param   starting_cluster  The first cluster of the chain.
+         * \param   extents           Receives the runs, in chain order.
+         * 
+         * \returns True on success. False if the chain leaves the data region or loops.
+         */
+        bool get_extents(const ClusterID starting_cluster, std::vector<Extent> &extents);
+
         /**
          * \brief   Reading data from the FAT image, starting at given cluster.
          * 
@@ -152,6 +279,12 @@ namespace Fat16 {
         std::uint32_t read_from_cluster(std::uint8_t *dest_buffer, const std::uint32_t offset,
             const ClusterID starting_cluster, const std::uint32_t size);
 
+        /**
+         * \brief   Read from the image at the given offset, seeing unflushed writes.
+         * \returns Number of bytes read.
+         */
+        std::uint32_t read_at(const std::uint32_t offset, void *dest, const std::uint32_t size);
+
         /**
          * \brief Get the read cursor of current image.
          * \internal
@@ -164,8 +297,163 @@ namespace Fat16 {
          * \returns Successor cluster ID.
          */
         ClusterID get_successor_cluster(const ClusterID target);
+
+        /**
+         * \brief   Check if the given FAT value terminates a chain.
+         */
+        static bool is_end_of_chain(const ClusterID value);
+
+        /**
+         * \brief   Set the successor of a cluster in the FAT.
+         * 
+         * The change goes to the cached FAT (if any) and to the dirty block cache. Nothing
+         * is written to the image until flush(), which mirrors it to every FAT copy.
+         * 
+         * \returns True on success.
+         */
+        bool set_successor_cluster(const ClusterID target, const ClusterID next);
+
+        /**
+         * \brief   Link the given runs into one chain, terminated by an end-of-chain marker.
+         * \returns True on success.
+         */
+        bool link_chain(const std::vector<Extent> &extents);
+
+        /**
+         * \brief   Mark every cluster of the chain starting at given cluster as free.
+         * \returns True on success.
+         */
+        bool free_chain(const ClusterID starting_cluster);
+
+        /**
+         * \brief   Buffer a write to the metadata area (boot block, FAT or directories).
+         * 
+         * Touched blocks are read once, patched and kept in the dirty block cache. Reads
+         * done through this image see the buffered content.
+         * 
+         * \returns True on success.
+         */
+        bool write_metadata(const std::uint32_t offset, const void *data, const std::uint32_t size);
+
+        /**
+         * \brief   Write file data straight to the image, for large sequential writes.
+         * 
+         * Nothing is buffered. Dirty blocks in the range are patched as well, so a later
+         * flush() doesn't bring back their old content.
+         * 
+         * \returns True on success.
+         */
+        bool write_data(const std::uint32_t offset, const void *data, const std::uint32_t size);
+
+        /**
+         * \brief   Write all dirty blocks back to the image.
+         * 
+         * Blocks are written in ascending order, with adjacent blocks coalesced into a single
+         * write. Dirty FAT blocks are written once per FAT copy, one sequential pass per copy.
+         * Clusters freed since the last flush then go to the discard hook, if any.
+         * 
+         * \returns True on success. On failure, the dirty blocks are kept.
+         */
+        bool flush();
+
+        /**
+         * \brief   Check if there are writes that have not been flushed yet.
+         */
+        bool has_pending_writes() const {
+            return !dirty_blocks.empty();
+        }
+
+        /**
+         * \brief   Find an entry of a directory by name, case insensitive, long or 8.3 name.
+         * 
+         * The first search in a directory reads it whole and hashes every name in it. Later
+         * searches in it are a hash lookup, plus reading the slots of the entry found. The
+         * hash is dropped when write_metadata() touches the directory or its chain.
+         * 
+         * \param   directory   First cluster of the directory. 0 for the root.
+         * \param   found       Receives the entry, as get_next_entry() would have returned it.
+         * 
+         * \returns True if the entry exists.
+         */
+        bool find_entry(const ClusterID directory, const std::u16string &name, Entry &found);
+
+        /**
+         * \brief   Drop every name hash built by find_entry().
+         * 
+         * Only needed if the image is changed other than through this object.
+         */
+        void drop_name_indexes() {
+            name_indexes.clear();
+        }
+
+    private:
+        struct NameIndex {
+            std::unordered_map<std::u16string, std::uint64_t> slots;        ///< Folded name -> 8.3 slot, and LFN slot count above 32 bits.
+            std::vector<Extent> extents;                                    ///< Empty for the root.
+        };
+
+        std::map<std::uint32_t, std::vector<std::uint8_t>> dirty_blocks;    ///< Block index -> block content.
+        std::map<ClusterID, NameIndex> name_indexes;                        ///< Directory first cluster -> its names.
+        std::vector<Extent> freed_extents;                                  ///< Freed since the last flush, to discard.
+
+        bool write_at(const std::uint32_t offset, const void *data, const std::uint32_t size);
+        bool flush_range(const std::vector<std::uint32_t> &blocks, const std::uint32_t shift);
+        void discard_freed_extents();
+        bool build_name_index(const ClusterID directory, NameIndex &index);
+        void invalidate_name_indexes(const std::uint32_t offset, const std::uint32_t size);
     };
 
+    /**
+     * \brief Compute the checksum LFN slots carry of the 8.3 name they belong to.
+     * 
+     * \param short_name The 11 bytes of the name, as stored.
+     */
+    std::uint8_t short_name_checksum(const char *short_name);
+
+    /**
+     * \brief   Find which of the LFN slots stored right before an 8.3 record make its long name.
+     * 
+     * A long name is a run of slots numbered down to 1, the first one flagged as the last
+     * part, all carrying the checksum of the 8.3 name. Slots before such a run belong to
+     * nothing.
+     * 
+     * \param   slots   The LFN slots, in the order they are stored.
+     * \param   count   Number of slots.
+     * \param   entry   The 8.3 record after them.
+     * 
+     * \returns Number of slots, at the end of the run, that make the long name. 0 if none.
+     */
+    std::uint32_t match_long_name(const LongFileNameEntry *slots, const std::uint32_t count, const FundamentalEntry &entry);
+
+    /**
+     * \brief   Check if an entry has the given name, long or 8.3, case insensitive.
+     * 
+     * Both names are compared straight from the slots, stopping at the first character
+     * that differs.
+     * 
+     * \param   long_name       LFN slots of the entry, in the order they are stored. Null if none.
+     * \param   long_name_count Number of LFN slots.
+     */
+    bool matches_name(const FundamentalEntry &entry, const LongFileNameEntry *long_name, const std::uint32_t long_name_count,
+        const char16_t *name, const std::size_t length);
+
+    /**
+     * \brief Fold a name character to upper case, the way FAT compares names.
+     * 
+     * Covers ASCII, Latin-1, Greek and Cyrillic, which is what the common OEM code pages hold.
+     */
+    char16_t fold_case(const char16_t c);
+
+    /**
+     * \brief Convert a UTF-16 string (as found in LFN entries) to UTF-8.
+     */
+    std::string utf16_to_utf8(const std::u16string &source);
+
+    /**
+     * \brief Convert a UTF-8 string to UTF-16.
+     */
+    std::u16string utf8_to_utf16(const std::string &source);
+
     static_assert(sizeof(BootBlock) == 512, "Boot block size doesn't match to what expected.");
     static_assert(sizeof(FundamentalEntry) == 32, "Fundamental entry size doesn't match to what expected.");
     static_assert(sizeof(LongFileNameEntry) == 32, "LFN entry size doesn't match to what expected.");
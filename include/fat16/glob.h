@@ -0,0 +1,108 @@
+#pragma once
+
+#include <fat16/fat16.h>
+#include <fat16/walker.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief A path pattern compiled once, for matching many entries.
+     *
+     * Components are separated by '/'. In a component, '*' matches any run of characters,
+     * '?' any one character, and "[a-z]" or "[!a-z]" a set of characters. A component
+     * that is only "**" matches any number of directories, none included. Matching is case
+     * insensitive, the way FAT names are.
+     *
+     * Components without wildcards match the long or the 8.3 name. Others are matched
+     * against the long name, or the 8.3 name when there is no long one.
+     */
+    struct GlobPattern {
+    private:
+        enum class TokenType {
+            CHARACTER,
+            ANY_ONE,
+            ANY_RUN,
+            SET
+        };
+
+        struct Token {
+            TokenType type;
+            char16_t character;                     ///< Folded. For CHARACTER only.
+            std::uint32_t set;                      ///< Index in sets. For SET only.
+        };
+
+        struct CharacterSet {
+            std::vector<std::pair<char16_t, char16_t>> ranges;  ///< Folded, inclusive.
+            bool negated;
+        };
+
+        struct Component {
+            bool any_depth;                         ///< The component is "**".
+            bool literal;                           ///< No wildcard, matched with matches_name().
+            std::u16string text;                    ///< The component, for literal ones.
+            std::vector<Token> tokens;
+        };
+
+        std::vector<Component> components;
+        std::vector<CharacterSet> sets;
+
+        bool match_tokens(const Component &component, const char16_t *name, const std::size_t length) const;
+
+    public:
+        /**
+         * \brief   Compile a pattern, UTF-8 encoded.
+         * \returns True if the pattern is valid. It may have up to 63 components.
+         */
+        bool compile(const std::string &pattern);
+
+        std::size_t component_count() const {
+            return components.size();
+        }
+
+        /**
+         * \brief   Advance a set of match states over one entry.
+         *
+         * Bit i of a state set means components before i are matched. Bit component_count()
+         * means the whole pattern is.
+         *
+         * \param   states  States in the directory holding the entry.
+         *
+         * \returns States after the entry: if the entry is a directory, the ones to look
+         *          inside it with. 0 if nothing under or at the entry can match.
+         */
+        std::uint64_t advance(const std::uint64_t states, const EntryView &view, std::u16string &scratch) const;
+
+        /**
+         * \brief   Get the states to start from, in the root directory.
+         */
+        std::uint64_t initial_states() const;
+
+        /**
+         * \brief   Check if a state set has the whole pattern matched.
+         */
+        bool is_match(const std::uint64_t states) const {
+            return (states >> components.size()) & 1;
+        }
+    };
+
+    /**
+     * \brief   Called for every entry that matches. Return false to stop the search.
+     */
+    typedef bool (*FindResultFunc)(void *userdata, const EntryView &view);
+
+    /**
+     * \brief   Find every entry of the image whose path matches a pattern.
+     *
+     * The tree is walked depth first, with each directory read whole. Directories are only
+     * opened when some part of the pattern can still match under them. Results are handed
+     * out as they are found, in directory order.
+     *
+     * \returns True if the search went through. False if a directory could not be read.
+     */
+    bool find(Image &img, const GlobPattern &pattern, FindResultFunc result_func, void *userdata);
+}
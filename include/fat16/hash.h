@@ -0,0 +1,95 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief   Update a CRC-32 (the zlib and gzip one) with more data.
+     *
+     * Folds 64 bytes at a time with carry-less multiplies where the CPU has PCLMULQDQ,
+     * slicing by 8 otherwise.
+     *
+     * \param   crc     0 to start, or the result of the previous call.
+     *
+     * \returns The CRC of everything so far.
+     */
+    std::uint32_t crc32(const std::uint32_t crc, const void *data, const std::size_t size);
+
+    /**
+     * \brief Incremental SHA-256. Uses the SHA extensions where the CPU has them.
+     */
+    struct Sha256 {
+    private:
+        std::uint32_t state[8];
+        std::uint8_t block[64];
+        std::uint64_t length;                       ///< Bytes hashed so far.
+
+    public:
+        explicit Sha256();
+
+        void update(const void *data, std::size_t size);
+
+        /**
+         * \brief Get the digest. The object must be reset before hashing again.
+         */
+        void finish(std::uint8_t digest[32]);
+
+        void reset();
+    };
+
+    struct FileDigest {
+        std::uint32_t crc32;
+        std::uint8_t sha256[32];
+    };
+
+    /**
+     * \brief   Hash a file straight from its clusters, both digests in the same pass.
+     *
+     * \param   buffer          Scratch space, reused across calls.
+     *
+     * \returns True on success. False if the chain is shorter than the file, or a read failed.
+     */
+    bool hash_file(Image &img, const FundamentalEntry &entry, FileDigest &digest, std::vector<std::uint8_t> &buffer);
+
+    struct HashedFile {
+        std::u16string path;                        ///< '/' separated, without a leading '/'.
+        FundamentalEntry entry;
+        std::uint32_t record_offset;                ///< Offset of the 8.3 record in the image.
+        FileDigest digest;
+        bool valid;                                 ///< False if the file could not be read whole. The digest is unset then.
+    };
+
+    /**
+     * \brief   Called once per file, in path order, from the calling thread. Return false to stop.
+     */
+    typedef bool (*HashResultFunc)(void *userdata, const HashedFile &file);
+
+    struct HashOptions {
+        std::uint32_t threads;                      ///< 0 to use one per hardware thread.
+        std::uint32_t chunk_size;                   ///< Bytes read and hashed at once, per thread.
+
+        explicit HashOptions()
+            : threads(0)
+            , chunk_size(0x40000) {
+        }
+    };
+
+    /**
+     * \brief   Hash every file of the image, files spread over a pool of threads.
+     *
+     * The tree is walked first to list the files. Workers then take files in cluster order,
+     * so the image is read mostly front to back, and hash each one in chunks small enough
+     * to stay in cache between the two digests. Nothing is written outside the image.
+     *
+     * Without Image::read_at_func everything runs on the calling thread.
+     *
+     * \returns True if every file was listed and the callback did not stop. Files that
+     *          could not be read are reported with valid unset and don't fail the call.
+     */
+    bool hash_files(Image &img, HashResultFunc result_func, void *userdata, const HashOptions &options = HashOptions());
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief What an index was built from. An index is only used for an image with the same key.
+     */
+    struct IndexKey {
+        std::uint64_t image_size;
+        std::uint64_t image_mtime;
+        std::uint64_t metadata_hash;                ///< FNV-1a of the boot block, the first FAT and the root directory.
+    };
+
+    #pragma pack(push, 1)
+    struct IndexHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entry_count;
+        std::uint32_t extent_count;
+        std::uint32_t name_length;                  ///< Total UTF-16 units in the name pool.
+        IndexKey key;
+    };
+
+    struct IndexEntry {
+        std::uint32_t parent;                       ///< Index of the parent directory. INDEX_NONE for the root.
+        std::uint32_t first_child;                  ///< Children are contiguous, sorted by folded name.
+        std::uint32_t child_count;
+        std::uint32_t name_offset;                  ///< In UTF-16 units, in the name pool.
+        std::uint16_t name_length;
+        std::uint8_t file_attributes;
+        std::uint8_t reserved;
+        std::uint32_t file_size;
+        std::uint16_t starting_cluster;
+        std::uint16_t last_modified_date;
+        std::uint16_t last_modified_time;
+        std::uint16_t reserved_2;
+        std::uint32_t first_extent;
+        std::uint32_t extent_count;
+        std::uint32_t record_offset;                ///< Offset of the 8.3 record in the image. 0 for the root.
+        std::uint32_t reserved_3;
+    };
+
+    struct IndexExtent {
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+    #pragma pack(pop)
+
+    static constexpr std::uint32_t INDEX_NONE = 0xFFFFFFFF;
+
+    /**
+     * \brief Compact snapshot of all the metadata of an image: names, tree and extent maps.
+     *
+     * Built with one walk of the image, it can be saved to a sidecar file and memory-mapped on
+     * the next open. Path and extent lookups are then answered from the mapping alone, without
+     * reading any directory or FAT of the image.
+     *
+     * Entry 0 is the root directory. Children of a directory are stored next to each other,
+     * sorted by case-folded name, so a path lookup is a binary search per component.
+     */
+    struct MetadataIndex {
+    private:
+        std::vector<std::uint8_t> owned;            ///< Content, when built or read rather than mapped.
+        void *mapping;
+        std::size_t mapping_size;
+
+        const IndexHeader *header;
+        const IndexEntry *entries;
+        const IndexExtent *extents;
+        const char16_t *names;
+
+        void release();
+        bool attach(const std::uint8_t *data, const std::size_t size);
+
+    public:
+        explicit MetadataIndex();
+        ~MetadataIndex();
+
+        MetadataIndex(const MetadataIndex&) = delete;
+        MetadataIndex &operator=(const MetadataIndex&) = delete;
+
+        /**
+         * \brief   Compute the key of an image.
+         *
+         * \param   image_size      Size of the image file, as given by the host.
+         * \param   image_mtime     Modification time of the image file, as given by the host.
+         *
+         * \returns True on success.
+         */
+        static bool compute_key(Image &img, const std::uint64_t image_size, const std::uint64_t image_mtime, IndexKey &key);
+
+        /**
+         * \brief   Walk the whole image and build the index in memory.
+         * \returns True on success.
+         */
+        bool build(Image &img, const IndexKey &key);
+
+        /**
+         * \brief   Write the index to a sidecar file.
+         * \returns True on success.
+         */
+        bool save(const std::string &path) const;
+
+        /**
+         * \brief   Map an index from a sidecar file.
+         *
+         * \param   expected_key    Key of the image about to be used. A mismatch fails the load.
+         *
+         * \returns True if the file is a valid index for that key.
+         */
+        bool load(const std::string &path, const IndexKey &expected_key);
+
+        /**
+         * \brief   Load the sidecar file if it matches, otherwise build the index and save it.
+         * \returns True if an index is available.
+         */
+        bool open_or_build(Image &img, const std::string &path, const IndexKey &key);
+
+        bool is_loaded() const {
+            return header != nullptr;
+        }
+
+        std::uint32_t entry_count() const {
+            return header ? header->entry_count : 0;
+        }
+
+        const IndexEntry &get_entry(const std::uint32_t index) const {
+            return entries[index];
+        }
+
+        std::u16string get_name(const std::uint32_t index) const;
+
+        /**
+         * \brief   Find an entry by path, '/' separated, case insensitive. An empty path is the root.
+         * \returns Index of the entry, or INDEX_NONE.
+         */
+        std::uint32_t find(const std::u16string &path) const;
+
+        /**
+         * \brief   Find a child of a directory by name, case insensitive.
+         * \returns Index of the entry, or INDEX_NONE.
+         */
+        std::uint32_t find_child(const std::uint32_t directory, const char16_t *name, const std::size_t name_length) const;
+
+        /**
+         * \brief   Get the physically contiguous runs of an entry's data.
+         */
+        const IndexExtent *get_extents(const std::uint32_t index, std::uint32_t &count) const;
+    };
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    enum class ClusterUsage : std::uint8_t {
+        FREE,
+        FILE,
+        DIRECTORY,
+        LOST,                                       ///< Allocated, but no entry leads to it.
+        BAD,
+        RESERVED                                    ///< Clusters 0 and 1, which have no data.
+    };
+
+    /**
+     * \brief Where the chain of one entry lies.
+     */
+    struct ChainLayout {
+        std::u16string path;                        ///< '/' separated.
+        ClusterID first;
+        std::uint32_t clusters;
+        std::uint32_t extents;                      ///< Runs of adjacent clusters.
+        std::uint32_t span;                         ///< Clusters from the lowest of the chain to the highest, both included.
+
+        double average_run() const {
+            return extents == 0 ? 0.0 : double(clusters) / extents;
+        }
+
+        /**
+         * \brief Get the number of seeks reading the whole chain in order takes: one to the start of each run.
+         */
+        std::uint32_t seeks() const {
+            return extents;
+        }
+    };
+
+    struct LayoutStats {
+        std::uint32_t chains;
+        std::uint32_t fragmented;                   ///< Chains in more than one run.
+        std::uint64_t extents;
+        std::uint64_t clusters;
+        std::uint32_t max_extents;                  ///< Runs of the most fragmented chain.
+
+        explicit LayoutStats()
+            : chains(0)
+            , fragmented(0)
+            , extents(0)
+            , clusters(0)
+            , max_extents(0) {
+        }
+
+        double average_run() const {
+            return extents == 0 ? 0.0 : double(clusters) / extents;
+        }
+
+        /**
+         * \brief Get the seeks reading one chain in order takes, on average.
+         */
+        double average_seeks() const {
+            return chains == 0 ? 0.0 : double(extents) / chains;
+        }
+    };
+
+    struct LayoutReport {
+        std::vector<ChainLayout> files;             ///< Files with data, sorted by path.
+        std::vector<ChainLayout> directories;       ///< Subdirectories, sorted by path. The root has no chain.
+        LayoutStats file_stats;
+        LayoutStats directory_stats;
+
+        /**
+         * \brief What each cluster holds, indexed by cluster number.
+         *
+         * A cross-linked cluster is counted for the first chain that reached it.
+         */
+        std::vector<ClusterUsage> usage;
+
+        std::uint32_t free_clusters;
+        std::uint32_t free_runs;
+        std::uint32_t largest_free_run;
+        std::uint32_t lost_clusters;
+        std::uint32_t bad_clusters;
+
+        explicit LayoutReport()
+            : free_clusters(0)
+            , free_runs(0)
+            , largest_free_run(0)
+            , lost_clusters(0)
+            , bad_clusters(0) {
+        }
+    };
+
+    struct LayoutOptions {
+        std::uint32_t threads;                      ///< For the directory walk. 0 to use one per hardware thread.
+
+        explicit LayoutOptions()
+            : threads(0) {
+        }
+    };
+
+    /**
+     * \brief   Report how files and directories are laid out on an image.
+     *
+     * The FAT is cached once. The tree is walked in parallel, each entry following its chain
+     * in the cached FAT, counting its runs and marking its clusters in the usage map. One
+     * linear pass over the FAT then accounts for free, bad and lost clusters, and free runs.
+     *
+     * \returns True if the whole tree was walked. False if the FAT or a directory could not be read.
+     */
+    bool analyze_layout(Image &img, LayoutReport &report, const LayoutOptions &options = LayoutOptions());
+}
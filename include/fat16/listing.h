@@ -0,0 +1,57 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief Columnar snapshot of a directory: one array per field, entry i at index i of each.
+     *
+     * Filters and sorts over one field only go through that field's array, densely packed,
+     * instead of striding over whole entries.
+     */
+    struct DirectoryListing {
+        std::vector<std::uint32_t> file_sizes;
+        std::vector<std::uint8_t> file_attributes;
+        std::vector<ClusterID> starting_clusters;
+        std::vector<std::uint16_t> last_modified_dates;
+        std::vector<std::uint16_t> last_modified_times;
+        std::vector<std::uint32_t> record_offsets;  ///< Offset of each 8.3 record in the image.
+
+        /**
+         * \brief Where each name starts in the name arena. Holds one more item than there are entries,
+         *        so name i goes from name_offsets[i] to name_offsets[i + 1].
+         */
+        std::vector<std::uint32_t> name_offsets;
+        std::u16string names;                       ///< All names, back to back.
+
+        std::size_t size() const {
+            return file_sizes.size();
+        }
+
+        /**
+         * \brief Empty the listing, keeping the memory for the next one.
+         */
+        void clear();
+
+        std::u16string get_name(const std::size_t index) const {
+            return names.substr(name_offsets[index], name_offsets[index + 1] - name_offsets[index]);
+        }
+    };
+
+    /**
+     * \brief   List a directory in one go, deleted entries, dot entries and volume labels excepted.
+     *
+     * The directory is read whole with one read per run of clusters, then decoded straight
+     * into the columns. The listing is cleared first, its memory is reused.
+     *
+     * \param   directory   First cluster of the directory. 0 for the root.
+     *
+     * \returns True on success.
+     */
+    bool list_directory(Image &img, const ClusterID directory, DirectoryListing &listing);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Fat16 {
+    struct ReadaheadOptions {
+        std::uint32_t initial_window;               ///< Bytes read ahead once a sequential streak starts.
+        std::uint32_t max_window;                   ///< The window doubles on every sequential read, up to this.
+        bool background;                            ///< Prefetch on a worker thread. Needs Image::read_at_func.
+
+        explicit ReadaheadOptions()
+            : initial_window(0x20000)
+            , max_window(0x400000)
+            , background(true) {
+        }
+    };
+
+    struct ReadaheadStats {
+        std::uint64_t reads;                        ///< Number of read() calls.
+        std::uint64_t bytes_requested;
+        std::uint64_t bytes_from_prefetch;          ///< Requested bytes that were already prefetched.
+        std::uint64_t bytes_prefetched;             ///< Bytes read ahead, used or not.
+        std::uint64_t prefetches;                   ///< Number of read ahead requests issued.
+        std::uint64_t waits;                        ///< Reads that had to wait for a prefetch in flight.
+
+        /**
+         * \brief Get the part of requested bytes served from prefetched data, from 0 to 1.
+         */
+        double hit_rate() const {
+            return bytes_requested ? static_cast<double>(bytes_from_prefetch) / bytes_requested : 0.0;
+        }
+    };
+
+    /**
+     * \brief Reader for one file that detects sequential access and reads ahead of it.
+     *
+     * The cluster chain is resolved once into extents, so each read maps straight to image
+     * offsets. While reads stay sequential the window grows, and the next window is fetched
+     * on a worker thread while the caller processes the current data. A non sequential read
+     * drops the prefetched data and resets the window.
+     *
+     * Without a positional read hook on the image, or with background disabled, the window is
+     * read synchronously together with the read that missed.
+     */
+    struct FileReader {
+    private:
+        struct Segment {
+            std::uint32_t offset;                   ///< Offset in the file.
+            std::vector<std::uint8_t> data;
+        };
+
+        Image &img;
+        ReadaheadOptions options;
+        std::uint32_t file_size;
+
+        std::vector<Extent> extents;
+        std::vector<std::uint64_t> extent_file_offsets;
+        bool valid;
+
+        std::uint32_t expected_offset;              ///< Where a sequential read would start.
+        std::uint32_t window;
+        std::uint32_t streak;
+
+        std::deque<Segment> ready;
+        bool request_pending;                       ///< A window is queued for, or being read by, the worker.
+        bool request_taken;                         ///< The worker is reading the pending window.
+        std::uint32_t generation;                   ///< Bumped on a reset, so stale windows get dropped.
+        std::uint32_t request_offset;
+        std::uint32_t request_size;
+        std::uint32_t prefetched_until;             ///< End of everything ready or requested.
+
+        ReadaheadStats stats;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        std::thread worker;
+        bool stopping;
+
+        std::uint32_t read_direct(std::uint8_t *dest, std::uint32_t offset, std::uint32_t size);
+        std::uint32_t take_from_ready(std::uint8_t *dest, std::uint32_t offset, std::uint32_t size);
+        void schedule(std::unique_lock<std::mutex> &guard);
+        void work();
+
+    public:
+        explicit FileReader(Image &img, const FundamentalEntry &entry, const ReadaheadOptions &options = ReadaheadOptions());
+        ~FileReader();
+
+        FileReader(const FileReader&) = delete;
+        FileReader &operator=(const FileReader&) = delete;
+
+        /**
+         * \brief   Check if the cluster chain could be resolved for the whole file size.
+         */
+        bool is_valid() const;
+
+        /**
+         * \brief   Read part of the file.
+         *
+         * \param   dest_buffer     The buffer contains read result.
+         * \param   offset          Offset in the file to read from.
+         * \param   size            The size of data to read.
+         *
+         * \returns Number of bytes read. Less than asked past the end of the file.
+         */
+        std::uint32_t read(std::uint8_t *dest_buffer, const std::uint32_t offset, const std::uint32_t size);
+
+        /**
+         * \brief   Get a snapshot of the read ahead statistics.
+         */
+        ReadaheadStats get_stats();
+    };
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <map>
+
+namespace Fat16 {
+    /**
+     * \brief Image backend over a sparse file, that knows where its holes are.
+     *
+     * Data and holes are mapped once with SEEK_DATA and SEEK_HOLE when the file is opened, and
+     * the map is kept up to date by every write after that. The parts of a read that fall in a
+     * hole are zero filled without any I/O. A write skips every all-zero block landing in a
+     * hole, and freed clusters are punched out with fallocate, so free space takes no room on
+     * disk.
+     *
+     * Every call is positional, the cursor of the read and write hooks is kept here. Reads can
+     * come from several threads at once, as long as nothing writes.
+     */
+    struct SparseFile {
+    private:
+        int fd;
+        bool writable;
+        std::uint32_t cursor;
+        std::uint32_t size;
+        std::map<std::uint32_t, std::uint32_t> data_regions;    ///< Start -> end of every region that holds data.
+
+        void map_regions();
+        void add_data(std::uint32_t start, std::uint32_t end);
+        void remove_data(const std::uint32_t start, const std::uint32_t end);
+        bool write_run(std::uint32_t offset, const std::uint8_t *data, std::uint32_t bytes);
+
+    public:
+        explicit SparseFile();
+        ~SparseFile();
+
+        SparseFile(const SparseFile&) = delete;
+        SparseFile &operator=(const SparseFile&) = delete;
+
+        /**
+         * \brief   Open an existing file and map its holes.
+         * \returns True on success. Always false on platforms without POSIX file descriptors.
+         */
+        bool open(const char *path, const bool writable);
+
+        void close();
+
+        /**
+         * \brief   Set the positional read, truncate and discard hooks of an image using this file.
+         *
+         * The image is expected to be built on the read, seek and (if writable) write hooks below.
+         */
+        void attach(Image &img);
+
+        /**
+         * \brief   Check if a range holds no data, so reads as zeros. Past the end of the file counts as a hole.
+         */
+        bool is_hole(const std::uint32_t offset, const std::uint32_t bytes) const;
+
+        /**
+         * \brief   Get the number of bytes that are not in a hole.
+         */
+        std::uint64_t data_bytes() const;
+
+        std::uint32_t get_size() const {
+            return size;
+        }
+
+        std::uint32_t read(void *dest, const std::uint32_t offset, const std::uint32_t bytes);
+
+        /**
+         * \brief   Write at the given offset. All-zero blocks that would land in a hole are left out.
+         * \returns Number of bytes written, counting those left out.
+         */
+        std::uint32_t write(const void *data, const std::uint32_t offset, const std::uint32_t bytes);
+
+        bool truncate(const std::uint32_t new_size);
+
+        /**
+         * \brief   Punch a hole over the range.
+         * \returns True on success. False if the filesystem can't punch holes.
+         */
+        bool discard(const std::uint32_t offset, const std::uint32_t bytes);
+
+        static std::uint32_t read_hook(void *userdata, void *buffer, std::uint32_t bytes);
+        static std::uint32_t seek_hook(void *userdata, std::uint32_t offset, int mode);
+        static std::uint32_t write_hook(void *userdata, const void *buffer, std::uint32_t bytes);
+        static std::uint32_t read_at_hook(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t bytes);
+        static bool truncate_hook(void *userdata, std::uint32_t size);
+        static bool discard_hook(void *userdata, std::uint32_t offset, std::uint32_t bytes);
+    };
+}
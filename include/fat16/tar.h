@@ -0,0 +1,37 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+
+namespace Fat16 {
+    struct TarExportOptions {
+        std::uint32_t buffer_size;                  ///< Size of the chunks file data goes through.
+        bool include_directories;                   ///< Emit a member for every directory too.
+
+        explicit TarExportOptions()
+            : buffer_size(0x100000)
+            , include_directories(true) {
+        }
+    };
+
+    /**
+     * \brief   Stream the content of the image as a POSIX (pax) tar archive.
+     *
+     * The directory tree is walked depth first. File data is read from the clusters into
+     * one large buffer that is handed to the write callback as it fills up, so nothing
+     * is staged on the host filesystem.
+     *
+     * Names longer than a ustar header can hold, or that are not plain ASCII, are written
+     * in a pax extended header. FAT timestamps have no time zone; they are stored as if
+     * they were UTC.
+     *
+     * \param   img             The image to export.
+     * \param   userdata        Passed to the write callback.
+     * \param   write_func      Receives the archive, in order, in chunks of buffer_size bytes.
+     *
+     * \returns True on success. False on a write failure or a broken cluster chain.
+     */
+    bool export_tar(Image &img, void *userdata, ImageWriteFunc write_func,
+        const TarExportOptions &options = TarExportOptions());
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief How likely the reconstructed extents hold the file as it was.
+     */
+    enum class RecoveryConfidence {
+        HIGH = 0,                                   ///< Every cluster from the first one on is free, in one run.
+        MEDIUM = 1,                                 ///< The first cluster is free, but allocated clusters had to be skipped.
+        LOW = 2,                                    ///< Clusters were missing, or were given to an earlier deleted file.
+        NONE = 3                                    ///< The first cluster is in use again, the data is gone.
+    };
+
+    struct DeletedFile {
+        std::u16string path;                        ///< '/' separated, without a leading '/'.
+
+        /**
+         * \brief The 8.3 record, with its first character put back.
+         *
+         * The character is only known when a deleted long name agrees with the record,
+         * see name_restored. It is '_' otherwise.
+         */
+        FundamentalEntry entry;
+        bool name_restored;
+
+        std::uint32_t record_offset;                ///< Offset of the 8.3 record in the image.
+        std::vector<Extent> extents;                ///< The guessed runs, in file order. Empty for NONE.
+        RecoveryConfidence confidence;
+        bool in_deleted_directory;                  ///< Found in a directory that is itself deleted.
+
+        bool is_directory() const {
+            return (entry.file_attributes & (int)EntryAttribute::DIRECTORY) != 0;
+        }
+    };
+
+    /**
+     * \brief   Called for every deleted entry found. Return false to stop the scan.
+     */
+    typedef bool (*DeletedFileFunc)(void *userdata, const DeletedFile &file);
+
+    struct UndeleteOptions {
+        bool scan_deleted_directories;              ///< Also look in deleted directories whose first cluster is intact.
+
+        explicit UndeleteOptions()
+            : scan_deleted_directories(true) {
+        }
+    };
+
+    /**
+     * \brief   Find deleted entries in every directory and guess where their data is.
+     *
+     * The FAT is cached once, and each directory is read whole and scanned slot by slot.
+     * A deleted file's chain is gone from the FAT, so its data is assumed to start at its
+     * first cluster and to take the next free clusters, as many as its size needs. Clusters
+     * given to one deleted file are not given to later ones at a higher confidence.
+     *
+     * Deleted directories only keep their first cluster for sure, so only it is scanned.
+     *
+     * \returns True if every directory could be read.
+     */
+    bool find_deleted_files(Image &img, DeletedFileFunc result_func, void *userdata,
+        const UndeleteOptions &options = UndeleteOptions());
+
+    /**
+     * \brief   Read part of a deleted file from its guessed extents.
+     * \returns Number of bytes read. Less than asked past the end of the file or of the extents.
+     */
+    std::uint32_t read_deleted_file(Image &img, const DeletedFile &file, std::uint8_t *dest, const std::uint32_t offset,
+        const std::uint32_t size);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace Fat16 {
+    /**
+     * \brief Path of a directory met during a walk, as a link to its parent.
+     *
+     * Shared by every entry of the directory, so no path string is built unless asked for.
+     */
+    struct WalkPath {
+        std::shared_ptr<const WalkPath> parent;     ///< Null for the root.
+        std::u16string name;                        ///< Empty for the root.
+        std::uint32_t depth;                        ///< 0 for the root.
+
+        /**
+         * \brief Build the full path, '/' separated, without a leading '/'.
+         */
+        std::u16string to_string() const;
+    };
+
+    /**
+     * \brief One entry met during a walk. Only valid for the duration of the visit.
+     */
+    struct EntryView {
+        const FundamentalEntry *entry;
+        const LongFileNameEntry *long_name;         ///< LFN slots as stored, last part first. Null if none.
+        std::uint32_t long_name_count;
+        std::uint32_t record_offset;                ///< Offset of the 8.3 record in the image.
+        const WalkPath *parent;                     ///< Directory the entry is in.
+
+        std::u16string get_filename() const;
+
+        bool matches_name(const char16_t *name, const std::size_t length) const {
+            return Fat16::matches_name(*entry, long_name, long_name_count, name, length);
+        }
+
+        bool matches_name(const std::u16string_view name) const {
+            return matches_name(name.data(), name.length());
+        }
+
+        bool is_directory() const {
+            return (entry->file_attributes & (int)EntryAttribute::DIRECTORY) != 0;
+        }
+    };
+
+    enum class WalkAction {
+        CONTINUE = 0,
+        SKIP = 1,                                   ///< Don't go into this directory. Same as CONTINUE for a file.
+        STOP = 2                                    ///< End the walk as soon as possible.
+    };
+
+    /**
+     * \brief   Called for every entry of the tree, dot entries and volume labels excepted.
+     *
+     * Called from several threads at once. \p worker goes from 0 to the thread count minus one,
+     * so per thread state can be kept without locking.
+     */
+    typedef WalkAction (*WalkVisitFunc)(void *userdata, const EntryView &view, const std::uint32_t worker);
+
+    struct WalkOptions {
+        std::uint32_t threads;                      ///< 0 to use one per hardware thread.
+        std::uint32_t max_depth;                    ///< Directories deeper than this are not opened. 0 for no limit.
+
+        explicit WalkOptions()
+            : threads(0)
+            , max_depth(0) {
+        }
+    };
+
+    /**
+     * \brief   Walk the whole directory tree, with directories spread over a pool of threads.
+     *
+     * Each worker reads a whole directory into its own buffer with positional reads, then
+     * visits the entries straight from that buffer. Subdirectories go to the worker's own
+     * queue, and idle workers steal from the other end of the busy ones' queues.
+     *
+     * The FAT is cached first. Without Image::read_at_func the walk runs on the calling
+     * thread only. Entries of one directory are visited in order, but there is no order
+     * between directories. The image must not be written to during the walk.
+     *
+     * \returns True if the whole tree was walked. False if a directory could not be read,
+     *          or the visitor stopped the walk.
+     */
+    bool walk(Image &img, WalkVisitFunc visitor, void *userdata, const WalkOptions &options = WalkOptions());
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <cstdint>
+
+namespace Fat16 {
+    /**
+     * \brief   Copy a file out of the image between two file descriptors, in the kernel.
+     *
+     * Each physically contiguous run of the file is handed to copy_file_range, so the data
+     * never goes through userspace and filesystems with reflinks can share the blocks
+     * instead of copying them. If the kernel refuses, sendfile then splice are tried, and
+     * last a plain pread/write loop.
+     *
+     * The image file descriptor is only used with positional calls, its offset is untouched.
+     *
+     * \param   img         The image, used to follow the cluster chain.
+     * \param   entry       The entry of the file to copy.
+     * \param   image_fd    File descriptor of the image, opened for reading.
+     * \param   out_fd      File descriptor to write to, at its current offset.
+     *
+     * \returns True on success. Always false on platforms without POSIX file descriptors.
+     */
+    bool copy_file_to_fd(Image &img, const FundamentalEntry &entry, const int image_fd, const int out_fd);
+}
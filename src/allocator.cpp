@@ -0,0 +1,241 @@
+#include <fat16/allocator.h>
+
+#include <algorithm>
+#include <iterator>
+
+namespace Fat16 {
+    ClusterAllocator::ClusterAllocator()
+        : cluster_limit(CLUSTER_FIRST_VALID)
+        , free_count(0) {
+    }
+
+    bool ClusterAllocator::build(Image &img) {
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        build(img.fat_cache, img.total_clusters());
+        return true;
+    }
+
+    void ClusterAllocator::build(const std::vector<ClusterID> &fat, const std::uint32_t total_clusters) {
+        cluster_limit = std::min<std::uint32_t>(total_clusters + CLUSTER_FIRST_VALID,
+            static_cast<std::uint32_t>(fat.size()));
+        cluster_limit = std::max<std::uint32_t>(cluster_limit, CLUSTER_FIRST_VALID);
+
+        bitmap.assign((cluster_limit + 63) / 64, 0);
+        runs_by_start.clear();
+        runs_by_length.clear();
+        free_count = 0;
+
+        // One linear pass: collect runs of free entries as we go
+        std::uint32_t run_first = 0;
+        std::uint32_t run_count = 0;
+
+        for (std::uint32_t i = CLUSTER_FIRST_VALID; i < cluster_limit; i++) {
+            if (fat[i] == CLUSTER_FREE) {
+                bitmap[i / 64] |= (1ULL << (i % 64));
+
+                if (run_count == 0) {
+                    run_first = i;
+                }
+
+                run_count++;
+                continue;
+            }
+
+            if (run_count != 0) {
+                insert_run(static_cast<ClusterID>(run_first), run_count);
+                run_count = 0;
+            }
+        }
+
+        if (run_count != 0) {
+            insert_run(static_cast<ClusterID>(run_first), run_count);
+        }
+    }
+
+    void ClusterAllocator::set_free_bits(const Extent &extent, const bool free) {
+        for (std::uint32_t i = extent.first; i < extent.first + extent.count; i++) {
+            if (free) {
+                bitmap[i / 64] |= (1ULL << (i % 64));
+            } else {
+                bitmap[i / 64] &= ~(1ULL << (i % 64));
+            }
+        }
+    }
+
+    void ClusterAllocator::insert_run(const ClusterID first, const std::uint32_t count) {
+        runs_by_start.emplace(first, count);
+        runs_by_length.emplace(count, first);
+        free_count += count;
+    }
+
+    void ClusterAllocator::erase_run(const ClusterID first, const std::uint32_t count) {
+        runs_by_start.erase(first);
+        runs_by_length.erase(std::make_pair(count, first));
+        free_count -= count;
+    }
+
+    void ClusterAllocator::take_from_run(const ClusterID run_first, const std::uint32_t run_count, const std::uint32_t count) {
+        erase_run(run_first, run_count);
+        set_free_bits({ run_first, count }, false);
+
+        if (run_count > count) {
+            insert_run(static_cast<ClusterID>(run_first + count), run_count - count);
+        }
+    }
+
+    bool ClusterAllocator::allocate_contiguous(const std::uint32_t count, Extent &result) {
+        if (count == 0) {
+            return false;
+        }
+
+        // Smallest run that still fits, lowest cluster first among equals
+        auto fit = runs_by_length.lower_bound(std::make_pair(count, ClusterID(0)));
+        if (fit == runs_by_length.end()) {
+            return false;
+        }
+
+        const std::uint32_t run_count = fit->first;
+        const ClusterID run_first = fit->second;
+
+        take_from_run(run_first, run_count, count);
+
+        result.first = run_first;
+        result.count = count;
+
+        return true;
+    }
+
+    bool ClusterAllocator::allocate(const std::uint32_t count, std::vector<Extent> &result) {
+        if (count > free_count || count == 0) {
+            return false;
+        }
+
+        Extent single;
+        if (allocate_contiguous(count, single)) {
+            result.push_back(single);
+            return true;
+        }
+
+        std::uint32_t left = count;
+
+        while (left != 0) {
+            Extent piece;
+
+            if (allocate_contiguous(left, piece)) {
+                result.push_back(piece);
+                break;
+            }
+
+            // Nothing fits the remainder, take the largest run entirely
+            auto largest = std::prev(runs_by_length.end());
+            const std::uint32_t run_count = largest->first;
+            const ClusterID run_first = largest->second;
+
+            take_from_run(run_first, run_count, run_count);
+            result.push_back({ run_first, run_count });
+
+            left -= run_count;
+        }
+
+        return true;
+    }
+
+    bool ClusterAllocator::reserve(const Extent &extent) {
+        if (extent.count == 0 || extent.first < CLUSTER_FIRST_VALID || extent.first + extent.count > cluster_limit) {
+            return false;
+        }
+
+        auto run = runs_by_start.upper_bound(extent.first);
+        if (run == runs_by_start.begin()) {
+            return false;
+        }
+
+        run--;
+
+        const ClusterID run_first = run->first;
+        const std::uint32_t run_count = run->second;
+
+        if (run_first + run_count < extent.first + extent.count) {
+            return false;
+        }
+
+        erase_run(run_first, run_count);
+        set_free_bits(extent, false);
+
+        if (extent.first > run_first) {
+            insert_run(run_first, extent.first - run_first);
+        }
+
+        const std::uint32_t run_end = run_first + run_count;
+        const std::uint32_t extent_end = extent.first + extent.count;
+
+        if (run_end > extent_end) {
+            insert_run(static_cast<ClusterID>(extent_end), run_end - extent_end);
+        }
+
+        return true;
+    }
+
+    void ClusterAllocator::release(const Extent &extent) {
+        const std::uint32_t begin = std::max<std::uint32_t>(extent.first, CLUSTER_FIRST_VALID);
+        const std::uint32_t end = std::min<std::uint32_t>(extent.first + extent.count, cluster_limit);
+
+        std::uint32_t i = begin;
+
+        while (i < end) {
+            // Skip clusters that are already free
+            if (is_free(static_cast<ClusterID>(i))) {
+                i++;
+                continue;
+            }
+
+            std::uint32_t piece_first = i;
+            std::uint32_t piece_end = i;
+
+            while (piece_end < end && !is_free(static_cast<ClusterID>(piece_end))) {
+                piece_end++;
+            }
+
+            i = piece_end;
+            set_free_bits({ static_cast<ClusterID>(piece_first), piece_end - piece_first }, true);
+
+            // Coalesce with the run that ends right before us
+            if (piece_first > CLUSTER_FIRST_VALID && is_free(static_cast<ClusterID>(piece_first - 1))) {
+                auto left = std::prev(runs_by_start.upper_bound(static_cast<ClusterID>(piece_first - 1)));
+                const ClusterID left_first = left->first;
+
+                erase_run(left_first, left->second);
+                piece_first = left_first;
+            }
+
+            // And with the one starting right after us
+            if (piece_end < cluster_limit) {
+                auto right = runs_by_start.find(static_cast<ClusterID>(piece_end));
+
+                if (right != runs_by_start.end()) {
+                    const std::uint32_t right_count = right->second;
+
+                    erase_run(right->first, right_count);
+                    piece_end += right_count;
+                }
+            }
+
+            insert_run(static_cast<ClusterID>(piece_first), piece_end - piece_first);
+        }
+    }
+
+    bool ClusterAllocator::is_free(const ClusterID cluster) const {
+        if (cluster >= cluster_limit) {
+            return false;
+        }
+
+        return (bitmap[cluster / 64] >> (cluster % 64)) & 1;
+    }
+
+    std::uint32_t ClusterAllocator::largest_free_run() const {
+        return runs_by_length.empty() ? 0 : runs_by_length.rbegin()->first;
+    }
+}
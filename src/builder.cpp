@@ -0,0 +1,800 @@
+#include <fat16/builder.h>
+
+#include "stream_writer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace Fat16 {
+    static constexpr std::uint32_t MIN_FAT16_CLUSTERS = 4085;
+    static constexpr std::uint32_t MAX_FAT16_CLUSTERS = 65524;
+    static constexpr std::uint32_t MAX_LFN_LENGTH = 255;
+    static constexpr std::uint32_t LFN_CHARS_PER_ENTRY = 13;
+    static constexpr std::uint32_t STREAM_BUFFER_SIZE = 0x100000;
+
+    struct ImageBuilder::Node {
+        std::u16string name;
+        char short_name[11];
+        bool needs_lfn;
+        bool is_directory;
+        std::uint16_t date;
+        std::uint16_t time;
+
+        Node *parent;
+        std::vector<std::unique_ptr<Node>> children;
+        std::map<std::u16string, Node*> children_by_name;  ///< Keyed by case-folded name.
+
+        std::string host_path;
+        std::vector<std::uint8_t> content;
+        bool in_memory;
+
+        std::uint32_t size;                 ///< File size, or size of the directory's entries.
+        ClusterID first_cluster;
+        std::uint32_t cluster_count;
+
+        explicit Node()
+            : needs_lfn(false)
+            , is_directory(false)
+            , date(0)
+            , time(0)
+            , parent(nullptr)
+            , in_memory(false)
+            , size(0)
+            , first_cluster(0)
+            , cluster_count(0) {
+            std::memset(short_name, ' ', sizeof(short_name));
+        }
+
+        std::uint32_t entry_slots() const {
+            if (!needs_lfn) {
+                return 1;
+            }
+
+            return 1 + static_cast<std::uint32_t>((name.length() + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY);
+        }
+    };
+
+    static bool is_valid_short_char(const char16_t c) {
+        if ((c >= u'A' && c <= u'Z') || (c >= u'0' && c <= u'9')) {
+            return true;
+        }
+
+        return c < 0x80 && c != 0 && std::strchr("$%'-_@~`!(){}^#&", static_cast<char>(c)) != nullptr;
+    }
+
+    /**
+     * \brief   Convert a part of a long name to its short form.
+     * \returns True if the conversion lost nothing (no case change, no substitute, no truncation).
+     */
+    static bool convert_short_part(const std::u16string &part, const std::size_t max_length, std::string &dest) {
+        bool lossless = true;
+
+        for (const char16_t c : part) {
+            if (c == u' ' || c == u'.') {
+                lossless = false;
+                continue;
+            }
+
+            char16_t converted = fold_case(c);
+
+            if (converted != c) {
+                lossless = false;
+            }
+
+            if (!is_valid_short_char(converted)) {
+                converted = u'_';
+                lossless = false;
+            }
+
+            if (dest.length() == max_length) {
+                lossless = false;
+                break;
+            }
+
+            dest += static_cast<char>(converted);
+        }
+
+        return lossless;
+    }
+
+    static std::uint32_t div_round_up(const std::uint64_t value, const std::uint64_t divisor) {
+        return static_cast<std::uint32_t>((value + divisor - 1) / divisor);
+    }
+
+    namespace {
+    /**
+     * \brief Read host files on worker threads, in layout order, ahead of the writer.
+     *
+     * Only files small enough to fit the budget a few times over are read ahead. Larger ones
+     * are left for the writer to stream in chunks.
+     */
+    struct FilePrefetcher {
+        struct Slot {
+            std::vector<std::uint8_t> data;
+            bool ready;
+            bool streamed;
+            bool failed;
+        };
+
+        const std::vector<std::uint32_t> &sizes;
+        const std::vector<const std::string*> &paths;
+        std::vector<Slot> slots;
+        std::vector<std::thread> workers;
+
+        std::mutex lock;
+        std::condition_variable cond;
+        std::size_t next_claim;
+        std::size_t next_write;
+        std::uint64_t in_flight;
+        std::uint64_t budget;
+        bool aborted;
+
+        explicit FilePrefetcher(const std::vector<std::uint32_t> &sizes, const std::vector<const std::string*> &paths,
+            const std::uint32_t threads, const std::uint64_t budget)
+            : sizes(sizes)
+            , paths(paths)
+            , slots(sizes.size())
+            , next_claim(0)
+            , next_write(0)
+            , in_flight(0)
+            , budget(budget)
+            , aborted(false) {
+            for (Slot &slot : slots) {
+                slot.ready = false;
+                slot.streamed = false;
+                slot.failed = false;
+            }
+
+            for (std::uint32_t i = 0; i < threads; i++) {
+                workers.emplace_back(&FilePrefetcher::work, this);
+            }
+        }
+
+        ~FilePrefetcher() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                aborted = true;
+            }
+
+            cond.notify_all();
+
+            for (std::thread &worker : workers) {
+                worker.join();
+            }
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while (!aborted && next_claim < slots.size()) {
+                const std::size_t index = next_claim;
+                const std::uint32_t size = sizes[index];
+
+                if (!paths[index] || size == 0 || size > budget / 4) {
+                    // In memory already, empty, or too big: the writer deals with it
+                    slots[index].streamed = true;
+                    slots[index].ready = true;
+                    next_claim++;
+
+                    cond.notify_all();
+                    continue;
+                }
+
+                // The file the writer waits for is always let through, or we could stall
+                if (in_flight + size > budget && index != next_write) {
+                    cond.wait(guard);
+                    continue;
+                }
+
+                next_claim++;
+                in_flight += size;
+
+                guard.unlock();
+
+                std::vector<std::uint8_t> data(size);
+                bool failed = true;
+
+                if (FILE *source = std::fopen(paths[index]->c_str(), "rb")) {
+                    failed = (std::fread(data.data(), 1, size, source) != size);
+                    std::fclose(source);
+                }
+
+                guard.lock();
+
+                slots[index].data = std::move(data);
+                slots[index].failed = failed;
+                slots[index].ready = true;
+
+                cond.notify_all();
+            }
+        }
+
+        /**
+         * \brief Wait until the given file is read, or is left for the writer.
+         */
+        Slot &acquire(const std::size_t index) {
+            std::unique_lock<std::mutex> guard(lock);
+
+            next_write = index;
+            cond.notify_all();
+
+            cond.wait(guard, [&]() {
+                return slots[index].ready;
+            });
+
+            return slots[index];
+        }
+
+        void release(const std::size_t index) {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (!slots[index].streamed) {
+                in_flight -= sizes[index];
+            }
+
+            std::vector<std::uint8_t>().swap(slots[index].data);
+            cond.notify_all();
+        }
+    };
+    }
+
+    ImageBuilder::ImageBuilder(const BuilderOptions &options)
+        : options(options)
+        , root(new Node())
+        , planned(false) {
+        root->is_directory = true;
+        std::memset(&boot_block, 0, sizeof(BootBlock));
+    }
+
+    ImageBuilder::~ImageBuilder() {
+    }
+
+    ImageBuilder::Node *ImageBuilder::make_path(const std::string &image_path, const bool is_directory) {
+        Node *current = root.get();
+        std::size_t start = 0;
+
+        planned = false;
+
+        while (start <= image_path.length()) {
+            std::size_t end = image_path.find('/', start);
+            if (end == std::string::npos) {
+                end = image_path.length();
+            }
+
+            const std::u16string component = utf8_to_utf16(image_path.substr(start, end - start));
+            start = end + 1;
+
+            if (component.empty()) {
+                continue;
+            }
+
+            if (!current->is_directory || component.length() > MAX_LFN_LENGTH || component == u"." || component == u"..") {
+                return nullptr;
+            }
+
+            const bool is_last = (image_path.find_first_not_of('/', start) == std::string::npos);
+            Node *next = nullptr;
+
+            std::u16string folded(component);
+            for (char16_t &c : folded) {
+                c = fold_case(c);
+            }
+
+            const auto existing = current->children_by_name.find(folded);
+            if (existing != current->children_by_name.end()) {
+                next = existing->second;
+            }
+
+            if (next) {
+                if (is_last && next->is_directory != is_directory) {
+                    return nullptr;
+                }
+            } else {
+                std::unique_ptr<Node> created(new Node());
+
+                created->name = component;
+                created->is_directory = !is_last || is_directory;
+                created->parent = current;
+
+                next = created.get();
+                current->children_by_name.emplace(std::move(folded), next);
+                current->children.push_back(std::move(created));
+            }
+
+            current = next;
+        }
+
+        return (current == root.get()) ? nullptr : current;
+    }
+
+    bool ImageBuilder::add_directory(const std::string &image_path, const std::uint16_t date, const std::uint16_t time) {
+        Node *node = make_path(image_path, true);
+
+        if (!node) {
+            return false;
+        }
+
+        node->date = date;
+        node->time = time;
+
+        return true;
+    }
+
+    bool ImageBuilder::add_file(const std::string &image_path, const std::string &host_path, const std::uint32_t size,
+        const std::uint16_t date, const std::uint16_t time) {
+        Node *node = make_path(image_path, false);
+
+        if (!node) {
+            return false;
+        }
+
+        node->host_path = host_path;
+        node->in_memory = false;
+        node->size = size;
+        node->date = date;
+        node->time = time;
+
+        return true;
+    }
+
+    bool ImageBuilder::add_file(const std::string &image_path, std::vector<std::uint8_t> content,
+        const std::uint16_t date, const std::uint16_t time) {
+        Node *node = make_path(image_path, false);
+
+        if (!node || content.size() > 0xFFFFFFFFULL) {
+            return false;
+        }
+
+        node->size = static_cast<std::uint32_t>(content.size());
+        node->content = std::move(content);
+        node->in_memory = true;
+        node->date = date;
+        node->time = time;
+
+        return true;
+    }
+
+    bool ImageBuilder::plan_directory(Node *dir) {
+        std::set<std::string> used_names;
+        std::vector<Node*> lossy;
+
+        std::uint32_t slots = (dir == root.get()) ? (options.volume_label.empty() ? 0 : 1) : 2;
+
+        // Names that convert exactly get their short name first, so generated ones never steal it
+        for (const std::unique_ptr<Node> &child : dir->children) {
+            const std::size_t dot = child->name.find_last_of(u'.');
+            const bool has_ext = (dot != std::u16string::npos && dot != 0);
+
+            std::string base;
+            std::string ext;
+
+            bool lossless = convert_short_part(has_ext ? child->name.substr(0, dot) : child->name, 8, base);
+            lossless = convert_short_part(has_ext ? child->name.substr(dot + 1) : u"", 3, ext) && lossless;
+            lossless = lossless && !base.empty() && (!has_ext || !ext.empty());
+
+            if (base.empty()) {
+                base = "_";
+            }
+
+            std::memset(child->short_name, ' ', sizeof(child->short_name));
+            std::memcpy(child->short_name + 8, ext.data(), ext.length());
+
+            if (lossless && used_names.insert(std::string(base.data(), base.length()) + "." + ext).second) {
+                std::memcpy(child->short_name, base.data(), base.length());
+                child->needs_lfn = false;
+            } else {
+                std::memcpy(child->short_name, base.data(), base.length());
+                child->needs_lfn = true;
+                lossy.push_back(child.get());
+            }
+        }
+
+        // Next tail to try per name, so a big directory of similar names isn't quadratic
+        std::map<std::string, std::uint32_t> next_tails;
+
+        // Numeric tails for the rest, like NAME~1.EXT
+        for (Node *child : lossy) {
+            const std::string ext(child->short_name + 8, 3);
+            std::string base(child->short_name, 8);
+            base.erase(base.find_last_not_of(' ') + 1);
+
+            std::uint32_t &next_tail = next_tails[base + "." + ext];
+
+            for (std::uint32_t number = next_tail + 1; ; number++) {
+                const std::string tail = "~" + std::to_string(number);
+
+                if (tail.length() > 7) {
+                    return false;
+                }
+
+                const std::string candidate = base.substr(0, 8 - tail.length()) + tail;
+                const std::string trimmed_ext = ext.substr(0, ext.find_last_not_of(' ') + 1);
+
+                if (used_names.insert(candidate + "." + trimmed_ext).second) {
+                    next_tail = number;
+                    std::memset(child->short_name, ' ', 8);
+                    std::memcpy(child->short_name, candidate.data(), candidate.length());
+                    break;
+                }
+            }
+        }
+
+        for (const std::unique_ptr<Node> &child : dir->children) {
+            slots += child->entry_slots();
+
+            if (child->is_directory) {
+                directories.push_back(child.get());
+            }
+        }
+
+        if (dir == root.get() && slots > options.num_root_dirs) {
+            return false;
+        }
+
+        dir->size = slots * sizeof(FundamentalEntry);
+        return true;
+    }
+
+    bool ImageBuilder::choose_geometry(const std::uint32_t directory_count) {
+        const std::uint32_t block_size = options.bytes_per_block;
+        const std::uint32_t root_blocks = div_round_up(options.num_root_dirs * sizeof(FundamentalEntry), block_size);
+        const std::uint32_t reserved_blocks = 1;
+
+        for (std::uint32_t blocks_per_cluster = 1; blocks_per_cluster <= 128; blocks_per_cluster *= 2) {
+            if (options.blocks_per_cluster != 0 && blocks_per_cluster != options.blocks_per_cluster) {
+                continue;
+            }
+
+            const std::uint32_t cluster_size = blocks_per_cluster * block_size;
+            if (cluster_size > 0x10000) {
+                break;
+            }
+
+            std::uint64_t needed = 0;
+
+            for (std::uint32_t i = 0; i < directory_count; i++) {
+                needed += std::max<std::uint32_t>(1, div_round_up(directories[i]->size, cluster_size));
+            }
+
+            for (const Node *file : files) {
+                needed += div_round_up(file->size, cluster_size);
+            }
+
+            std::uint64_t clusters = 0;
+            std::uint32_t fat_blocks = 0;
+
+            if (options.total_blocks == 0) {
+                clusters = std::max<std::uint64_t>(needed, MIN_FAT16_CLUSTERS);
+                fat_blocks = div_round_up((clusters + CLUSTER_FIRST_VALID) * sizeof(ClusterID), block_size);
+            } else {
+                // Size the FAT for every cluster the image could hold, then see what's left
+                fat_blocks = div_round_up((options.total_blocks / blocks_per_cluster + CLUSTER_FIRST_VALID)
+                    * sizeof(ClusterID), block_size);
+
+                const std::uint64_t overhead = reserved_blocks + options.num_fat * fat_blocks + root_blocks;
+                if (overhead >= options.total_blocks) {
+                    continue;
+                }
+
+                clusters = (options.total_blocks - overhead) / blocks_per_cluster;
+            }
+
+            if (clusters < needed || clusters < MIN_FAT16_CLUSTERS || clusters > MAX_FAT16_CLUSTERS
+                || fat_blocks > 0xFFFF) {
+                continue;
+            }
+
+            const std::uint64_t total_blocks = (options.total_blocks != 0) ? options.total_blocks
+                : reserved_blocks + options.num_fat * fat_blocks + root_blocks + clusters * blocks_per_cluster;
+
+            BootBlock &boot = boot_block;
+            std::memset(&boot, 0, sizeof(BootBlock));
+
+            boot.jump_code[0] = 0xEB;
+            boot.jump_code[1] = 0x3C;
+            boot.jump_code[2] = 0x90;
+            std::memcpy(boot.manufacturer_description, "LIBFAT16", 8);
+            boot.bytes_per_block = static_cast<std::uint16_t>(block_size);
+            boot.num_blocks_per_allocation_unit = static_cast<std::uint8_t>(blocks_per_cluster);
+            boot.num_reserved_blocks = static_cast<std::uint16_t>(reserved_blocks);
+            boot.num_fat = options.num_fat;
+            boot.num_root_dirs = static_cast<std::uint16_t>(root_blocks * block_size / sizeof(FundamentalEntry));
+            boot.num_blocks_in_image_op1 = (total_blocks < 0x10000) ? static_cast<std::uint16_t>(total_blocks) : 0;
+            boot.media_descriptor = 0xF8;
+            boot.num_blocks_per_fat = static_cast<std::uint16_t>(fat_blocks);
+            boot.num_blocks_per_track = 63;
+            boot.num_heads = 255;
+            boot.num_hidden_blocks = 0;
+            boot.num_blocks_in_image_op2 = (total_blocks < 0x10000) ? 0 : static_cast<std::uint32_t>(total_blocks);
+            boot.physical_driver_num = 0x80;
+            boot.extended_boot_record_signature = 0x29;
+            boot.volume_sig_num = options.volume_serial;
+            std::memset(boot.volume_label, ' ', sizeof(boot.volume_label));
+            std::memcpy(boot.volume_label, options.volume_label.empty() ? "NO NAME" : options.volume_label.data(),
+                std::min<std::size_t>(options.volume_label.empty() ? 7 : options.volume_label.length(), 11));
+            std::memcpy(boot.file_sys_id, "FAT16   ", 8);
+            boot.boot_block_sig = 0xAA55;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    bool ImageBuilder::plan() {
+        const std::uint32_t block_size = options.bytes_per_block;
+
+        if (block_size < 512 || block_size > 4096 || (block_size & (block_size - 1)) != 0 || options.num_fat == 0
+            || options.volume_label.length() > 11) {
+            return false;
+        }
+
+        directories.clear();
+        files.clear();
+
+        if (!plan_directory(root.get())) {
+            return false;
+        }
+
+        // Breadth first, so each level of the tree sits together
+        for (std::size_t i = 0; i < directories.size(); i++) {
+            if (!plan_directory(directories[i])) {
+                return false;
+            }
+        }
+
+        const std::size_t directory_count = directories.size();
+
+        // Files follow the directory order, so siblings end up next to each other
+        directories.insert(directories.begin(), root.get());
+
+        for (const Node *dir : directories) {
+            for (const std::unique_ptr<Node> &child : dir->children) {
+                if (!child->is_directory) {
+                    files.push_back(child.get());
+                }
+            }
+        }
+
+        directories.erase(directories.begin());
+
+        if (!choose_geometry(static_cast<std::uint32_t>(directory_count))) {
+            return false;
+        }
+
+        const std::uint32_t cluster_size = block_size * boot_block.num_blocks_per_allocation_unit;
+        std::uint32_t next_cluster = CLUSTER_FIRST_VALID;
+
+        for (Node *dir : directories) {
+            dir->first_cluster = static_cast<ClusterID>(next_cluster);
+            dir->cluster_count = std::max<std::uint32_t>(1, div_round_up(dir->size, cluster_size));
+            next_cluster += dir->cluster_count;
+        }
+
+        for (Node *file : files) {
+            file->cluster_count = div_round_up(file->size, cluster_size);
+            file->first_cluster = file->cluster_count ? static_cast<ClusterID>(next_cluster) : 0;
+            next_cluster += file->cluster_count;
+        }
+
+        planned = true;
+        return true;
+    }
+
+    std::uint64_t ImageBuilder::image_size() const {
+        return static_cast<std::uint64_t>(boot_block.total_blocks()) * boot_block.bytes_per_block;
+    }
+
+    void ImageBuilder::generate_directory(const Node *dir, std::vector<std::uint8_t> &dest) const {
+        std::uint8_t *cursor = dest.data();
+
+        auto put_entry = [&](const char *short_name, const std::uint8_t attributes, const ClusterID cluster,
+            const std::uint32_t size, const std::uint16_t date, const std::uint16_t time) {
+            FundamentalEntry entry;
+            std::memset(&entry, 0, sizeof(FundamentalEntry));
+
+            std::memcpy(entry.filename, short_name, 8);
+            std::memcpy(entry.filename_ext, short_name + 8, 3);
+            entry.file_attributes = attributes;
+            entry.last_modified_date = date ? date : options.default_date;
+            entry.last_modified_time = time ? time : options.default_time;
+            entry.starting_cluster = cluster;
+            entry.file_size = size;
+
+            std::memcpy(cursor, &entry, sizeof(FundamentalEntry));
+            cursor += sizeof(FundamentalEntry);
+        };
+
+        if (dir == root.get()) {
+            if (!options.volume_label.empty()) {
+                char label[11];
+                std::memset(label, ' ', sizeof(label));
+                std::memcpy(label, options.volume_label.data(), options.volume_label.length());
+
+                put_entry(label, static_cast<std::uint8_t>(EntryAttribute::SPECIAL), 0, 0, 0, 0);
+            }
+        } else {
+            const ClusterID parent_cluster = (dir->parent == root.get()) ? 0 : dir->parent->first_cluster;
+
+            put_entry(".          ", static_cast<std::uint8_t>(EntryAttribute::DIRECTORY), dir->first_cluster, 0,
+                dir->date, dir->time);
+            put_entry("..         ", static_cast<std::uint8_t>(EntryAttribute::DIRECTORY), parent_cluster, 0,
+                dir->date, dir->time);
+        }
+
+        for (const std::unique_ptr<Node> &child : dir->children) {
+            if (child->needs_lfn) {
+                const std::uint32_t lfn_count = child->entry_slots() - 1;
+                const std::uint8_t checksum = short_name_checksum(child->short_name);
+
+                // Last part of the name goes first on disk
+                for (std::uint32_t part = lfn_count; part >= 1; part--) {
+                    char16_t chars[LFN_CHARS_PER_ENTRY];
+
+                    for (std::uint32_t i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+                        const std::size_t index = (part - 1) * LFN_CHARS_PER_ENTRY + i;
+
+                        if (index < child->name.length()) {
+                            chars[i] = child->name[index];
+                        } else {
+                            chars[i] = (index == child->name.length()) ? 0 : 0xFFFF;
+                        }
+                    }
+
+                    LongFileNameEntry lfn;
+                    std::memset(&lfn, 0, sizeof(LongFileNameEntry));
+
+                    lfn.position = static_cast<std::uint8_t>(part | ((part == lfn_count) ? 0x40 : 0));
+                    std::memcpy(lfn.name_part_1, chars, sizeof(lfn.name_part_1));
+                    lfn.attrib = static_cast<std::uint8_t>(EntryAttribute::LFN);
+                    lfn.checksum = checksum;
+                    std::memcpy(lfn.name_part_2, chars + 5, sizeof(lfn.name_part_2));
+                    std::memcpy(lfn.name_part_3, chars + 11, sizeof(lfn.name_part_3));
+
+                    std::memcpy(cursor, &lfn, sizeof(LongFileNameEntry));
+                    cursor += sizeof(LongFileNameEntry);
+                }
+            }
+
+            put_entry(child->short_name, static_cast<std::uint8_t>(child->is_directory ? EntryAttribute::DIRECTORY
+                : EntryAttribute::ARCHIVE), child->first_cluster, child->is_directory ? 0 : child->size,
+                child->date, child->time);
+        }
+    }
+
+    bool ImageBuilder::write(void *userdata, ImageWriteFunc write_func, ImageTruncateFunc truncate_func) {
+        if (!planned && !plan()) {
+            return false;
+        }
+
+        const std::uint32_t block_size = boot_block.bytes_per_block;
+        const std::uint32_t cluster_size = block_size * boot_block.num_blocks_per_allocation_unit;
+
+        StreamWriter out(userdata, write_func, STREAM_BUFFER_SIZE);
+
+        // Reserved region
+        out.put(&boot_block, sizeof(BootBlock));
+        out.put_zeros(static_cast<std::uint64_t>(boot_block.num_reserved_blocks) * block_size - sizeof(BootBlock));
+
+        // FAT, every chain is a single run
+        std::vector<ClusterID> fat(boot_block.num_blocks_per_fat * block_size / sizeof(ClusterID), CLUSTER_FREE);
+        fat[0] = static_cast<ClusterID>(0xFF00 | boot_block.media_descriptor);
+        fat[1] = CLUSTER_END_OF_CHAIN;
+
+        auto link_run = [&](const Node *node) {
+            for (std::uint32_t i = 0; i < node->cluster_count; i++) {
+                const std::uint32_t cluster = node->first_cluster + i;
+                fat[cluster] = (i + 1 == node->cluster_count) ? ClusterID(CLUSTER_END_OF_CHAIN)
+                    : static_cast<ClusterID>(cluster + 1);
+            }
+        };
+
+        std::for_each(directories.begin(), directories.end(), link_run);
+        std::for_each(files.begin(), files.end(), link_run);
+
+        for (std::uint32_t i = 0; i < boot_block.num_fat; i++) {
+            out.put(fat.data(), fat.size() * sizeof(ClusterID));
+        }
+
+        // Root directory region
+        std::vector<std::uint8_t> dir_buffer(boot_block.num_root_dirs * sizeof(FundamentalEntry));
+        generate_directory(root.get(), dir_buffer);
+        out.put(dir_buffer.data(), dir_buffer.size());
+
+        // Data region: directories first
+        for (const Node *dir : directories) {
+            dir_buffer.assign(dir->cluster_count * cluster_size, 0);
+            generate_directory(dir, dir_buffer);
+            out.put(dir_buffer.data(), dir_buffer.size());
+        }
+
+        // Then file content, read ahead on other threads if asked to
+        std::vector<std::uint32_t> sizes;
+        std::vector<const std::string*> paths;
+
+        for (const Node *file : files) {
+            sizes.push_back(file->size);
+            paths.push_back(file->in_memory ? nullptr : &file->host_path);
+        }
+
+        std::unique_ptr<FilePrefetcher> prefetcher;
+
+        if (options.reader_threads > 1) {
+            prefetcher.reset(new FilePrefetcher(sizes, paths, options.reader_threads, options.read_ahead_bytes));
+        }
+
+        std::vector<std::uint8_t> chunk;
+        std::uint32_t used_clusters = 0;
+
+        for (std::size_t i = 0; i < files.size() && !out.failed; i++) {
+            const Node *file = files[i];
+
+            if (file->in_memory) {
+                out.put(file->content.data(), file->content.size());
+            } else if (prefetcher && !prefetcher->acquire(i).streamed) {
+                FilePrefetcher::Slot &slot = prefetcher->slots[i];
+
+                if (slot.failed) {
+                    return false;
+                }
+
+                out.put(slot.data.data(), slot.data.size());
+                prefetcher->release(i);
+            } else if (file->size != 0) {
+                FILE *source = std::fopen(file->host_path.c_str(), "rb");
+                if (!source) {
+                    return false;
+                }
+
+                chunk.resize(STREAM_BUFFER_SIZE);
+                std::uint32_t size_left = file->size;
+
+                while (size_left != 0) {
+                    const std::uint32_t size_to_take = std::min<std::uint32_t>(size_left, STREAM_BUFFER_SIZE);
+
+                    if (std::fread(chunk.data(), 1, size_to_take, source) != size_to_take) {
+                        std::fclose(source);
+                        return false;
+                    }
+
+                    out.put(chunk.data(), size_to_take);
+                    size_left -= size_to_take;
+                }
+
+                std::fclose(source);
+            }
+
+            // Pad to the end of the last cluster
+            out.put_zeros(static_cast<std::uint64_t>(file->cluster_count) * cluster_size - file->size);
+            used_clusters += file->cluster_count;
+        }
+
+        // Whatever is left of the image is free space
+        std::uint64_t data_written = 0;
+
+        for (const Node *dir : directories) {
+            data_written += static_cast<std::uint64_t>(dir->cluster_count) * cluster_size;
+        }
+
+        data_written += static_cast<std::uint64_t>(used_clusters) * cluster_size;
+
+        out.flush();
+
+        // The hook takes a 32-bit size, bigger images get their zeros written
+        if (!out.failed && truncate_func && image_size() <= 0xFFFFFFFF
+            && truncate_func(userdata, static_cast<std::uint32_t>(image_size()))) {
+            return true;
+        }
+
+        out.put_zeros(image_size() - boot_block.data_region_start() - data_written);
+        out.flush();
+
+        return !out.failed;
+    }
+}
@@ -0,0 +1,222 @@
+#include <fat16/carve.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAT16_HAS_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace Fat16 {
+    static constexpr std::uint32_t FILTER_BUCKETS = 8;
+    static constexpr std::uint32_t FILTER_WIDTH = 16;
+    static constexpr std::size_t MAX_MAGIC_SIZE = 16;
+
+    const std::vector<CarveSignature> &get_default_signatures() {
+        static const std::vector<CarveSignature> signatures = {
+            { "jpeg", { 0xFF, 0xD8, 0xFF } },
+            { "png", { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A } },
+            { "gif", { 0x47, 0x49, 0x46, 0x38 } },
+            { "zip", { 0x50, 0x4B, 0x03, 0x04 } },
+            { "pdf", { 0x25, 0x50, 0x44, 0x46, 0x2D } },
+            { "elf", { 0x7F, 0x45, 0x4C, 0x46 } },
+            { "gzip", { 0x1F, 0x8B, 0x08 } }
+        };
+
+        return signatures;
+    }
+
+    namespace {
+        /**
+         * \brief Nibble tables for the first two bytes, one bit per bucket of signatures.
+         *
+         * A head passes for a bucket if both nibbles of both bytes are allowed by some
+         * signature of the bucket. That lets false positives through, never false negatives.
+         */
+        struct SignatureFilter {
+            std::uint8_t low_nibbles[2][16];
+            std::uint8_t high_nibbles[2][16];
+            std::vector<std::uint32_t> buckets[FILTER_BUCKETS];
+
+            explicit SignatureFilter(const std::vector<CarveSignature> &signatures) {
+                std::memset(low_nibbles, 0, sizeof(low_nibbles));
+                std::memset(high_nibbles, 0, sizeof(high_nibbles));
+
+                for (std::uint32_t i = 0; i < signatures.size(); i++) {
+                    // Signatures sharing a first byte share a bucket, so the filter stays tight
+                    const std::uint8_t first = signatures[i].magic[0];
+                    const std::uint32_t bucket = (first ^ (first >> 3)) % FILTER_BUCKETS;
+
+                    for (int byte = 0; byte < 2; byte++) {
+                        const std::uint8_t value = signatures[i].magic[byte];
+
+                        low_nibbles[byte][value & 0x0F] |= static_cast<std::uint8_t>(1 << bucket);
+                        high_nibbles[byte][value >> 4] |= static_cast<std::uint8_t>(1 << bucket);
+                    }
+
+                    buckets[bucket].push_back(i);
+                }
+            }
+        };
+    }
+
+    static void filter_heads_scalar(const SignatureFilter &filter, const std::uint8_t *heads, const std::uint32_t stride,
+        const std::uint32_t count, std::uint8_t *masks) {
+        for (std::uint32_t i = 0; i < count; i++) {
+            const std::uint8_t *head = heads + i * stride;
+
+            masks[i] = filter.low_nibbles[0][head[0] & 0x0F] & filter.high_nibbles[0][head[0] >> 4]
+                & filter.low_nibbles[1][head[1] & 0x0F] & filter.high_nibbles[1][head[1] >> 4];
+        }
+    }
+
+#if defined(FAT16_HAS_X86_DISPATCH)
+    __attribute__((target("ssse3")))
+    static void filter_heads_ssse3(const SignatureFilter &filter, const std::uint8_t *heads, const std::uint32_t stride,
+        const std::uint32_t count, std::uint8_t *masks) {
+        const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+
+        __m128i low_tables[2];
+        __m128i high_tables[2];
+
+        for (int byte = 0; byte < 2; byte++) {
+            low_tables[byte] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filter.low_nibbles[byte]));
+            high_tables[byte] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filter.high_nibbles[byte]));
+        }
+
+        std::uint32_t i = 0;
+
+        for (; i + FILTER_WIDTH <= count; i += FILTER_WIDTH) {
+            // Heads are a cluster apart, gather the two bytes of 16 of them
+            alignas(16) std::uint8_t bytes[2][FILTER_WIDTH];
+
+            for (std::uint32_t k = 0; k < FILTER_WIDTH; k++) {
+                const std::uint8_t *head = heads + (i + k) * stride;
+
+                bytes[0][k] = head[0];
+                bytes[1][k] = head[1];
+            }
+
+            __m128i result = _mm_set1_epi8(-1);
+
+            for (int byte = 0; byte < 2; byte++) {
+                const __m128i value = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes[byte]));
+                const __m128i low = _mm_and_si128(value, nibble_mask);
+                const __m128i high = _mm_and_si128(_mm_srli_epi16(value, 4), nibble_mask);
+
+                result = _mm_and_si128(result, _mm_and_si128(_mm_shuffle_epi8(low_tables[byte], low),
+                    _mm_shuffle_epi8(high_tables[byte], high)));
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(masks + i), result);
+        }
+
+        filter_heads_scalar(filter, heads + i * stride, stride, count - i, masks + i);
+    }
+#endif
+
+    typedef void (*FilterHeadsFunc)(const SignatureFilter &filter, const std::uint8_t *heads, const std::uint32_t stride,
+        const std::uint32_t count, std::uint8_t *masks);
+
+    static FilterHeadsFunc pick_head_filter() {
+#if defined(FAT16_HAS_X86_DISPATCH)
+        if (__builtin_cpu_supports("ssse3")) {
+            return filter_heads_ssse3;
+        }
+#endif
+
+        return filter_heads_scalar;
+    }
+
+    bool carve_free_clusters(Image &img, const std::vector<CarveSignature> &signatures, CarveMatchFunc match_func,
+        void *userdata, const CarveOptions &options) {
+        static const FilterHeadsFunc filter_heads = pick_head_filter();
+
+        for (const CarveSignature &signature : signatures) {
+            if (signature.magic.size() < 2 || signature.magic.size() > MAX_MAGIC_SIZE) {
+                return false;
+            }
+        }
+
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        const std::vector<ClusterID> &fat = img.fat_cache;
+        const std::uint32_t cluster_limit = img.cluster_limit();
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+
+        if (cluster_size < MAX_MAGIC_SIZE) {
+            return false;
+        }
+
+        const SignatureFilter filter(signatures);
+        const std::uint32_t batch_clusters = std::max<std::uint32_t>(options.batch_size / cluster_size, 1);
+
+        std::vector<std::uint8_t> batch(std::uint64_t(batch_clusters) * cluster_size);
+        std::vector<std::uint8_t> masks(batch_clusters);
+
+        std::uint32_t cluster = CLUSTER_FIRST_VALID;
+
+        while (cluster < cluster_limit) {
+            if (fat[cluster] != CLUSTER_FREE) {
+                cluster++;
+                continue;
+            }
+
+            std::uint32_t run_end = cluster;
+
+            while (run_end < cluster_limit && fat[run_end] == CLUSTER_FREE) {
+                run_end++;
+            }
+
+            // The run is read front to back, a batch at a time
+            for (; cluster < run_end; ) {
+                const std::uint32_t count = std::min(batch_clusters, run_end - cluster);
+                const std::uint32_t size = count * cluster_size;
+
+                if (img.read_at(img.cluster_offset(static_cast<ClusterID>(cluster)), batch.data(), size) != size) {
+                    return false;
+                }
+
+                filter_heads(filter, batch.data(), cluster_size, count, masks.data());
+
+                for (std::uint32_t i = 0; i < count; i++) {
+                    if (masks[i] == 0) {
+                        continue;
+                    }
+
+                    const std::uint8_t *head = batch.data() + i * cluster_size;
+
+                    for (std::uint32_t bucket = 0; bucket < FILTER_BUCKETS; bucket++) {
+                        if ((masks[i] & (1 << bucket)) == 0) {
+                            continue;
+                        }
+
+                        for (const std::uint32_t index : filter.buckets[bucket]) {
+                            const std::vector<std::uint8_t> &magic = signatures[index].magic;
+
+                            if (std::memcmp(head, magic.data(), magic.size()) != 0) {
+                                continue;
+                            }
+
+                            CarveMatch match;
+                            match.cluster = static_cast<ClusterID>(cluster + i);
+                            match.signature = index;
+                            match.free_run = run_end - (cluster + i);
+
+                            if (!match_func(userdata, match)) {
+                                return true;
+                            }
+                        }
+                    }
+                }
+
+                cluster += count;
+            }
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,263 @@
+#include <fat16/check.h>
+#include <fat16/walker.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+namespace Fat16 {
+    namespace {
+        struct CheckState {
+            const std::vector<ClusterID> &fat;
+            const std::uint32_t cluster_limit;
+            const std::uint32_t cluster_size;
+
+            std::unique_ptr<std::atomic<std::uint8_t>[]> claimed;   ///< Set once an entry's chain went through the cluster.
+
+            std::atomic<std::uint32_t> files;
+            std::atomic<std::uint32_t> directories;
+
+            std::mutex issues_lock;
+            std::vector<CheckIssue> &issues;
+
+            explicit CheckState(const std::vector<ClusterID> &fat, const std::uint32_t cluster_limit,
+                const std::uint32_t cluster_size, std::vector<CheckIssue> &issues)
+                : fat(fat)
+                , cluster_limit(cluster_limit)
+                , cluster_size(cluster_size)
+                , claimed(new std::atomic<std::uint8_t>[cluster_limit]())
+                , files(0)
+                , directories(0)
+                , issues(issues) {
+            }
+
+            bool is_in_range(const ClusterID cluster) const {
+                return cluster >= CLUSTER_FIRST_VALID && cluster < cluster_limit;
+            }
+        };
+    }
+
+    static void add_issue(CheckState &state, const CheckIssueType type, const EntryView &view, const ClusterID cluster,
+        const std::uint32_t detail = 0) {
+        CheckIssue issue;
+        issue.type = type;
+        issue.path = view.parent->to_string();
+
+        if (!issue.path.empty()) {
+            issue.path += u'/';
+        }
+
+        issue.path += view.get_filename();
+        issue.cluster = cluster;
+        issue.detail = detail;
+
+        std::lock_guard<std::mutex> guard(state.issues_lock);
+        state.issues.push_back(std::move(issue));
+    }
+
+    static WalkAction check_entry(void *userdata, const EntryView &view, const std::uint32_t worker) {
+        (void)worker;
+
+        CheckState &state = *static_cast<CheckState*>(userdata);
+        const bool is_directory = view.is_directory();
+
+        (is_directory ? state.directories : state.files)++;
+
+        const ClusterID starting_cluster = view.entry->starting_cluster;
+        ClusterID current = starting_cluster;
+
+        std::uint32_t length = 0;
+        bool intact = true;
+
+        if (current != CLUSTER_FREE && !state.is_in_range(current)) {
+            add_issue(state, CheckIssueType::BAD_CHAIN, view, current);
+            intact = false;
+        }
+
+        // Cross links and loops both show up as a cluster claimed before, which also bounds the loop
+        while (intact && current != CLUSTER_FREE) {
+            if (state.claimed[current].exchange(1) != 0) {
+                add_issue(state, CheckIssueType::CROSS_LINKED, view, current);
+                intact = false;
+                break;
+            }
+
+            length++;
+
+            const ClusterID next = state.fat[current];
+
+            if (Image::is_end_of_chain(next)) {
+                break;
+            }
+
+            if (!state.is_in_range(next)) {
+                add_issue(state, CheckIssueType::BAD_CHAIN, view, current);
+                intact = false;
+                break;
+            }
+
+            current = next;
+        }
+
+        // Directories have no size to check against
+        if (intact && !is_directory) {
+            const std::uint32_t expected = static_cast<std::uint32_t>(
+                (std::uint64_t(view.entry->file_size) + state.cluster_size - 1) / state.cluster_size);
+
+            if (length != expected) {
+                add_issue(state, CheckIssueType::SIZE_MISMATCH, view, starting_cluster, length);
+            }
+        }
+
+        return WalkAction::CONTINUE;
+    }
+
+    static void compare_fat_copies(Image &img, const std::vector<ClusterID> &fat, std::vector<CheckIssue> &issues) {
+        static constexpr std::uint32_t CHUNK_SIZE = 0x10000;
+
+        const std::uint32_t fat_bytes = img.boot_block.num_blocks_per_fat * img.boot_block.bytes_per_block;
+        const std::uint8_t *first_copy = reinterpret_cast<const std::uint8_t*>(fat.data());
+
+        std::vector<std::uint8_t> buffer(std::min(CHUNK_SIZE, fat_bytes));
+
+        for (std::uint32_t copy = 1; copy < img.boot_block.num_fat; copy++) {
+            const std::uint32_t copy_start = img.boot_block.fat_region_start() + copy * fat_bytes;
+
+            std::uint32_t first_difference = 0;
+            std::uint32_t differences = 0;
+
+            for (std::uint32_t position = 0; position < fat_bytes; position += CHUNK_SIZE) {
+                const std::uint32_t size = std::min(CHUNK_SIZE, fat_bytes - position);
+
+                if (img.read_at(copy_start + position, buffer.data(), size) != size) {
+                    // What can't be read can't match
+                    std::memset(buffer.data(), 0, size);
+                    buffer[0] = static_cast<std::uint8_t>(~first_copy[position]);
+                }
+
+                // memcmp is vectorized, entries are only looked at in chunks that differ
+                if (std::memcmp(buffer.data(), first_copy + position, size) == 0) {
+                    continue;
+                }
+
+                for (std::uint32_t i = 0; i + 1 < size; i += sizeof(ClusterID)) {
+                    if (std::memcmp(buffer.data() + i, first_copy + position + i, sizeof(ClusterID)) != 0) {
+                        if (differences++ == 0) {
+                            first_difference = (position + i) / sizeof(ClusterID);
+                        }
+                    }
+                }
+            }
+
+            if (differences != 0) {
+                CheckIssue issue;
+                issue.type = CheckIssueType::FAT_COPY_MISMATCH;
+                issue.cluster = static_cast<ClusterID>(first_difference);
+                issue.detail = (copy << 16) | std::min<std::uint32_t>(differences, 0xFFFF);
+
+                issues.push_back(std::move(issue));
+            }
+        }
+    }
+
+    bool check_image(Image &img, CheckReport &report, const CheckOptions &options) {
+        report = CheckReport();
+
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        const std::vector<ClusterID> &fat = img.fat_cache;
+        const std::uint32_t cluster_limit = img.cluster_limit();
+
+        CheckState state(fat, cluster_limit, img.bytes_per_cluster(), report.issues);
+
+        WalkOptions walk_options;
+        walk_options.threads = options.threads;
+
+        if (!walk(img, check_entry, &state, walk_options)) {
+            CheckIssue issue;
+            issue.type = CheckIssueType::UNREADABLE_DIRECTORY;
+            issue.cluster = 0;
+            issue.detail = 0;
+
+            report.issues.push_back(std::move(issue));
+        }
+
+        report.files = state.files;
+        report.directories = state.directories;
+
+        // One pass over the FAT: what's allocated, and how many links lead into each cluster
+        std::vector<std::uint8_t> links_in(cluster_limit, 0);
+
+        for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; cluster++) {
+            const ClusterID next = fat[cluster];
+
+            if (next == CLUSTER_FREE || next == CLUSTER_BAD) {
+                continue;
+            }
+
+            report.allocated_clusters++;
+
+            if (state.claimed[cluster] != 0) {
+                report.reached_clusters++;
+            } else {
+                report.lost_clusters++;
+            }
+
+            if (state.is_in_range(next) && links_in[next] != 0xFF) {
+                links_in[next]++;
+            }
+        }
+
+        // Lost chains start where nothing links in. Whatever is left after those is lost loops.
+        if (report.lost_clusters != 0) {
+            std::vector<bool> seen(cluster_limit, false);
+
+            for (int pass = 0; pass < 2; pass++) {
+                for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; cluster++) {
+                    const ClusterID value = fat[cluster];
+
+                    if (value == CLUSTER_FREE || value == CLUSTER_BAD || state.claimed[cluster] != 0 || seen[cluster]
+                        || (pass == 0 && links_in[cluster] != 0)) {
+                        continue;
+                    }
+
+                    std::uint32_t length = 0;
+                    ClusterID current = static_cast<ClusterID>(cluster);
+
+                    while (state.is_in_range(current) && !seen[current] && state.claimed[current] == 0) {
+                        seen[current] = true;
+                        length++;
+                        current = fat[current];
+                    }
+
+                    CheckIssue issue;
+                    issue.type = CheckIssueType::LOST_CHAIN;
+                    issue.cluster = static_cast<ClusterID>(cluster);
+                    issue.detail = length;
+
+                    report.issues.push_back(std::move(issue));
+                }
+            }
+        }
+
+        compare_fat_copies(img, fat, report.issues);
+
+        std::sort(report.issues.begin(), report.issues.end(), [](const CheckIssue &a, const CheckIssue &b) {
+            if (a.type != b.type) {
+                return a.type < b.type;
+            }
+
+            if (a.path != b.path) {
+                return a.path < b.path;
+            }
+
+            return a.cluster < b.cluster;
+        });
+
+        return true;
+    }
+}
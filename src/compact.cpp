@@ -0,0 +1,307 @@
+#include <fat16/compact.h>
+#include <fat16/directory.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace Fat16 {
+    namespace {
+        /**
+         * \brief The starting cluster field of a directory slot.
+         */
+        struct ClusterReference {
+            std::uint32_t offset;                   ///< Where the field is before the move.
+            ClusterID cluster;
+        };
+
+        /**
+         * \brief Gathers moved data into one buffer, written out once full or when the target stops being contiguous.
+         */
+        struct DataMover {
+            Image &img;
+            std::vector<std::uint8_t> buffer;
+            std::uint32_t write_offset;
+            std::uint32_t filled;
+
+            explicit DataMover(Image &img, const std::uint32_t buffer_size)
+                : img(img)
+                , buffer(buffer_size)
+                , write_offset(0)
+                , filled(0) {
+            }
+
+            bool finish() {
+                if (filled != 0 && !img.write_data(write_offset, buffer.data(), filled)) {
+                    return false;
+                }
+
+                write_offset += filled;
+                filled = 0;
+
+                return true;
+            }
+
+            bool move(std::uint32_t source, const std::uint32_t target, std::uint32_t size) {
+                if (filled != 0 && write_offset + filled != target && !finish()) {
+                    return false;
+                }
+
+                if (filled == 0) {
+                    write_offset = target;
+                }
+
+                const std::uint32_t buffer_size = static_cast<std::uint32_t>(buffer.size());
+
+                while (size != 0) {
+                    const std::uint32_t size_to_take = std::min(size, buffer_size - filled);
+
+                    if (img.read_at(source, buffer.data() + filled, size_to_take) != size_to_take) {
+                        return false;
+                    }
+
+                    source += size_to_take;
+                    size -= size_to_take;
+                    filled += size_to_take;
+
+                    if (filled == buffer_size && !finish()) {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+        };
+    }
+
+    /**
+     * \brief Find the starting cluster of every entry, dot entries included, reading each directory once.
+     */
+    static bool collect_references(Image &img, std::vector<ClusterReference> &references) {
+        const std::uint32_t cluster_limit = img.cluster_limit();
+
+        std::vector<bool> visited(cluster_limit);
+        std::vector<ClusterID> pending(1, CLUSTER_FREE);
+        DirectoryBuffer buffer;
+
+        while (!pending.empty()) {
+            const ClusterID directory = pending.back();
+            pending.pop_back();
+
+            if (!buffer.read(img, directory)) {
+                return false;
+            }
+
+            for (std::uint32_t slot = 0; slot < buffer.slot_count() && buffer.classes[slot] != SLOT_END; slot++) {
+                if (buffer.classes[slot] != SLOT_ENTRY && buffer.classes[slot] != SLOT_DOT) {
+                    continue;
+                }
+
+                const FundamentalEntry &entry = *buffer.get_record(slot);
+                const ClusterID cluster = entry.starting_cluster;
+
+                if (cluster < CLUSTER_FIRST_VALID || cluster >= cluster_limit) {
+                    continue;
+                }
+
+                references.push_back({ buffer.get_slot_offset(img, slot)
+                    + static_cast<std::uint32_t>(offsetof(FundamentalEntry, starting_cluster)), cluster });
+
+                if (buffer.classes[slot] == SLOT_ENTRY && (entry.file_attributes & (int)EntryAttribute::DIRECTORY)
+                    && !visited[cluster]) {
+                    visited[cluster] = true;
+                    pending.push_back(cluster);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool compact(Image &img, CompactResult &result, const CompactOptions &options) {
+        result = CompactResult();
+
+        // Everything is worked out from the FAT and directories on disk
+        if (!img.write_func || !img.flush() || !img.cache_fat()) {
+            return false;
+        }
+
+        const BootBlock old_boot = img.boot_block;
+        const std::uint32_t block_size = old_boot.bytes_per_block;
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        const std::uint32_t old_clusters = img.total_clusters();
+        const std::uint32_t cluster_limit = old_clusters + CLUSTER_FIRST_VALID;
+        const std::vector<ClusterID> fat = img.fat_cache;
+
+        if (old_clusters == 0) {
+            return false;
+        }
+
+        std::vector<ClusterReference> references;
+
+        if (!collect_references(img, references)) {
+            return false;
+        }
+
+        // Number used clusters again in the same order, stepping over bad ones. Never above the old number.
+        std::vector<ClusterID> remap(cluster_limit, CLUSTER_FREE);
+        std::uint32_t next = CLUSTER_FIRST_VALID;
+        bool has_bad_clusters = false;
+
+        for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; cluster++) {
+            has_bad_clusters |= (fat[cluster] == CLUSTER_BAD);
+
+            if (fat[cluster] == CLUSTER_FREE || fat[cluster] == CLUSTER_BAD) {
+                continue;
+            }
+
+            while (fat[next] == CLUSTER_BAD) {
+                next++;
+            }
+
+            remap[cluster] = static_cast<ClusterID>(next++);
+        }
+
+        const std::uint32_t new_clusters = static_cast<std::uint32_t>(std::min<std::uint64_t>(old_clusters,
+            std::max<std::uint64_t>(static_cast<std::uint64_t>(next - CLUSTER_FIRST_VALID) + options.spare_clusters,
+            options.min_clusters)));
+
+        BootBlock new_boot = old_boot;
+
+        // A bad mark is kept on its cluster number, which only stays on the same sectors if the data region doesn't move
+        if (!has_bad_clusters) {
+            new_boot.num_blocks_per_fat = static_cast<std::uint16_t>(((new_clusters + CLUSTER_FIRST_VALID) * sizeof(ClusterID)
+                + block_size - 1) / block_size);
+        }
+
+        // Every block the FAT copies lose moves the root directory and the data region down
+        const std::uint32_t shift = (old_boot.num_blocks_per_fat - new_boot.num_blocks_per_fat) * old_boot.num_fat * block_size;
+        const std::uint32_t old_data_start = old_boot.data_region_start();
+        const std::uint32_t new_data_start = new_boot.data_region_start();
+        const std::uint32_t total_blocks = new_data_start / block_size + new_clusters * old_boot.num_blocks_per_allocation_unit;
+
+        new_boot.num_blocks_in_image_op1 = static_cast<std::uint16_t>(total_blocks < 0x10000 ? total_blocks : 0);
+        new_boot.num_blocks_in_image_op2 = (total_blocks < 0x10000 ? 0 : total_blocks);
+
+        result.old_size = old_boot.total_blocks() * block_size;
+        result.new_size = std::max(total_blocks * block_size, new_data_start + new_clusters * cluster_size);
+        result.old_clusters = old_clusters;
+        result.new_clusters = new_clusters;
+        result.old_blocks_per_fat = old_boot.num_blocks_per_fat;
+        result.new_blocks_per_fat = new_boot.num_blocks_per_fat;
+
+        // The root directory first: the data region may now start where it was
+        if (shift != 0) {
+            const std::uint32_t root_start = old_boot.root_directory_region_start();
+            const std::uint32_t root_size = old_data_start - root_start;
+
+            std::vector<std::uint8_t> root(root_size);
+
+            if (img.read_at(root_start, root.data(), root_size) != root_size
+                || !img.write_data(root_start - shift, root.data(), root_size)) {
+                return false;
+            }
+        }
+
+        // Everything lands at or below where it was read from, so one ascending pass never overwrites data still to move
+        DataMover mover(img, std::max(options.buffer_size, cluster_size) / cluster_size * cluster_size);
+
+        for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; ) {
+            if (remap[cluster] == CLUSTER_FREE) {
+                cluster++;
+                continue;
+            }
+
+            // As many clusters as stay contiguous both where they are and where they go
+            std::uint32_t count = 1;
+
+            while (cluster + count < cluster_limit && remap[cluster + count] == remap[cluster] + count) {
+                count++;
+            }
+
+            const std::uint32_t source = old_data_start + (cluster - CLUSTER_FIRST_VALID) * cluster_size;
+            const std::uint32_t target = new_data_start + (remap[cluster] - CLUSTER_FIRST_VALID) * cluster_size;
+
+            if (source != target) {
+                if (!mover.move(source, target, count * cluster_size)) {
+                    return false;
+                }
+
+                result.clusters_moved += count;
+            }
+
+            cluster += count;
+        }
+
+        if (!mover.finish()) {
+            return false;
+        }
+
+        std::vector<ClusterID> new_fat(new_boot.num_blocks_per_fat * block_size / sizeof(ClusterID), CLUSTER_FREE);
+        new_fat[0] = fat[0];
+        new_fat[1] = fat[1];
+
+        for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; cluster++) {
+            const ClusterID successor = fat[cluster];
+
+            if (successor == CLUSTER_BAD) {
+                if (cluster < new_clusters + CLUSTER_FIRST_VALID) {
+                    new_fat[cluster] = CLUSTER_BAD;
+                }
+            } else if (remap[cluster] != CLUSTER_FREE) {
+                // A link to a cluster not in use was broken already, it ends the chain rather than point at what moved there
+                const bool links = successor >= CLUSTER_FIRST_VALID && successor < cluster_limit && remap[successor] != CLUSTER_FREE;
+                new_fat[remap[cluster]] = links ? remap[successor] : (Image::is_end_of_chain(successor) ? successor
+                    : static_cast<ClusterID>(CLUSTER_END_OF_CHAIN));
+            }
+        }
+
+        const std::uint32_t fat_size = static_cast<std::uint32_t>(new_fat.size() * sizeof(ClusterID));
+
+        for (std::uint32_t copy = 0; copy < old_boot.num_fat; copy++) {
+            if (!img.write_data(old_boot.fat_region_start() + copy * fat_size, new_fat.data(), fat_size)) {
+                return false;
+            }
+        }
+
+        img.boot_block = new_boot;
+        img.fat_cache = std::move(new_fat);
+        img.drop_name_indexes();
+
+        for (const ClusterReference &reference : references) {
+            const ClusterID renumbered = remap[reference.cluster];
+
+            if (renumbered == CLUSTER_FREE || renumbered == reference.cluster) {
+                continue;
+            }
+
+            // Directory slots moved with their cluster, or with the root directory
+            std::uint32_t offset = reference.offset - shift;
+
+            if (reference.offset >= old_data_start) {
+                const std::uint32_t position = reference.offset - old_data_start;
+                const ClusterID directory_cluster = static_cast<ClusterID>(position / cluster_size + CLUSTER_FIRST_VALID);
+
+                offset = new_data_start + (remap[directory_cluster] - CLUSTER_FIRST_VALID) * cluster_size + position % cluster_size;
+            }
+
+            if (!img.write_metadata(offset, &renumbered, sizeof(ClusterID))) {
+                return false;
+            }
+        }
+
+        if (!img.write_metadata(0, &new_boot, sizeof(BootBlock)) || !img.flush()) {
+            return false;
+        }
+
+        if (img.truncate_func) {
+            if (!img.truncate_func(img.userdata, result.new_size)) {
+                return false;
+            }
+
+            result.truncated = true;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,489 @@
+#include <fat16/compressed.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FAT16_HAS_POSIX_FD 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(FAT16_HAS_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace Fat16 {
+    // Frame sizes one table member holds, so its extra field stays under 64 KiB
+    static constexpr std::uint32_t INDEX_ENTRIES_PER_MEMBER = 16000;
+    static constexpr std::uint32_t EMPTY_MEMBER_SIZE = 22;         ///< Header, XLEN, empty deflate block and trailer.
+    static constexpr std::uint32_t SUBFIELD_HEADER_SIZE = 4;
+    static constexpr std::uint32_t TAIL_PAYLOAD_SIZE = 24;
+
+    static_assert(EMPTY_MEMBER_SIZE + SUBFIELD_HEADER_SIZE + TAIL_PAYLOAD_SIZE == COMPRESSED_TAIL_SIZE,
+        "Tail member size doesn't match to what expected.");
+
+    static void put_le(std::uint8_t *dest, std::uint64_t value, const std::uint32_t bytes) {
+        for (std::uint32_t i = 0; i < bytes; i++, value >>= 8) {
+            dest[i] = static_cast<std::uint8_t>(value);
+        }
+    }
+
+    static std::uint64_t get_le(const std::uint8_t *source, const std::uint32_t bytes) {
+        std::uint64_t value = 0;
+
+        for (std::uint32_t i = bytes; i != 0; i--) {
+            value = (value << 8) | source[i - 1];
+        }
+
+        return value;
+    }
+
+    /**
+     * \brief Build a gzip member with no content, carrying one extra subfield.
+     */
+    static std::vector<std::uint8_t> make_empty_member(const char id_1, const char id_2, const std::vector<std::uint8_t> &payload) {
+        const std::uint32_t extra_size = SUBFIELD_HEADER_SIZE + static_cast<std::uint32_t>(payload.size());
+        std::vector<std::uint8_t> member(EMPTY_MEMBER_SIZE + extra_size, 0);
+
+        // Magic, deflate, FEXTRA set, no time, no extra flags, unknown OS
+        const std::uint8_t header[10] = { 0x1F, 0x8B, 8, 0x04, 0, 0, 0, 0, 0, 0xFF };
+        std::memcpy(member.data(), header, sizeof(header));
+
+        put_le(member.data() + 10, extra_size, 2);
+        member[12] = static_cast<std::uint8_t>(id_1);
+        member[13] = static_cast<std::uint8_t>(id_2);
+        put_le(member.data() + 14, payload.size(), 2);
+        std::copy(payload.begin(), payload.end(), member.begin() + 16);
+
+        // A final fixed Huffman block holding only its end code. CRC and size of nothing are 0.
+        member[16 + payload.size()] = 0x03;
+        member[17 + payload.size()] = 0x00;
+
+        return member;
+    }
+
+    /**
+     * \brief   Get the payload of the one subfield an empty member made by make_empty_member() carries.
+     * \returns Size of the whole member, or 0 if it isn't one with that subfield.
+     */
+    static std::uint32_t parse_empty_member(const std::uint8_t *member, const std::uint64_t available, const char id_1,
+        const char id_2, const std::uint8_t *&payload, std::uint32_t &payload_size) {
+        if (available < EMPTY_MEMBER_SIZE + SUBFIELD_HEADER_SIZE || member[0] != 0x1F || member[1] != 0x8B || member[2] != 8
+            || (member[3] & 0x04) == 0 || member[12] != static_cast<std::uint8_t>(id_1) || member[13] != static_cast<std::uint8_t>(id_2)) {
+            return 0;
+        }
+
+        const std::uint32_t extra_size = static_cast<std::uint32_t>(get_le(member + 10, 2));
+        payload_size = static_cast<std::uint32_t>(get_le(member + 14, 2));
+        payload = member + 16;
+
+        if (extra_size != payload_size + SUBFIELD_HEADER_SIZE || available < EMPTY_MEMBER_SIZE + extra_size) {
+            return 0;
+        }
+
+        return EMPTY_MEMBER_SIZE + extra_size;
+    }
+
+    CompressedImageWriter::CompressedImageWriter(void *userdata, ImageWriteFunc write_func, const CompressOptions &options)
+        : userdata(userdata)
+        , write_func(write_func)
+        , options(options)
+        , frame(std::max<std::uint32_t>(options.frame_size, 1))
+        , filled(0)
+        , written(0)
+        , image_size(0)
+        , failed(false) {
+    }
+
+    bool CompressedImageWriter::put(const void *data, const std::uint32_t bytes) {
+        if (!failed && bytes != 0) {
+            failed = (write_func(userdata, data, bytes) != bytes);
+            written += bytes;
+        }
+
+        return !failed;
+    }
+
+    bool CompressedImageWriter::compress_frame() {
+#if defined(FAT16_HAS_ZLIB)
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+
+        // 16 over the window bits asks for a gzip wrapper
+        if (deflateInit2(&stream, options.level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed = true;
+            return false;
+        }
+
+        output.resize(deflateBound(&stream, filled));
+
+        stream.next_in = frame.data();
+        stream.avail_in = filled;
+        stream.next_out = output.data();
+        stream.avail_out = static_cast<uInt>(output.size());
+
+        const int status = deflate(&stream, Z_FINISH);
+        const std::uint32_t compressed = static_cast<std::uint32_t>(stream.total_out);
+
+        deflateEnd(&stream);
+
+        if (status != Z_STREAM_END) {
+            failed = true;
+            return false;
+        }
+
+        frame_sizes.push_back(compressed);
+        filled = 0;
+
+        return put(output.data(), compressed);
+#else
+        failed = true;
+        return false;
+#endif
+    }
+
+    bool CompressedImageWriter::write(const void *data, std::uint32_t bytes) {
+        const std::uint8_t *source = static_cast<const std::uint8_t*>(data);
+        const std::uint32_t frame_size = static_cast<std::uint32_t>(frame.size());
+
+        while (bytes != 0 && !failed) {
+            const std::uint32_t size_to_take = std::min(bytes, frame_size - filled);
+            std::memcpy(frame.data() + filled, source, size_to_take);
+
+            filled += size_to_take;
+            source += size_to_take;
+            bytes -= size_to_take;
+            image_size += size_to_take;
+
+            if (filled == frame_size) {
+                compress_frame();
+            }
+        }
+
+        return !failed;
+    }
+
+    bool CompressedImageWriter::finish() {
+        if (filled != 0) {
+            compress_frame();
+        }
+
+        if (failed || image_size > 0xFFFFFFFFu) {
+            return false;
+        }
+
+        const std::uint64_t index_offset = written;
+
+        for (std::size_t first = 0; first < frame_sizes.size(); first += INDEX_ENTRIES_PER_MEMBER) {
+            const std::size_t count = std::min<std::size_t>(INDEX_ENTRIES_PER_MEMBER, frame_sizes.size() - first);
+            std::vector<std::uint8_t> payload(count * sizeof(std::uint32_t));
+
+            for (std::size_t i = 0; i < count; i++) {
+                put_le(payload.data() + i * sizeof(std::uint32_t), frame_sizes[first + i], sizeof(std::uint32_t));
+            }
+
+            const std::vector<std::uint8_t> member = make_empty_member('F', 'I', payload);
+            put(member.data(), static_cast<std::uint32_t>(member.size()));
+        }
+
+        std::vector<std::uint8_t> tail(TAIL_PAYLOAD_SIZE);
+        put_le(tail.data(), index_offset, 8);
+        put_le(tail.data() + 8, frame_sizes.size(), 4);
+        put_le(tail.data() + 12, frame.size(), 4);
+        put_le(tail.data() + 16, image_size, 8);
+
+        const std::vector<std::uint8_t> member = make_empty_member('F', 'T', tail);
+        return put(member.data(), static_cast<std::uint32_t>(member.size()));
+    }
+
+    std::uint32_t CompressedImageWriter::write_hook(void *userdata, const void *buffer, std::uint32_t bytes) {
+        return static_cast<CompressedImageWriter*>(userdata)->write(buffer, bytes) ? bytes : 0;
+    }
+
+#if defined(FAT16_HAS_POSIX_FD)
+    static bool read_fully(const int fd, void *dest, std::uint64_t offset, std::size_t bytes) {
+        std::uint8_t *output = static_cast<std::uint8_t*>(dest);
+
+        while (bytes != 0) {
+            const ssize_t bytes_read = pread(fd, output, bytes, static_cast<off_t>(offset));
+
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes_read <= 0) {
+                return false;
+            }
+
+            output += bytes_read;
+            offset += static_cast<std::uint64_t>(bytes_read);
+            bytes -= static_cast<std::size_t>(bytes_read);
+        }
+
+        return true;
+    }
+#endif
+
+    CompressedImage::CompressedImage(const CompressedReadOptions &options)
+        : fd(-1)
+        , cursor(0)
+        , frame_size(0)
+        , image_size(0)
+        , options(options)
+        , stats() {
+    }
+
+    CompressedImage::~CompressedImage() {
+        close();
+    }
+
+    bool CompressedImage::open(const char *path) {
+        close();
+
+#if defined(FAT16_HAS_POSIX_FD) && defined(FAT16_HAS_ZLIB)
+        fd = ::open(path, O_RDONLY);
+
+        struct stat info;
+
+        if (fd < 0 || fstat(fd, &info) != 0 || !read_index(static_cast<std::uint64_t>(info.st_size))) {
+            close();
+            return false;
+        }
+
+        return true;
+#else
+        (void)path;
+        return false;
+#endif
+    }
+
+    void CompressedImage::close() {
+#if defined(FAT16_HAS_POSIX_FD)
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+
+        fd = -1;
+        cursor = 0;
+        frame_size = 0;
+        image_size = 0;
+        frame_offsets.clear();
+
+        std::lock_guard<std::mutex> guard(lock);
+        cache.clear();
+        cache_index.clear();
+        stats = CompressedReadStats();
+    }
+
+    bool CompressedImage::read_index(const std::uint64_t file_size) {
+#if defined(FAT16_HAS_POSIX_FD)
+        std::uint8_t tail[COMPRESSED_TAIL_SIZE];
+
+        if (file_size < COMPRESSED_TAIL_SIZE || !read_fully(fd, tail, file_size - COMPRESSED_TAIL_SIZE, COMPRESSED_TAIL_SIZE)) {
+            return false;
+        }
+
+        const std::uint8_t *payload = nullptr;
+        std::uint32_t payload_size = 0;
+
+        if (parse_empty_member(tail, COMPRESSED_TAIL_SIZE, 'F', 'T', payload, payload_size) != COMPRESSED_TAIL_SIZE
+            || payload_size != TAIL_PAYLOAD_SIZE) {
+            return false;
+        }
+
+        const std::uint64_t index_offset = get_le(payload, 8);
+        const std::uint32_t frame_count = static_cast<std::uint32_t>(get_le(payload + 8, 4));
+        const std::uint64_t size = get_le(payload + 16, 8);
+
+        frame_size = static_cast<std::uint32_t>(get_le(payload + 12, 4));
+
+        if (index_offset > file_size - COMPRESSED_TAIL_SIZE || frame_size == 0 || size > 0xFFFFFFFFu
+            || (size + frame_size - 1) / frame_size != frame_count) {
+            return false;
+        }
+
+        image_size = static_cast<std::uint32_t>(size);
+
+        // The whole frame table in one read
+        std::vector<std::uint8_t> table(static_cast<std::size_t>(file_size - COMPRESSED_TAIL_SIZE - index_offset));
+
+        if (!table.empty() && !read_fully(fd, table.data(), index_offset, table.size())) {
+            return false;
+        }
+
+        // Each frame takes 4 bytes of the table, more than it can hold is a damaged or forged tail
+        if (frame_count > table.size() / sizeof(std::uint32_t)) {
+            return false;
+        }
+
+        frame_offsets.reserve(frame_count + 1);
+        frame_offsets.push_back(0);
+
+        for (std::size_t position = 0; position < table.size(); ) {
+            const std::uint32_t member_size = parse_empty_member(table.data() + position, table.size() - position, 'F', 'I',
+                payload, payload_size);
+
+            if (member_size == 0 || payload_size % sizeof(std::uint32_t) != 0) {
+                return false;
+            }
+
+            for (std::uint32_t i = 0; i < payload_size; i += sizeof(std::uint32_t)) {
+                frame_offsets.push_back(frame_offsets.back() + get_le(payload + i, sizeof(std::uint32_t)));
+            }
+
+            position += member_size;
+        }
+
+        // Frames must end right where the table starts
+        return frame_offsets.size() == frame_count + 1u && frame_offsets.back() == index_offset;
+#else
+        (void)file_size;
+        return false;
+#endif
+    }
+
+    std::shared_ptr<const std::vector<std::uint8_t>> CompressedImage::get_frame(const std::uint32_t index) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto cached = cache_index.find(index);
+
+            if (cached != cache_index.end()) {
+                cache.splice(cache.begin(), cache, cached->second);
+                stats.cache_hits++;
+                return cached->second->data;
+            }
+        }
+
+#if defined(FAT16_HAS_POSIX_FD) && defined(FAT16_HAS_ZLIB)
+        // Inflated without the lock, so threads reading other frames don't wait on it
+        const std::uint64_t start = frame_offsets[index];
+        std::vector<std::uint8_t> compressed(static_cast<std::size_t>(frame_offsets[index + 1] - start));
+
+        if (!read_fully(fd, compressed.data(), start, compressed.size())) {
+            return nullptr;
+        }
+
+        std::shared_ptr<std::vector<std::uint8_t>> data = std::make_shared<std::vector<std::uint8_t>>(
+            std::min<std::uint64_t>(frame_size, static_cast<std::uint64_t>(image_size) - static_cast<std::uint64_t>(index) * frame_size));
+
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+
+        if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+            return nullptr;
+        }
+
+        stream.next_in = compressed.data();
+        stream.avail_in = static_cast<uInt>(compressed.size());
+        stream.next_out = data->data();
+        stream.avail_out = static_cast<uInt>(data->size());
+
+        const int status = inflate(&stream, Z_FINISH);
+        const bool complete = (status == Z_STREAM_END && stream.avail_out == 0);
+
+        inflateEnd(&stream);
+
+        if (!complete) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        stats.frames_inflated++;
+
+        // Another thread may have inflated it meanwhile
+        if (cache_index.find(index) == cache_index.end() && options.cache_frames != 0) {
+            cache.push_front({ index, data });
+            cache_index[index] = cache.begin();
+
+            if (cache.size() > options.cache_frames) {
+                cache_index.erase(cache.back().index);
+                cache.pop_back();
+            }
+        }
+
+        return data;
+#else
+        return nullptr;
+#endif
+    }
+
+    std::uint32_t CompressedImage::read(void *dest, const std::uint32_t offset, const std::uint32_t bytes) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stats.reads++;
+        }
+
+        if (offset >= image_size || frame_size == 0) {
+            return 0;
+        }
+
+        const std::uint32_t end = offset + std::min(bytes, image_size - offset);
+        std::uint8_t *output = static_cast<std::uint8_t*>(dest);
+        std::uint32_t position = offset;
+
+        while (position < end) {
+            const std::uint32_t index = position / frame_size;
+            const std::shared_ptr<const std::vector<std::uint8_t>> data = get_frame(index);
+
+            if (!data) {
+                break;
+            }
+
+            const std::uint32_t offset_in_frame = position - index * frame_size;
+            const std::uint32_t size_to_take = std::min(end - position, static_cast<std::uint32_t>(data->size()) - offset_in_frame);
+
+            std::memcpy(output + (position - offset), data->data() + offset_in_frame, size_to_take);
+            position += size_to_take;
+        }
+
+        return position - offset;
+    }
+
+    CompressedReadStats CompressedImage::get_stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        return stats;
+    }
+
+    void CompressedImage::attach(Image &img) {
+        img.read_at_func = read_at_hook;
+    }
+
+    std::uint32_t CompressedImage::read_hook(void *userdata, void *buffer, std::uint32_t bytes) {
+        CompressedImage &image = *static_cast<CompressedImage*>(userdata);
+        const std::uint32_t bytes_read = image.read(buffer, image.cursor, bytes);
+
+        image.cursor += bytes_read;
+        return bytes_read;
+    }
+
+    std::uint32_t CompressedImage::seek_hook(void *userdata, std::uint32_t offset, int mode) {
+        CompressedImage &image = *static_cast<CompressedImage*>(userdata);
+
+        switch (mode) {
+        case IMAGE_SEEK_MODE_BEG:
+            image.cursor = offset;
+            break;
+
+        case IMAGE_SEEK_MODE_CUR:
+            image.cursor += offset;
+            break;
+
+        case IMAGE_SEEK_MODE_END:
+            image.cursor = image.image_size + offset;
+            break;
+
+        default:
+            break;
+        }
+
+        return image.cursor;
+    }
+
+    std::uint32_t CompressedImage::read_at_hook(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t bytes) {
+        return static_cast<CompressedImage*>(userdata)->read(buffer, offset, bytes);
+    }
+}
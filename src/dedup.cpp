@@ -0,0 +1,525 @@
+#include <fat16/dedup.h>
+#include <fat16/hash.h>
+#include <fat16/sparse.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FAT16_HAS_POSIX_FD 1
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Fat16 {
+    static const char CHUNK_TABLE_MAGIC[8] = { 'F', 'A', 'T', '1', '6', 'C', 'H', 'K' };
+    static const char RECIPE_MAGIC[8] = { 'F', 'A', 'T', '1', '6', 'R', 'C', 'P' };
+    static constexpr std::uint32_t DEDUP_VERSION = 1;
+    static constexpr std::uint32_t RESTORE_BATCH_SIZE = 0x400000;
+    static constexpr std::uint32_t ZERO_BLOCK_SIZE = 0x10000;
+
+    static const std::uint8_t zero_block[ZERO_BLOCK_SIZE] = {};
+
+    struct DedupStore::PendingChunk {
+        std::uint32_t offset;                       ///< In the batch buffer.
+        std::uint32_t size;
+        bool zero;
+        ChunkDigest digest;
+    };
+
+    /**
+     * \brief Read from the pack at a 64-bit offset, which fseek() can't reach where long is 32-bit.
+     */
+    static bool read_pack(FILE *pack, void *dest, std::uint64_t offset, std::size_t bytes) {
+#if defined(FAT16_HAS_POSIX_FD)
+        std::uint8_t *output = static_cast<std::uint8_t*>(dest);
+
+        while (bytes != 0) {
+            const ssize_t bytes_read = pread(fileno(pack), output, bytes, static_cast<off_t>(offset));
+
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes_read <= 0) {
+                return false;
+            }
+
+            output += bytes_read;
+            offset += static_cast<std::uint64_t>(bytes_read);
+            bytes -= static_cast<std::size_t>(bytes_read);
+        }
+
+        return true;
+#else
+        return offset <= 0x7FFFFFFF && std::fseek(pack, static_cast<long>(offset), SEEK_SET) == 0
+            && std::fread(dest, 1, bytes, pack) == bytes;
+#endif
+    }
+
+    static bool get_pack_size(FILE *pack, std::uint64_t &size) {
+#if defined(FAT16_HAS_POSIX_FD)
+        struct stat info;
+
+        if (fstat(fileno(pack), &info) != 0) {
+            return false;
+        }
+
+        size = static_cast<std::uint64_t>(info.st_size);
+        return true;
+#else
+        if (std::fseek(pack, 0, SEEK_END) != 0) {
+            return false;
+        }
+
+        const long position = std::ftell(pack);
+        size = static_cast<std::uint64_t>(position);
+
+        return position >= 0;
+#endif
+    }
+
+    bool ChunkDigest::operator==(const ChunkDigest &other) const {
+        return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+
+    std::size_t ChunkDigestHash::operator()(const ChunkDigest &digest) const {
+        // Already uniformly spread
+        std::size_t value = 0;
+        std::memcpy(&value, digest.bytes, sizeof(value));
+
+        return value;
+    }
+
+    static bool is_zero(const std::uint8_t *data, std::uint32_t size) {
+        while (size != 0) {
+            const std::uint32_t size_to_take = std::min(size, ZERO_BLOCK_SIZE);
+
+            if (std::memcmp(data, zero_block, size_to_take) != 0) {
+                return false;
+            }
+
+            data += size_to_take;
+            size -= size_to_take;
+        }
+
+        return true;
+    }
+
+    /**
+     * \brief Add a piece to a recipe, merging runs of zeros.
+     */
+    static void append_entry(std::vector<RecipeEntry> &recipe, const std::uint32_t chunk, const std::uint32_t size) {
+        if (chunk == DEDUP_ZEROS && !recipe.empty() && recipe.back().chunk == DEDUP_ZEROS
+            && recipe.back().size <= 0xFFFFFFFFu - size) {
+            recipe.back().size += size;
+            return;
+        }
+
+        recipe.push_back({ chunk, size });
+    }
+
+    DedupStore::DedupStore()
+        : pack(nullptr)
+        , table(nullptr)
+        , pack_size(0) {
+    }
+
+    DedupStore::~DedupStore() {
+        close();
+    }
+
+    void DedupStore::close() {
+        if (pack) {
+            std::fclose(pack);
+        }
+
+        if (table) {
+            std::fclose(table);
+        }
+
+        pack = nullptr;
+        table = nullptr;
+        pack_size = 0;
+        chunks.clear();
+        chunk_ids.clear();
+    }
+
+    bool DedupStore::open(const std::string &directory) {
+        close();
+
+        this->directory = directory;
+
+        const std::string pack_path = directory + "/chunks.pack";
+        const std::string table_path = directory + "/chunks.table";
+
+        pack = std::fopen(pack_path.c_str(), "a+b");
+
+        if (!pack || !get_pack_size(pack, pack_size)) {
+            close();
+            return false;
+        }
+
+        // Chunks whose bytes didn't all make it to the pack are dropped
+        bool rewrite = true;
+        FILE *f = std::fopen(table_path.c_str(), "rb");
+
+        if (f) {
+            char magic[sizeof(CHUNK_TABLE_MAGIC)];
+            std::uint32_t version = 0;
+
+            if (std::fread(magic, sizeof(magic), 1, f) == 1 && std::fread(&version, sizeof(version), 1, f) == 1
+                && std::memcmp(magic, CHUNK_TABLE_MAGIC, sizeof(magic)) == 0 && version == DEDUP_VERSION) {
+                ChunkRecord record;
+                std::size_t bytes_read = 0;
+                rewrite = false;
+
+                while ((bytes_read = std::fread(&record, 1, sizeof(record), f)) == sizeof(record)) {
+                    if (record.offset + record.size > pack_size) {
+                        rewrite = true;
+                        break;
+                    }
+
+                    chunk_ids.emplace(record.digest, static_cast<std::uint32_t>(chunks.size()));
+                    chunks.push_back(record);
+                }
+
+                // A torn last record would put every record appended after it off by its size
+                rewrite = rewrite || bytes_read != 0 || !std::feof(f);
+            }
+
+            std::fclose(f);
+        }
+
+        if (rewrite) {
+            f = std::fopen(table_path.c_str(), "wb");
+
+            if (!f || std::fwrite(CHUNK_TABLE_MAGIC, sizeof(CHUNK_TABLE_MAGIC), 1, f) != 1
+                || std::fwrite(&DEDUP_VERSION, sizeof(DEDUP_VERSION), 1, f) != 1
+                || (!chunks.empty() && std::fwrite(chunks.data(), sizeof(ChunkRecord), chunks.size(), f) != chunks.size())) {
+                if (f) {
+                    std::fclose(f);
+                }
+
+                close();
+                return false;
+            }
+
+            std::fclose(f);
+        }
+
+        table = std::fopen(table_path.c_str(), "ab");
+
+        if (!table) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool DedupStore::store_chunks(const std::uint8_t *data, const std::vector<PendingChunk> &pending, std::vector<RecipeEntry> &recipe,
+        DedupStats &stats) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (const PendingChunk &chunk : pending) {
+            stats.bytes += chunk.size;
+
+            if (chunk.zero) {
+                stats.zero_bytes += chunk.size;
+                append_entry(recipe, DEDUP_ZEROS, chunk.size);
+                continue;
+            }
+
+            stats.chunks++;
+
+            auto found = chunk_ids.find(chunk.digest);
+
+            if (found == chunk_ids.end()) {
+                // Bytes first, so the table never lists a chunk the pack doesn't hold
+                ChunkRecord record;
+                record.digest = chunk.digest;
+                record.offset = pack_size;
+                record.size = chunk.size;
+                record.reserved = 0;
+
+                if (std::fwrite(data + chunk.offset, 1, chunk.size, pack) != chunk.size
+                    || std::fwrite(&record, sizeof(record), 1, table) != 1) {
+                    return false;
+                }
+
+                pack_size += chunk.size;
+                stats.new_chunks++;
+                stats.new_bytes += chunk.size;
+
+                found = chunk_ids.emplace(chunk.digest, static_cast<std::uint32_t>(chunks.size())).first;
+                chunks.push_back(record);
+            }
+
+            append_entry(recipe, found->second, chunk.size);
+        }
+
+        return true;
+    }
+
+    bool DedupStore::add_image(const DedupSource &source, const DedupOptions &options, DedupStats &stats) {
+        SparseFile file;
+
+        if (!file.open(source.image_path.c_str(), false)) {
+            return false;
+        }
+
+        Image img(&file, SparseFile::read_hook, SparseFile::seek_hook);
+        file.attach(img);
+
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+
+        if (cluster_size == 0 || img.total_clusters() == 0 || !img.cache_fat()) {
+            return false;
+        }
+
+        const std::uint32_t image_size = file.get_size();
+        const std::uint32_t data_start = img.boot_block.data_region_start();
+        const std::uint32_t data_end = data_start + img.total_clusters() * cluster_size;
+
+        std::vector<std::uint8_t> buffer(std::max(options.batch_size, cluster_size) / cluster_size * cluster_size);
+        std::vector<PendingChunk> pending;
+        std::vector<RecipeEntry> recipe;
+        std::uint32_t batch_start = 0;
+        std::uint32_t batch_size = 0;
+        Sha256 sha;
+
+        auto flush_batch = [&]() -> bool {
+            if (batch_size == 0) {
+                return true;
+            }
+
+            if (img.read_at(batch_start, buffer.data(), batch_size) != batch_size) {
+                return false;
+            }
+
+            // Hashed outside the lock, while other workers read
+            for (PendingChunk &chunk : pending) {
+                chunk.zero = is_zero(buffer.data() + chunk.offset, chunk.size);
+
+                if (!chunk.zero) {
+                    sha.reset();
+                    sha.update(buffer.data() + chunk.offset, chunk.size);
+                    sha.finish(chunk.digest.bytes);
+                }
+            }
+
+            const bool stored = store_chunks(buffer.data(), pending, recipe, stats);
+
+            pending.clear();
+            batch_size = 0;
+
+            return stored;
+        };
+
+        for (std::uint32_t position = 0; position < image_size; ) {
+            // Cluster sized pieces, lined up on clusters in the data region
+            std::uint32_t size = std::min(cluster_size, image_size - position);
+            bool free_cluster = false;
+
+            if (position < data_start) {
+                size = std::min(size, data_start - position);
+            } else if (position < data_end) {
+                const std::uint32_t cluster = (position - data_start) / cluster_size + CLUSTER_FIRST_VALID;
+                free_cluster = !options.keep_free_space && img.fat_cache[cluster] == CLUSTER_FREE;
+            }
+
+            if (free_cluster) {
+                if (!flush_batch()) {
+                    return false;
+                }
+
+                stats.bytes += size;
+                stats.zero_bytes += size;
+                append_entry(recipe, DEDUP_ZEROS, size);
+            } else {
+                if (batch_size + size > buffer.size() && !flush_batch()) {
+                    return false;
+                }
+
+                if (batch_size == 0) {
+                    batch_start = position;
+                }
+
+                pending.push_back({ batch_size, size, false, ChunkDigest() });
+                batch_size += size;
+            }
+
+            position += size;
+        }
+
+        if (!flush_batch()) {
+            return false;
+        }
+
+        // Write aside then rename, so a recipe is either whole or the previous one
+        const std::string path = directory + "/" + source.name + ".recipe";
+        const std::string temp_path = path + ".tmp";
+
+        RecipeHeader header;
+        std::memcpy(header.magic, RECIPE_MAGIC, sizeof(header.magic));
+        header.version = DEDUP_VERSION;
+        header.entry_count = static_cast<std::uint32_t>(recipe.size());
+        header.image_size = image_size;
+
+        // The chunks it names must be on disk before it is
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (std::fflush(pack) != 0 || std::fflush(table) != 0) {
+                return false;
+            }
+        }
+
+        FILE *f = std::fopen(temp_path.c_str(), "wb");
+
+        if (!f) {
+            return false;
+        }
+
+        const bool written = std::fwrite(&header, sizeof(header), 1, f) == 1
+            && (recipe.empty() || std::fwrite(recipe.data(), sizeof(RecipeEntry), recipe.size(), f) == recipe.size());
+
+        if (std::fclose(f) != 0 || !written) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    bool DedupStore::add_images(const std::vector<DedupSource> &sources, DedupStats &stats, const DedupOptions &options) {
+        stats = DedupStats();
+
+        // Writes can't follow the reads of restore() without a seek
+        if (!pack || std::fseek(pack, 0, SEEK_END) != 0) {
+            return false;
+        }
+
+        std::uint32_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        threads = std::max<std::uint32_t>(1, std::min<std::uint32_t>(threads, static_cast<std::uint32_t>(sources.size())));
+
+        std::atomic<std::size_t> next_image(0);
+        std::mutex stats_lock;
+
+        auto run_worker = [&]() {
+            for (std::size_t i = next_image++; i < sources.size(); i = next_image++) {
+                DedupStats image_stats;
+                const bool added = add_image(sources[i], options, image_stats);
+
+                std::lock_guard<std::mutex> guard(stats_lock);
+
+                // What a failed image stored stays in the pack, for the next one to use
+                stats.chunks += image_stats.chunks;
+                stats.new_chunks += image_stats.new_chunks;
+                stats.bytes += image_stats.bytes;
+                stats.zero_bytes += image_stats.zero_bytes;
+                stats.new_bytes += image_stats.new_bytes;
+
+                if (added) {
+                    stats.images_added++;
+                } else {
+                    stats.images_failed++;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+
+        for (std::uint32_t i = 1; i < threads; i++) {
+            workers.emplace_back(run_worker);
+        }
+
+        run_worker();
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        return stats.images_failed == 0;
+    }
+
+    bool DedupStore::restore(const std::string &name, void *userdata, ImageWriteFunc write_func) {
+        if (!pack || std::fflush(pack) != 0) {
+            return false;
+        }
+
+        FILE *f = std::fopen((directory + "/" + name + ".recipe").c_str(), "rb");
+
+        if (!f) {
+            return false;
+        }
+
+        RecipeHeader header;
+        std::vector<RecipeEntry> recipe;
+
+        bool valid = std::fread(&header, sizeof(header), 1, f) == 1 && std::memcmp(header.magic, RECIPE_MAGIC, sizeof(header.magic)) == 0
+            && header.version == DEDUP_VERSION;
+
+        if (valid) {
+            recipe.resize(header.entry_count);
+            valid = recipe.empty() || std::fread(recipe.data(), sizeof(RecipeEntry), recipe.size(), f) == recipe.size();
+        }
+
+        std::fclose(f);
+
+        if (!valid) {
+            return false;
+        }
+
+        std::vector<std::uint8_t> buffer;
+
+        for (std::size_t i = 0; i < recipe.size(); ) {
+            if (recipe[i].chunk == DEDUP_ZEROS) {
+                for (std::uint32_t size_left = recipe[i].size; size_left != 0; ) {
+                    const std::uint32_t size_to_take = std::min(size_left, ZERO_BLOCK_SIZE);
+
+                    if (write_func(userdata, zero_block, size_to_take) != size_to_take) {
+                        return false;
+                    }
+
+                    size_left -= size_to_take;
+                }
+
+                i++;
+                continue;
+            }
+
+            // Chunks added together usually sit together in the pack
+            std::size_t run_end = i;
+            std::uint64_t run_size = 0;
+
+            while (run_end < recipe.size() && recipe[run_end].chunk < chunks.size()
+                && chunks[recipe[run_end].chunk].size == recipe[run_end].size
+                && chunks[recipe[run_end].chunk].offset == chunks[recipe[i].chunk].offset + run_size
+                && (run_end == i || run_size + recipe[run_end].size <= RESTORE_BATCH_SIZE)) {
+                run_size += recipe[run_end].size;
+                run_end++;
+            }
+
+            if (run_end == i) {
+                // Names a chunk the store doesn't have, or with another size
+                return false;
+            }
+
+            buffer.resize(static_cast<std::size_t>(run_size));
+
+            if (!read_pack(pack, buffer.data(), chunks[recipe[i].chunk].offset, buffer.size())
+                || write_func(userdata, buffer.data(), static_cast<std::uint32_t>(run_size)) != run_size) {
+                return false;
+            }
+
+            i = run_end;
+        }
+
+        return true;
+    }
+}
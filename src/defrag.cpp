@@ -0,0 +1,265 @@
+#include <fat16/allocator.h>
+#include <fat16/defrag.h>
+#include <fat16/layout.h>
+#include <fat16/walker.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace Fat16 {
+    namespace {
+        struct FileRecord {
+            std::u16string path;
+            std::uint32_t record_offset;
+            ClusterID starting_cluster;
+            std::vector<Extent> extents;
+            std::uint32_t cluster_count;
+        };
+
+        struct FileCollector {
+            std::mutex lock;
+            std::vector<FileRecord> files;
+        };
+    }
+
+    static WalkAction collect_file(void *userdata, const EntryView &view, const std::uint32_t worker) {
+        (void)worker;
+
+        if (view.is_directory() || view.entry->starting_cluster == CLUSTER_FREE) {
+            return WalkAction::CONTINUE;
+        }
+
+        FileRecord file;
+        file.path = view.parent->to_string();
+
+        if (!file.path.empty()) {
+            file.path += u'/';
+        }
+
+        file.path += view.get_filename();
+        file.record_offset = view.record_offset;
+        file.starting_cluster = view.entry->starting_cluster;
+        file.cluster_count = 0;
+
+        FileCollector &collector = *static_cast<FileCollector*>(userdata);
+        std::lock_guard<std::mutex> guard(collector.lock);
+
+        collector.files.push_back(std::move(file));
+        return WalkAction::CONTINUE;
+    }
+
+    /**
+     * \brief List the files with data, and the runs they are made of. Files with a broken chain are left out.
+     */
+    static bool collect_files(Image &img, std::vector<FileRecord> &files) {
+        FileCollector collector;
+
+        if (!walk(img, collect_file, &collector)) {
+            return false;
+        }
+
+        files.clear();
+
+        for (FileRecord &file : collector.files) {
+            if (!img.get_extents(file.starting_cluster, file.extents)) {
+                continue;
+            }
+
+            for (const Extent &extent : file.extents) {
+                file.cluster_count += extent.count;
+            }
+
+            files.push_back(std::move(file));
+        }
+
+        // The walk hands them out in no particular order
+        std::sort(files.begin(), files.end(), [](const FileRecord &a, const FileRecord &b) {
+            return a.path < b.path;
+        });
+
+        return true;
+    }
+
+    bool get_fragmentation_stats(Image &img, FragmentationStats &stats) {
+        stats = FragmentationStats();
+
+        // The file side of the layout report, so both always agree
+        LayoutReport report;
+
+        if (!analyze_layout(img, report)) {
+            return false;
+        }
+
+        stats.files = report.file_stats.chains;
+        stats.fragmented_files = report.file_stats.fragmented;
+        stats.extents = report.file_stats.extents;
+        stats.clusters = report.file_stats.clusters;
+
+        return true;
+    }
+
+    /**
+     * \brief Copy the runs of a file into one run, filling the buffer from as many runs as fit before each write.
+     */
+    static bool copy_clusters(Image &img, const std::vector<Extent> &source, const Extent &target, std::vector<std::uint8_t> &buffer) {
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        const std::uint32_t buffer_size = static_cast<std::uint32_t>(buffer.size());
+
+        std::uint32_t write_offset = img.cluster_offset(target.first);
+        std::uint32_t filled = 0;
+
+        for (const Extent &extent : source) {
+            std::uint32_t read_offset = img.cluster_offset(extent.first);
+            std::uint32_t size_left = extent.count * cluster_size;
+
+            while (size_left != 0) {
+                const std::uint32_t size = std::min(size_left, buffer_size - filled);
+
+                if (img.read_at(read_offset, buffer.data() + filled, size) != size) {
+                    return false;
+                }
+
+                read_offset += size;
+                size_left -= size;
+                filled += size;
+
+                if (filled == buffer_size) {
+                    if (!img.write_data(write_offset, buffer.data(), filled)) {
+                        return false;
+                    }
+
+                    write_offset += filled;
+                    filled = 0;
+                }
+            }
+        }
+
+        return img.write_data(write_offset, buffer.data(), filled);
+    }
+
+    bool defragment(Image &img, DefragResult &result, DefragProgressFunc progress_func, void *userdata,
+        const DefragOptions &options) {
+        result = DefragResult();
+
+        // Start from what's on disk, every pass ends consistent with it
+        if (!img.write_func || !img.flush()) {
+            return false;
+        }
+
+        std::vector<FileRecord> files;
+
+        if (!get_fragmentation_stats(img, result.before) || !collect_files(img, files)) {
+            return false;
+        }
+
+        std::vector<FileRecord*> pending;
+
+        for (FileRecord &file : files) {
+            if (file.extents.size() > 1) {
+                pending.push_back(&file);
+            }
+        }
+
+        // Biggest first, they have the fewest runs to pick from
+        std::stable_sort(pending.begin(), pending.end(), [](const FileRecord *a, const FileRecord *b) {
+            return a->cluster_count > b->cluster_count;
+        });
+
+        DefragProgress progress;
+        progress.files_moved = 0;
+        progress.files_planned = static_cast<std::uint32_t>(pending.size());
+        progress.clusters_moved = 0;
+        progress.clusters_planned = 0;
+        progress.path = nullptr;
+
+        for (const FileRecord *file : pending) {
+            progress.clusters_planned += file->cluster_count;
+        }
+
+        ClusterAllocator allocator;
+
+        if (!allocator.build(img)) {
+            return false;
+        }
+
+        std::vector<std::uint8_t> buffer(std::max(options.buffer_size, img.bytes_per_cluster()) / img.bytes_per_cluster()
+            * img.bytes_per_cluster());
+
+        std::vector<FileRecord*> left;
+        std::vector<Extent> freed;
+        bool stopped = false;
+
+        while (!pending.empty() && !stopped) {
+            left.clear();
+            freed.clear();
+
+            for (FileRecord *file : pending) {
+                Extent target;
+
+                if (stopped || !allocator.allocate_contiguous(file->cluster_count, target)) {
+                    left.push_back(file);
+                    continue;
+                }
+
+                // Data first: until the chain is relinked, the copy sits in clusters nothing points at
+                if (!copy_clusters(img, file->extents, target, buffer)) {
+                    img.flush();
+                    return false;
+                }
+
+                const std::vector<Extent> new_extents = { target };
+
+                if (!img.link_chain(new_extents) || !img.write_metadata(file->record_offset
+                    + static_cast<std::uint32_t>(offsetof(FundamentalEntry, starting_cluster)), &target.first, sizeof(ClusterID))
+                    || !img.free_chain(file->starting_cluster)) {
+                    img.flush();
+                    return false;
+                }
+
+                // Not reused before the next flush, the chain on disk still points at them
+                freed.insert(freed.end(), file->extents.begin(), file->extents.end());
+
+                file->extents = new_extents;
+                file->starting_cluster = target.first;
+
+                result.files_moved++;
+                result.clusters_moved += file->cluster_count;
+
+                progress.files_moved = result.files_moved;
+                progress.clusters_moved = result.clusters_moved;
+                progress.path = &file->path;
+
+                if (progress_func && !progress_func(userdata, progress)) {
+                    stopped = true;
+                }
+            }
+
+            if (!img.flush()) {
+                return false;
+            }
+
+            for (const Extent &extent : freed) {
+                allocator.release(extent);
+            }
+
+            // Nothing moved, so nothing was freed for what's left either
+            if (left.size() == pending.size()) {
+                break;
+            }
+
+            pending.swap(left);
+        }
+
+        // After a stop, what's left may only have lacked a run freed later
+        (stopped ? result.files_stopped : result.files_left) = static_cast<std::uint32_t>(pending.size());
+
+        if (progress_func) {
+            progress.path = nullptr;
+            progress_func(userdata, progress);
+        }
+
+        return get_fragmentation_stats(img, result.after);
+    }
+}
@@ -0,0 +1,400 @@
+#include <fat16/diff.h>
+#include <fat16/directory.h>
+#include <fat16/hash.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace Fat16 {
+    namespace {
+        /**
+         * \brief A directory to compare, with its counterpart. Either side may be missing.
+         */
+        struct DiffTask {
+            std::u16string path;
+            ClusterID old_directory;
+            ClusterID new_directory;
+            bool has_old;
+            bool has_new;
+        };
+
+        struct DiffItem {
+            std::u16string key;                     ///< Case folded name.
+            std::u16string name;
+            const FundamentalEntry *entry;
+
+            bool is_directory() const {
+                return (entry->file_attributes & (int)EntryAttribute::DIRECTORY) != 0;
+            }
+        };
+
+        struct DiffWorker {
+            std::vector<std::uint8_t> old_buffer;
+            std::vector<std::uint8_t> new_buffer;
+            DirectoryBuffer old_directory;
+            DirectoryBuffer new_directory;
+            std::vector<DiffItem> old_items;
+            std::vector<DiffItem> new_items;
+            std::vector<DiffEntry> changes;
+            std::vector<DiffTask> tasks;
+            DiffStats stats;
+        };
+
+        struct DiffState {
+            Image &old_img;
+            Image &new_img;
+            const DiffOptions &options;
+            bool same_geometry;
+
+            std::mutex lock;
+            std::condition_variable cond;
+            std::deque<DiffTask> tasks;
+            std::uint32_t busy;
+            bool failed;
+
+            std::vector<bool> old_visited;          ///< Directories queued already, so loops end.
+            std::vector<bool> new_visited;
+
+            DiffResult &result;
+
+            explicit DiffState(Image &old_img, Image &new_img, const DiffOptions &options, DiffResult &result)
+                : old_img(old_img)
+                , new_img(new_img)
+                , options(options)
+                , same_geometry(old_img.bytes_per_cluster() == new_img.bytes_per_cluster()
+                    && old_img.boot_block.data_region_start() == new_img.boot_block.data_region_start())
+                , busy(0)
+                , failed(false)
+                , old_visited(old_img.cluster_limit())
+                , new_visited(new_img.cluster_limit())
+                , result(result) {
+            }
+        };
+    }
+
+    static void list_items(const DirectoryBuffer &buffer, std::vector<DiffItem> &items) {
+        items.clear();
+
+        std::uint32_t slot = 0;
+        DirectoryRecord record;
+
+        while (buffer.next_record(slot, record)) {
+            DiffItem item;
+            item.entry = buffer.get_record(record.slot);
+            append_filename(*item.entry, buffer.get_long_name(record), record.long_name_count, item.name);
+
+            item.key = item.name;
+
+            for (char16_t &c : item.key) {
+                c = fold_case(c);
+            }
+
+            items.push_back(std::move(item));
+        }
+
+        std::sort(items.begin(), items.end(), [](const DiffItem &a, const DiffItem &b) {
+            return a.key < b.key;
+        });
+    }
+
+    static std::u16string join_path(const std::u16string &parent, const std::u16string &name) {
+        return parent.empty() ? name : parent + u'/' + name;
+    }
+
+    static void add_change(DiffWorker &worker, const std::u16string &path, const DiffKind kind, const DiffItem *old_item,
+        const DiffItem *new_item) {
+        DiffEntry change;
+        change.path = path;
+        change.kind = kind;
+        change.is_directory = (old_item ? old_item : new_item)->is_directory();
+
+        std::memset(&change.old_entry, 0, sizeof(FundamentalEntry));
+        std::memset(&change.new_entry, 0, sizeof(FundamentalEntry));
+
+        if (old_item) {
+            change.old_entry = *old_item->entry;
+        }
+
+        if (new_item) {
+            change.new_entry = *new_item->entry;
+        }
+
+        worker.changes.push_back(std::move(change));
+    }
+
+    /**
+     * \brief Queue the inside of a directory of one side, or of both, unless it was queued before.
+     */
+    static void add_task(DiffState &state, DiffWorker &worker, const std::u16string &path, const DiffItem *old_item,
+        const DiffItem *new_item) {
+        DiffTask task;
+        task.path = path;
+        task.old_directory = old_item ? old_item->entry->starting_cluster : static_cast<ClusterID>(CLUSTER_FREE);
+        task.new_directory = new_item ? new_item->entry->starting_cluster : static_cast<ClusterID>(CLUSTER_FREE);
+        task.has_old = old_item && task.old_directory >= CLUSTER_FIRST_VALID && task.old_directory < state.old_visited.size();
+        task.has_new = new_item && task.new_directory >= CLUSTER_FIRST_VALID && task.new_directory < state.new_visited.size();
+
+        if (task.has_old || task.has_new) {
+            worker.tasks.push_back(std::move(task));
+        }
+    }
+
+    /**
+     * \brief Compare the data of two files of the same size, in place, both stored in the same runs.
+     */
+    static bool same_in_place(DiffState &state, DiffWorker &worker, const std::vector<Extent> &extents, std::uint32_t size_left) {
+        const std::uint32_t cluster_size = state.old_img.bytes_per_cluster();
+        const std::uint32_t chunk_size = static_cast<std::uint32_t>(worker.old_buffer.size());
+
+        for (const Extent &extent : extents) {
+            std::uint32_t offset = state.old_img.cluster_offset(extent.first);
+            std::uint32_t run_left = std::min(size_left, extent.count * cluster_size);
+
+            size_left -= run_left;
+
+            while (run_left != 0) {
+                const std::uint32_t size = std::min(run_left, chunk_size);
+
+                if (state.old_img.read_at(offset, worker.old_buffer.data(), size) != size
+                    || state.new_img.read_at(offset, worker.new_buffer.data(), size) != size) {
+                    return false;
+                }
+
+                worker.stats.bytes_read += 2ull * size;
+
+                if (std::memcmp(worker.old_buffer.data(), worker.new_buffer.data(), size) != 0) {
+                    return false;
+                }
+
+                offset += size;
+                run_left -= size;
+            }
+        }
+
+        return size_left == 0;
+    }
+
+    static bool same_content(DiffState &state, DiffWorker &worker, const FundamentalEntry &old_entry, const FundamentalEntry &new_entry) {
+        if (old_entry.file_size != new_entry.file_size) {
+            return false;
+        }
+
+        worker.stats.files_compared++;
+
+        if (old_entry.file_size == 0) {
+            return true;
+        }
+
+        std::vector<Extent> old_extents;
+        std::vector<Extent> new_extents;
+
+        const bool old_valid = state.old_img.get_extents(old_entry.starting_cluster, old_extents);
+        const bool new_valid = state.new_img.get_extents(new_entry.starting_cluster, new_extents);
+
+        const bool same_runs = old_valid && new_valid && state.same_geometry && old_extents.size() == new_extents.size()
+            && std::equal(old_extents.begin(), old_extents.end(), new_extents.begin(), [](const Extent &a, const Extent &b) {
+                return a.first == b.first && a.count == b.count;
+            });
+
+        if (same_runs) {
+            worker.stats.same_extents++;
+            return state.options.trust_extents || same_in_place(state, worker, old_extents, old_entry.file_size);
+        }
+
+        worker.stats.hashed++;
+        worker.stats.bytes_read += 2ull * old_entry.file_size;
+
+        // A file that can't be read whole can't be shown to be the same
+        FileDigest old_digest;
+        FileDigest new_digest;
+
+        return hash_file(state.old_img, old_entry, old_digest, worker.old_buffer)
+            && hash_file(state.new_img, new_entry, new_digest, worker.new_buffer)
+            && std::memcmp(old_digest.sha256, new_digest.sha256, sizeof(old_digest.sha256)) == 0;
+    }
+
+    static bool same_metadata(const FundamentalEntry &a, const FundamentalEntry &b) {
+        return a.file_attributes == b.file_attributes && a.last_modified_date == b.last_modified_date
+            && a.last_modified_time == b.last_modified_time;
+    }
+
+    static bool compare_directory(DiffState &state, DiffWorker &worker, const DiffTask &task) {
+        worker.stats.directories++;
+
+        worker.old_items.clear();
+        worker.new_items.clear();
+
+        if (task.has_old) {
+            if (!worker.old_directory.read(state.old_img, task.old_directory)) {
+                return false;
+            }
+
+            list_items(worker.old_directory, worker.old_items);
+        }
+
+        if (task.has_new) {
+            if (!worker.new_directory.read(state.new_img, task.new_directory)) {
+                return false;
+            }
+
+            list_items(worker.new_directory, worker.new_items);
+        }
+
+        auto old_item = worker.old_items.begin();
+        auto new_item = worker.new_items.begin();
+
+        // Both lists are sorted by key, so this is a merge
+        while (old_item != worker.old_items.end() || new_item != worker.new_items.end()) {
+            const bool take_old = new_item == worker.new_items.end()
+                || (old_item != worker.old_items.end() && old_item->key <= new_item->key);
+            const bool take_new = old_item == worker.old_items.end()
+                || (new_item != worker.new_items.end() && new_item->key <= old_item->key);
+
+            const DiffItem *old_match = take_old ? &*old_item : nullptr;
+            const DiffItem *new_match = take_new ? &*new_item : nullptr;
+            const std::u16string path = join_path(task.path, (new_match ? new_match : old_match)->name);
+
+            if (!old_match || !new_match || old_match->is_directory() != new_match->is_directory()) {
+                // Only on one side, or a file that became a directory or the reverse
+                if (old_match) {
+                    add_change(worker, join_path(task.path, old_match->name), DiffKind::REMOVED, old_match, nullptr);
+
+                    if (old_match->is_directory()) {
+                        add_task(state, worker, join_path(task.path, old_match->name), old_match, nullptr);
+                    }
+                }
+
+                if (new_match) {
+                    add_change(worker, path, DiffKind::ADDED, nullptr, new_match);
+
+                    if (new_match->is_directory()) {
+                        add_task(state, worker, path, nullptr, new_match);
+                    }
+                }
+            } else if (old_match->is_directory()) {
+                if (!same_metadata(*old_match->entry, *new_match->entry)) {
+                    add_change(worker, path, DiffKind::METADATA, old_match, new_match);
+                }
+
+                add_task(state, worker, path, old_match, new_match);
+            } else if (!same_content(state, worker, *old_match->entry, *new_match->entry)) {
+                add_change(worker, path, DiffKind::MODIFIED, old_match, new_match);
+            } else if (!same_metadata(*old_match->entry, *new_match->entry)) {
+                add_change(worker, path, DiffKind::METADATA, old_match, new_match);
+            }
+
+            if (take_old) {
+                old_item++;
+            }
+
+            if (take_new) {
+                new_item++;
+            }
+        }
+
+        return true;
+    }
+
+    static void run_worker(DiffState &state) {
+        DiffWorker worker;
+        worker.old_buffer.resize(std::max<std::uint32_t>(state.options.chunk_size, 64));
+        worker.new_buffer.resize(worker.old_buffer.size());
+
+        std::unique_lock<std::mutex> guard(state.lock);
+
+        for (;;) {
+            state.cond.wait(guard, [&state]() {
+                return !state.tasks.empty() || state.busy == 0 || state.failed;
+            });
+
+            if (state.tasks.empty() || state.failed) {
+                break;
+            }
+
+            const DiffTask task = std::move(state.tasks.front());
+            state.tasks.pop_front();
+            state.busy++;
+
+            guard.unlock();
+
+            const bool compared = compare_directory(state, worker, task);
+
+            guard.lock();
+
+            state.failed = state.failed || !compared;
+            state.busy--;
+
+            for (DiffTask &next : worker.tasks) {
+                // A directory met twice on a side is only gone into once
+                if (next.has_old) {
+                    next.has_old = !state.old_visited[next.old_directory];
+                    state.old_visited[next.old_directory] = true;
+                }
+
+                if (next.has_new) {
+                    next.has_new = !state.new_visited[next.new_directory];
+                    state.new_visited[next.new_directory] = true;
+                }
+
+                if (next.has_old || next.has_new) {
+                    state.tasks.push_back(std::move(next));
+                }
+            }
+
+            worker.tasks.clear();
+            state.cond.notify_all();
+        }
+
+        state.result.changes.insert(state.result.changes.end(), std::make_move_iterator(worker.changes.begin()),
+            std::make_move_iterator(worker.changes.end()));
+
+        state.result.stats.directories += worker.stats.directories;
+        state.result.stats.files_compared += worker.stats.files_compared;
+        state.result.stats.same_extents += worker.stats.same_extents;
+        state.result.stats.hashed += worker.stats.hashed;
+        state.result.stats.bytes_read += worker.stats.bytes_read;
+
+        state.cond.notify_all();
+    }
+
+    bool diff_images(Image &old_img, Image &new_img, DiffResult &result, const DiffOptions &options) {
+        result = DiffResult();
+
+        // Chains are then followed from memory, from any thread
+        if ((old_img.fat_cache.empty() && !old_img.cache_fat()) || (new_img.fat_cache.empty() && !new_img.cache_fat())) {
+            return false;
+        }
+
+        DiffState state(old_img, new_img, options, result);
+        state.tasks.push_back({ std::u16string(), CLUSTER_FREE, CLUSTER_FREE, true, true });
+
+        std::uint32_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+
+        // Reads would share the image cursors otherwise
+        if (threads == 0 || !old_img.read_at_func || !new_img.read_at_func) {
+            threads = 1;
+        }
+
+        std::vector<std::thread> workers;
+
+        for (std::uint32_t i = 1; i < threads; i++) {
+            workers.emplace_back(run_worker, std::ref(state));
+        }
+
+        run_worker(state);
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        std::sort(result.changes.begin(), result.changes.end(), [](const DiffEntry &a, const DiffEntry &b) {
+            return a.path < b.path || (a.path == b.path && a.kind < b.kind);
+        });
+
+        return !state.failed;
+    }
+}
@@ -0,0 +1,333 @@
+#include <fat16/directory.h>
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAT16_HAS_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Fat16 {
+    static std::uint8_t classify_slot(const std::uint8_t *slot) {
+        const std::uint8_t first = slot[0];
+        const std::uint8_t attrib = slot[11];
+
+        if (first == 0x00) {
+            return SLOT_END;
+        }
+
+        if (attrib == 0x0F) {
+            return SLOT_LONG_NAME;
+        }
+
+        if (first == 0xE5) {
+            return SLOT_DELETED;
+        }
+
+        if (first == 0x2E) {
+            return SLOT_DOT;
+        }
+
+        return (attrib & (int)EntryAttribute::SPECIAL) ? SLOT_VOLUME_LABEL : SLOT_ENTRY;
+    }
+
+    static void classify_slots_scalar(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes) {
+        for (std::uint32_t i = 0; i < count; i++) {
+            classes[i] = classify_slot(slots + i * sizeof(FundamentalEntry));
+        }
+    }
+
+#if defined(__SSE2__)
+    static __m128i select_lanes(const __m128i mask, const __m128i value, const __m128i current) {
+        return _mm_or_si128(_mm_and_si128(mask, value), _mm_andnot_si128(mask, current));
+    }
+
+    static void classify_slots_sse2(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes) {
+        const __m128i byte_mask = _mm_set1_epi32(0xFF);
+        const __m128i special = _mm_set1_epi32((int)EntryAttribute::SPECIAL);
+
+        std::uint32_t i = 0;
+
+        for (; i + 4 <= count; i += 4) {
+            const std::uint8_t *base = slots + i * sizeof(FundamentalEntry);
+            __m128 halves[2];
+
+            for (int j = 0; j < 2; j++) {
+                // Bytes 0-3 and 8-11 of two slots, side by side
+                const __m128i lo = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(base + j * 64)),
+                    _MM_SHUFFLE(3, 3, 2, 0));
+                const __m128i hi = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(base + j * 64 + 32)),
+                    _MM_SHUFFLE(3, 3, 2, 0));
+
+                halves[j] = _mm_castsi128_ps(_mm_unpacklo_epi64(lo, hi));
+            }
+
+            // One lane per slot: first name byte, and attribute byte
+            const __m128i first = _mm_and_si128(_mm_castps_si128(_mm_shuffle_ps(halves[0], halves[1], _MM_SHUFFLE(2, 0, 2, 0))),
+                byte_mask);
+            const __m128i attrib = _mm_srli_epi32(_mm_castps_si128(_mm_shuffle_ps(halves[0], halves[1], _MM_SHUFFLE(3, 1, 3, 1))), 24);
+
+            // Lowest priority first, so the checks done last win
+            __m128i result = _mm_set1_epi32(SLOT_ENTRY);
+            result = select_lanes(_mm_cmpeq_epi32(_mm_and_si128(attrib, special), special), _mm_set1_epi32(SLOT_VOLUME_LABEL), result);
+            result = select_lanes(_mm_cmpeq_epi32(first, _mm_set1_epi32(0x2E)), _mm_set1_epi32(SLOT_DOT), result);
+            result = select_lanes(_mm_cmpeq_epi32(first, _mm_set1_epi32(0xE5)), _mm_set1_epi32(SLOT_DELETED), result);
+            result = select_lanes(_mm_cmpeq_epi32(attrib, _mm_set1_epi32(0x0F)), _mm_set1_epi32(SLOT_LONG_NAME), result);
+            result = select_lanes(_mm_cmpeq_epi32(first, _mm_setzero_si128()), _mm_set1_epi32(SLOT_END), result);
+
+            result = _mm_packs_epi32(result, result);
+            result = _mm_packus_epi16(result, result);
+
+            const std::int32_t packed = _mm_cvtsi128_si32(result);
+            std::memcpy(classes + i, &packed, sizeof(packed));
+        }
+
+        classify_slots_scalar(slots + i * sizeof(FundamentalEntry), count - i, classes + i);
+    }
+#endif
+
+#if defined(FAT16_HAS_X86_DISPATCH)
+    __attribute__((target("avx2")))
+    static void classify_slots_avx2(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes) {
+        const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+        const __m256i special = _mm256_set1_epi32((int)EntryAttribute::SPECIAL);
+
+        std::uint32_t i = 0;
+
+        for (; i + 8 <= count; i += 8) {
+            const std::uint8_t *base = slots + i * sizeof(FundamentalEntry);
+            __m256 halves[2];
+
+            for (int j = 0; j < 2; j++) {
+                __m256i pairs[2];
+
+                for (int k = 0; k < 2; k++) {
+                    // Slot n in the low lane, slot n + 4 in the high one, keeps the lanes in slot order at the end
+                    const std::uint8_t *slot = base + (j * 2 + k) * sizeof(FundamentalEntry);
+                    const __m256i both = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(
+                        reinterpret_cast<const __m128i*>(slot))), _mm_loadu_si128(reinterpret_cast<const __m128i*>(slot + 128)), 1);
+
+                    pairs[k] = _mm256_shuffle_epi32(both, _MM_SHUFFLE(3, 3, 2, 0));
+                }
+
+                halves[j] = _mm256_castsi256_ps(_mm256_unpacklo_epi64(pairs[0], pairs[1]));
+            }
+
+            const __m256i first = _mm256_and_si256(_mm256_castps_si256(_mm256_shuffle_ps(halves[0], halves[1],
+                _MM_SHUFFLE(2, 0, 2, 0))), byte_mask);
+            const __m256i attrib = _mm256_srli_epi32(_mm256_castps_si256(_mm256_shuffle_ps(halves[0], halves[1],
+                _MM_SHUFFLE(3, 1, 3, 1))), 24);
+
+            __m256i result = _mm256_set1_epi32(SLOT_ENTRY);
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi32(SLOT_VOLUME_LABEL),
+                _mm256_cmpeq_epi32(_mm256_and_si256(attrib, special), special));
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi32(SLOT_DOT), _mm256_cmpeq_epi32(first, _mm256_set1_epi32(0x2E)));
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi32(SLOT_DELETED), _mm256_cmpeq_epi32(first, _mm256_set1_epi32(0xE5)));
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi32(SLOT_LONG_NAME), _mm256_cmpeq_epi32(attrib, _mm256_set1_epi32(0x0F)));
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi32(SLOT_END), _mm256_cmpeq_epi32(first, _mm256_setzero_si256()));
+
+            __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+            packed = _mm_packus_epi16(packed, packed);
+
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(classes + i), packed);
+        }
+
+        classify_slots_scalar(slots + i * sizeof(FundamentalEntry), count - i, classes + i);
+    }
+#endif
+
+    typedef void (*ClassifySlotsFunc)(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes);
+
+    static ClassifySlotsFunc pick_slot_classifier() {
+#if defined(FAT16_HAS_X86_DISPATCH)
+        if (__builtin_cpu_supports("avx2")) {
+            return classify_slots_avx2;
+        }
+#endif
+
+#if defined(__SSE2__)
+        return classify_slots_sse2;
+#else
+        return classify_slots_scalar;
+#endif
+    }
+
+    void classify_slots(const std::uint8_t *slots, const std::uint32_t count, std::uint8_t *classes) {
+        static const ClassifySlotsFunc classify = pick_slot_classifier();
+        classify(slots, count, classes);
+    }
+
+    static bool read_directory_data(Image &img, const ClusterID cluster, DirectoryBuffer &buffer) {
+        std::vector<std::uint8_t> &data = buffer.data;
+        std::vector<Extent> &extents = buffer.extents;
+
+        extents.clear();
+        buffer.root_offset = 0;
+
+        if (cluster == 0) {
+            buffer.root_offset = img.boot_block.root_directory_region_start();
+            data.resize(img.boot_block.data_region_start() - buffer.root_offset);
+
+            return img.read_at(buffer.root_offset, data.data(), static_cast<std::uint32_t>(data.size())) == data.size();
+        }
+
+        if (!img.get_extents(cluster, extents)) {
+            return false;
+        }
+
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        std::size_t total = 0;
+
+        for (const Extent &extent : extents) {
+            total += static_cast<std::size_t>(extent.count) * cluster_size;
+        }
+
+        data.resize(total);
+        total = 0;
+
+        // One read per run of contiguous clusters
+        for (const Extent &extent : extents) {
+            const std::uint32_t size = extent.count * cluster_size;
+
+            if (img.read_at(img.cluster_offset(extent.first), data.data() + total, size) != size) {
+                return false;
+            }
+
+            total += size;
+        }
+
+        return true;
+    }
+
+    bool DirectoryBuffer::read(Image &img, const ClusterID cluster) {
+        if (!read_directory_data(img, cluster, *this)) {
+            return false;
+        }
+
+        classes.resize(slot_count());
+        classify_slots(data.data(), slot_count(), classes.data());
+
+        return true;
+    }
+
+    std::uint32_t DirectoryBuffer::get_slot_offset(const Image &img, const std::uint32_t slot) const {
+        const std::uint32_t position = slot * sizeof(FundamentalEntry);
+
+        if (root_offset) {
+            return root_offset + position;
+        }
+
+        return get_extent_offset(img, extents, position);
+    }
+
+    bool DirectoryBuffer::next_record(std::uint32_t &slot, DirectoryRecord &record) const {
+        const std::uint32_t count = slot_count();
+        std::uint32_t long_name_count = 0;
+
+        record.long_name_slot = slot;
+
+        // Only the class bytes are looked at until a live entry turns up
+        for (; slot < count; slot++) {
+            switch (classes[slot]) {
+            case SLOT_END:
+                // Nothing is used past this one
+                slot = count;
+                return false;
+
+            case SLOT_LONG_NAME:
+                if (reinterpret_cast<const LongFileNameEntry*>(get_record(slot))->padding != 0) {
+                    // Not a real long name slot, whatever it is
+                    long_name_count = 0;
+                } else if (long_name_count++ == 0) {
+                    record.long_name_slot = slot;
+                }
+
+                break;
+
+            case SLOT_ENTRY: {
+                // Checked against the record, only the slots of a valid name are kept
+                const std::uint32_t matched = long_name_count ? match_long_name(reinterpret_cast<const LongFileNameEntry*>(
+                    get_record(record.long_name_slot)), long_name_count, *get_record(slot)) : 0;
+
+                record.slot = slot++;
+                record.long_name_slot += long_name_count - matched;
+                record.long_name_count = matched;
+                record.discarded_long_name_slots = long_name_count - matched;
+                return true;
+            }
+
+            default:
+                // Deleted, dot entries and volume labels
+                long_name_count = 0;
+                break;
+            }
+        }
+
+        return false;
+    }
+
+    std::uint32_t get_extent_offset(const Image &img, const std::vector<Extent> &extents, const std::uint32_t position) {
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        std::uint32_t cluster_index = position / cluster_size;
+
+        for (const Extent &extent : extents) {
+            if (cluster_index < extent.count) {
+                return img.cluster_offset(static_cast<ClusterID>(extent.first + cluster_index)) + position % cluster_size;
+            }
+
+            cluster_index -= extent.count;
+        }
+
+        return 0;
+    }
+
+    void append_filename(const FundamentalEntry &entry, const LongFileNameEntry *long_name, const std::uint32_t long_name_count,
+        std::u16string &dest) {
+        if (long_name_count != 0) {
+            // Stored last part first
+            for (std::uint32_t i = long_name_count; i != 0; i--) {
+                const LongFileNameEntry &part = long_name[i - 1];
+                const char16_t units[13] = {
+                    part.name_part_1[0], part.name_part_1[1], part.name_part_1[2], part.name_part_1[3], part.name_part_1[4],
+                    part.name_part_2[0], part.name_part_2[1], part.name_part_2[2], part.name_part_2[3], part.name_part_2[4],
+                    part.name_part_2[5], part.name_part_3[0], part.name_part_3[1]
+                };
+
+                for (const char16_t unit : units) {
+                    if (unit == 0) {
+                        return;
+                    }
+
+                    dest += unit;
+                }
+            }
+
+            return;
+        }
+
+        std::uint32_t base_length = sizeof(entry.filename);
+        while (base_length != 0 && entry.filename[base_length - 1] == ' ') {
+            base_length--;
+        }
+
+        std::uint32_t extension_length = sizeof(entry.filename_ext);
+        while (extension_length != 0 && entry.filename_ext[extension_length - 1] == ' ') {
+            extension_length--;
+        }
+
+        for (std::uint32_t i = 0; i < base_length; i++) {
+            // 0x05 stands for a real 0xE5, which would mark the entry deleted
+            dest += (i == 0 && entry.filename[0] == 0x05) ? u'\xE5' : static_cast<char16_t>(entry.filename[i]);
+        }
+
+        if (extension_length != 0) {
+            dest += u'.';
+
+            for (std::uint32_t i = 0; i < extension_length; i++) {
+                dest += static_cast<char16_t>(static_cast<std::uint8_t>(entry.filename_ext[i]));
+            }
+        }
+    }
+}
@@ -1,6 +1,8 @@
 #include <cstdio>
+#include <fat16/directory.h>
 #include <fat16/fat16.h>
 #include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 
@@ -19,6 +21,10 @@ namespace Fat16 {
         return root_directory_region_start() + (num_root_dirs * sizeof(FundamentalEntry));
     }
 
+    std::uint32_t BootBlock::total_blocks() const {
+        return num_blocks_in_image_op1 ? num_blocks_in_image_op1 : num_blocks_in_image_op2;
+    }
+
     std::string FundamentalEntry::get_filename() {
         EntryType etype = get_entry_type_from_filename();
         std::string fname(reinterpret_cast<char*>(filename));
@@ -60,66 +66,154 @@ namespace Fat16 {
     }
     
     ClusterID Image::get_successor_cluster(const ClusterID target) {
-        const std::uint32_t current = get_current_image_offset();
+        if (!fat_cache.empty()) {
+            return (target < fat_cache.size()) ? fat_cache[target] : 0;
+        }
 
-        // Seek to beginning of the FAT
-        seek_func(userdata, boot_block.fat_region_start() + (target * 2), IMAGE_SEEK_MODE_BEG);
+        // Look it up in the FAT
         ClusterID next = 0;
     
-        if (read_func(userdata, &next, sizeof(ClusterID)) != sizeof(ClusterID)) {
+        if (read_at(boot_block.fat_region_start() + (target * 2), &next, sizeof(ClusterID)) != sizeof(ClusterID)) {
             return 0;
         }
         
-        seek_func(userdata, current, IMAGE_SEEK_MODE_BEG);
         return next;
     }
 
+    bool Image::is_end_of_chain(const ClusterID value) {
+        return value >= CLUSTER_END_OF_CHAIN_MIN;
+    }
+
     std::uint32_t Image::bytes_per_cluster() const {
         return boot_block.bytes_per_block * boot_block.num_blocks_per_allocation_unit;
     }
 
+    std::uint32_t Image::total_clusters() const {
+        const std::uint32_t data_start_block = boot_block.data_region_start() / boot_block.bytes_per_block;
+        const std::uint32_t total_blocks = boot_block.total_blocks();
+
+        if (total_blocks <= data_start_block || boot_block.num_blocks_per_allocation_unit == 0) {
+            return 0;
+        }
+
+        std::uint32_t count = (total_blocks - data_start_block) / boot_block.num_blocks_per_allocation_unit;
+
+        // The FAT may be too small to describe every cluster the region could hold
+        const std::uint32_t fat_entries = (boot_block.num_blocks_per_fat * boot_block.bytes_per_block) / sizeof(ClusterID);
+        if (fat_entries < CLUSTER_FIRST_VALID) {
+            return 0;
+        }
+
+        return std::min<std::uint32_t>(count, fat_entries - CLUSTER_FIRST_VALID);
+    }
+
+    bool Image::cache_fat() {
+        const std::uint32_t fat_bytes = boot_block.num_blocks_per_fat * boot_block.bytes_per_block;
+        const std::uint32_t current = get_current_image_offset();
+
+        std::vector<ClusterID> table(fat_bytes / sizeof(ClusterID));
+
+        seek_func(userdata, boot_block.fat_region_start(), IMAGE_SEEK_MODE_BEG);
+        const std::uint32_t bytes_read = read_func(userdata, table.data(), fat_bytes);
+        seek_func(userdata, current, IMAGE_SEEK_MODE_BEG);
+
+        if (bytes_read != fat_bytes) {
+            return false;
+        }
+
+        fat_cache = std::move(table);
+        return true;
+    }
+
+    std::uint32_t Image::cluster_offset(const ClusterID cluster) const {
+        return boot_block.data_region_start() + (cluster - 2) * bytes_per_cluster();
+    }
+
+    bool Image::get_extents(const ClusterID starting_cluster, std::vector<Extent> &extents) {
+        const std::uint32_t cluster_limit = this->cluster_limit();
+
+        ClusterID current = starting_cluster;
+        std::uint32_t visited = 0;
+
+        while (current >= CLUSTER_FIRST_VALID && current < cluster_limit) {
+            if (visited++ >= cluster_limit) {
+                // More clusters than the volume has: the chain loops
+                return false;
+            }
+
+            if (!extents.empty() && extents.back().first + extents.back().count == current) {
+                extents.back().count++;
+            } else {
+                extents.push_back({ current, 1 });
+            }
+
+            current = get_successor_cluster(current);
+        }
+
+        return current == CLUSTER_FREE ? (starting_cluster == CLUSTER_FREE) : is_end_of_chain(current);
+    }
+
     std::uint32_t Image::read_from_cluster(std::uint8_t *dest_buffer, const std::uint32_t offset, const ClusterID starting_cluster,
         const std::uint32_t size) {
-        // Calculate total number of cluster we need to traverse
-        const std::uint32_t total_block_to_read = (size + boot_block.bytes_per_block - 1) / boot_block.bytes_per_block;
-        const std::uint32_t total_cluster_to_read = (total_block_to_read + boot_block.num_blocks_per_allocation_unit - 1)
-            / boot_block.num_blocks_per_allocation_unit;
-
-        std::uint32_t from_start_cluster_dist = offset / boot_block.bytes_per_block;
-        from_start_cluster_dist = (from_start_cluster_dist) / boot_block.num_blocks_per_allocation_unit;
+        const std::uint32_t cluster_size = bytes_per_cluster();
+        const std::uint32_t cluster_limit = this->cluster_limit();
 
-        std::uint32_t offset_in_that_cluster = offset % bytes_per_cluster();
+        std::uint32_t from_start_cluster_dist = offset / cluster_size;
+        std::uint32_t offset_in_that_cluster = offset % cluster_size;
 
         ClusterID current_cluster = starting_cluster;
-        std::uint32_t offset_start_data_area = 0;
 
-        while (from_start_cluster_dist != 0) {
+        while (from_start_cluster_dist != 0 && !is_end_of_chain(current_cluster)) {
             current_cluster = get_successor_cluster(current_cluster);
             from_start_cluster_dist--;
         }
 
         // Add the FAT with the boot block, then add the root directory entries size
-        offset_start_data_area = boot_block.data_region_start();
-        offset_start_data_area += offset_in_that_cluster;
+        const std::uint32_t offset_start_data_area = boot_block.data_region_start();
+        std::uint32_t total_bytes_left_to_read = size;
 
-        // Let's seek to that place.
-        seek_func(userdata, offset_start_data_area, IMAGE_SEEK_MODE_BEG);
+        while (total_bytes_left_to_read != 0) {
+            if (current_cluster < CLUSTER_FIRST_VALID || current_cluster >= cluster_limit) {
+                // Chain ended before the requested size
+                break;
+            }
 
-        std::uint32_t total_bytes_left_to_read = size;
+            // Only the first cluster is read from the middle
+            const ClusterID run_start = current_cluster;
+            std::uint32_t run_size = cluster_size - offset_in_that_cluster;
 
-        for (std::uint8_t i = 0; i < total_cluster_to_read; i++) {
-            // Seek to the given cluster.
-            seek_func(userdata, offset_start_data_area + (current_cluster - 2) * bytes_per_cluster(), IMAGE_SEEK_MODE_BEG);
-            const std::uint32_t size_to_read_this_take = std::min<std::uint32_t>(bytes_per_cluster(), total_bytes_left_to_read);
+            ClusterID next_cluster = 0;
+            bool next_known = false;
 
-            // Read it
-            read_func(userdata, dest_buffer, size_to_read_this_take);
+            // Physically contiguous clusters are merged, so they go out as one read
+            while (run_size < total_bytes_left_to_read) {
+                // LINK... WAKE UP!!!! WE GOT A VILLAGE TO BURN
+                next_cluster = get_successor_cluster(current_cluster);
+                next_known = true;
 
-            total_bytes_left_to_read -= size_to_read_this_take;
-            dest_buffer += size_to_read_this_take;
+                if (next_cluster != current_cluster + 1 || next_cluster >= cluster_limit) {
+                    break;
+                }
 
-            // LINK... WAKE UP!!!! WE GOT A VILLAGE TO BURN
-            current_cluster = get_successor_cluster(current_cluster);
+                current_cluster = next_cluster;
+                next_known = false;
+                run_size += cluster_size;
+            }
+
+            const std::uint32_t size_to_read_this_take = std::min<std::uint32_t>(run_size, total_bytes_left_to_read);
+
+            const std::uint32_t bytes_read = read_at(offset_start_data_area + (run_start - 2) * cluster_size
+                + offset_in_that_cluster, dest_buffer, size_to_read_this_take);
+
+            total_bytes_left_to_read -= bytes_read;
+            dest_buffer += bytes_read;
+            offset_in_that_cluster = 0;
+
+            if (bytes_read != size_to_read_this_take || total_bytes_left_to_read == 0) {
+                break;
+            }
+
+            current_cluster = next_known ? next_cluster : get_successor_cluster(current_cluster);
         }
 
         // Return the total of bytes read. Calculated by this formula.
@@ -127,15 +221,13 @@ namespace Fat16 {
     }
 
     bool Image::get_next_entry(Entry &entry) {
-        if (entry.cursor_record / 32 >= boot_block.num_root_dirs) {
+        // The root directory has a fixed size. Others end with their cluster chain.
+        if (!entry.root && entry.cursor_record / 32 >= boot_block.num_root_dirs) {
             return false;
         }
 
-        std::uint32_t offset_root_dir = 0;
-
         // Add the FAT with the boot block, then add the root directory entries size
-        offset_root_dir = boot_block.root_directory_region_start();
-        seek_func(userdata, offset_root_dir + entry.cursor_record, IMAGE_SEEK_MODE_BEG);
+        const std::uint32_t offset_root_dir = boot_block.root_directory_region_start();
 
         LongFileNameEntry extended_entry;
         entry.extended_entries.clear();
@@ -146,7 +238,8 @@ namespace Fat16 {
                         entry.root, sizeof(LongFileNameEntry)) != sizeof(LongFileNameEntry)) {
                     return false;
                 }
-            } else if (read_func(userdata, &extended_entry, sizeof(LongFileNameEntry)) != sizeof(LongFileNameEntry)) {
+            } else if (read_at(offset_root_dir + entry.cursor_record, &extended_entry, sizeof(LongFileNameEntry))
+                != sizeof(LongFileNameEntry)) {
                 return false;
             }
 
@@ -155,13 +248,9 @@ namespace Fat16 {
                 entry.cursor_record += sizeof(LongFileNameEntry);
                 entry.extended_entries.push_back(extended_entry);
             } else {
-                // Seek back
-                if (!entry.root)
-                    seek_func(userdata, offset_root_dir + entry.cursor_record, IMAGE_SEEK_MODE_BEG);
-                
                 break;
             }
-        } while (true && (entry.cursor_record / 32 != boot_block.num_root_dirs));
+        } while (entry.root || (entry.cursor_record / 32 != boot_block.num_root_dirs));
 
         // Try to do fundamental entry read
         if (entry.root) {
@@ -169,12 +258,20 @@ namespace Fat16 {
                     entry.root, sizeof(FundamentalEntry)) != sizeof(FundamentalEntry)) {
                 return false;
             }
-        } else if (read_func(userdata, &entry.entry, sizeof(FundamentalEntry)) != sizeof(FundamentalEntry)) {
+        } else if (read_at(offset_root_dir + entry.cursor_record, &entry.entry, sizeof(FundamentalEntry))
+            != sizeof(FundamentalEntry)) {
             return false;
         }
         
         entry.cursor_record += sizeof(FundamentalEntry);
 
+        // Slots before a valid name, or a run that isn't one at all, don't name this entry
+        const std::uint32_t matched = match_long_name(entry.extended_entries.data(),
+            static_cast<std::uint32_t>(entry.extended_entries.size()), entry.entry);
+
+        entry.discarded_long_name_slots = static_cast<std::uint32_t>(entry.extended_entries.size()) - matched;
+        entry.extended_entries.erase(entry.extended_entries.begin(), entry.extended_entries.begin() + entry.discarded_long_name_slots);
+
         return true;
     }
 
@@ -189,9 +286,39 @@ namespace Fat16 {
         return true;
     }
     
-    Image::Image(void *userdata, ImageReadFunc read_func, ImageSeekFunc seek_func)
+    std::uint32_t Image::get_entry_offset(const Entry &entry) {
+        if (entry.cursor_record < sizeof(FundamentalEntry)) {
+            return 0;
+        }
+
+        // The cursor sits right after the 8.3 record
+        const std::uint32_t record = entry.cursor_record - sizeof(FundamentalEntry);
+
+        if (!entry.root) {
+            return boot_block.root_directory_region_start() + record;
+        }
+
+        const std::uint32_t cluster_limit = this->cluster_limit();
+        ClusterID current = entry.root;
+
+        for (std::uint32_t i = record / bytes_per_cluster(); i != 0; i--) {
+            current = get_successor_cluster(current);
+        }
+
+        if (current < CLUSTER_FIRST_VALID || current >= cluster_limit) {
+            return 0;
+        }
+
+        return cluster_offset(current) + record % bytes_per_cluster();
+    }
+
+    Image::Image(void *userdata, ImageReadFunc read_func, ImageSeekFunc seek_func, ImageWriteFunc write_func)
         : read_func(read_func)
         , seek_func(seek_func)
+        , write_func(write_func)
+        , read_at_func(nullptr)
+        , truncate_func(nullptr)
+        , discard_func(nullptr)
         , userdata(userdata) {
         seek_func(userdata, 0, IMAGE_SEEK_MODE_BEG);
         if (read_func(userdata, &boot_block, sizeof(BootBlock)) != sizeof(BootBlock)) {
@@ -199,50 +326,616 @@ namespace Fat16 {
         }
     }
 
-    std::u16string Entry::get_filename() {
-        if (extended_entries.size() != 0) {
-            // Use name from extended entries
-            std::u16string final_name;
+    std::uint32_t Image::read_at(const std::uint32_t offset, void *dest, const std::uint32_t size) {
+        std::uint32_t bytes_read = 0;
+
+        if (read_at_func) {
+            bytes_read = read_at_func(userdata, dest, offset, size);
+        } else {
+            seek_func(userdata, offset, IMAGE_SEEK_MODE_BEG);
+            bytes_read = read_func(userdata, dest, size);
+        }
+
+        if (dirty_blocks.empty() || bytes_read == 0) {
+            return bytes_read;
+        }
+
+        // Patch in the blocks that have not been flushed yet
+        const std::uint32_t block_size = boot_block.bytes_per_block;
+        const std::uint32_t end = offset + bytes_read;
+
+        for (auto block = dirty_blocks.lower_bound(offset / block_size);
+            block != dirty_blocks.end() && block->first * block_size < end; block++) {
+            const std::uint32_t block_start = block->first * block_size;
+            const std::uint32_t copy_start = std::max<std::uint32_t>(offset, block_start);
+            const std::uint32_t copy_end = std::min<std::uint32_t>(end, block_start + block_size);
+
+            std::memcpy(static_cast<std::uint8_t*>(dest) + (copy_start - offset),
+                block->second.data() + (copy_start - block_start), copy_end - copy_start);
+        }
+
+        return bytes_read;
+    }
 
-            for (std::intptr_t j = extended_entries.size() - 1; j >= 0; j--) {
-                volatile int i = 0;
+    bool Image::write_at(const std::uint32_t offset, const void *data, const std::uint32_t size) {
+        if (!write_func) {
+            return false;
+        }
+
+        seek_func(userdata, offset, IMAGE_SEEK_MODE_BEG);
+        return write_func(userdata, data, size) == size;
+    }
+
+    bool Image::write_metadata(const std::uint32_t offset, const void *data, const std::uint32_t size) {
+        if (!write_func) {
+            return false;
+        }
+
+        if (!name_indexes.empty()) {
+            invalidate_name_indexes(offset, size);
+        }
+
+        const std::uint32_t block_size = boot_block.bytes_per_block;
+        const std::uint8_t *source = static_cast<const std::uint8_t*>(data);
+
+        std::uint32_t position = offset;
+        std::uint32_t size_left = size;
 
-                while (extended_entries[j].name_part_1[i] != 0 && i < 5) {
-                    final_name += extended_entries[j].name_part_1[i++];
+        while (size_left != 0) {
+            const std::uint32_t block = position / block_size;
+            const std::uint32_t offset_in_block = position % block_size;
+            const std::uint32_t size_to_take = std::min<std::uint32_t>(block_size - offset_in_block, size_left);
+
+            auto cached = dirty_blocks.find(block);
+
+            if (cached == dirty_blocks.end()) {
+                std::vector<std::uint8_t> content(block_size);
+
+                // Partial block: keep the rest of what's on the image
+                if (size_to_take != block_size && read_at(block * block_size, content.data(), block_size) != block_size) {
+                    return false;
                 }
 
-                if (i < 5 && extended_entries[j].name_part_1[i] == 0) {
+                cached = dirty_blocks.emplace(block, std::move(content)).first;
+            }
+
+            std::memcpy(cached->second.data() + offset_in_block, source, size_to_take);
+
+            source += size_to_take;
+            position += size_to_take;
+            size_left -= size_to_take;
+        }
+
+        return true;
+    }
+
+    bool Image::write_data(const std::uint32_t offset, const void *data, const std::uint32_t size) {
+        if (size == 0) {
+            return true;
+        }
+
+        if (!write_at(offset, data, size)) {
+            return false;
+        }
+
+        const std::uint32_t block_size = boot_block.bytes_per_block;
+        const std::uint8_t *source = static_cast<const std::uint8_t*>(data);
+
+        // Keep dirty blocks in step, or flushing them would undo this write
+        for (auto it = dirty_blocks.lower_bound(offset / block_size); it != dirty_blocks.end()
+            && it->first <= (offset + size - 1) / block_size; ++it) {
+            const std::uint32_t block_start = it->first * block_size;
+            const std::uint32_t from = std::max(block_start, offset);
+            const std::uint32_t to = std::min(block_start + block_size, offset + size);
+
+            std::memcpy(it->second.data() + (from - block_start), source + (from - offset), to - from);
+        }
+
+        return true;
+    }
+
+    void Image::invalidate_name_indexes(const std::uint32_t offset, const std::uint32_t size) {
+        const std::uint32_t end = offset + size;
+        const std::uint32_t fat_start = boot_block.fat_region_start();
+        const std::uint32_t cluster_size = bytes_per_cluster();
+
+        for (auto index = name_indexes.begin(); index != name_indexes.end(); ) {
+            bool touched = false;
+
+            if (index->first == 0) {
+                touched = (offset < boot_block.data_region_start() && end > boot_block.root_directory_region_start());
+            }
+
+            for (const Extent &extent : index->second.extents) {
+                // Its slots, or the links of its chain, which it grows or shrinks through
+                const std::uint32_t run_start = cluster_offset(extent.first);
+                const std::uint32_t run_end = run_start + extent.count * cluster_size;
+                const std::uint32_t links_start = fat_start + extent.first * sizeof(ClusterID);
+                const std::uint32_t links_end = links_start + extent.count * sizeof(ClusterID);
+
+                if ((offset < run_end && end > run_start) || (offset < links_end && end > links_start)) {
+                    touched = true;
                     break;
                 }
-                
-                i = 0;
+            }
+
+            index = touched ? name_indexes.erase(index) : std::next(index);
+        }
+    }
+
+    bool Image::build_name_index(const ClusterID directory, NameIndex &index) {
+        DirectoryBuffer buffer;
+
+        if (!buffer.read(*this, directory)) {
+            return false;
+        }
+
+        index.slots.clear();
+        index.slots.reserve(buffer.slot_count());
+        index.extents = buffer.extents;
 
-                while (extended_entries[j].name_part_2[i] != 0 && i < 6) {
-                    final_name += extended_entries[j].name_part_2[i++];
+        std::uint32_t slot = 0;
+        DirectoryRecord record;
+        std::u16string name;
+
+        while (buffer.next_record(slot, record)) {
+            const std::uint64_t value = record.slot | (static_cast<std::uint64_t>(record.long_name_count) << 32);
+
+            // Found by its long name and by its 8.3 name. A name used twice keeps its first entry.
+            for (std::uint32_t use_long_name = (record.long_name_count ? 1 : 0); ; use_long_name--) {
+                name.clear();
+                append_filename(*buffer.get_record(record.slot), buffer.get_long_name(record),
+                    use_long_name ? record.long_name_count : 0, name);
+
+                for (char16_t &c : name) {
+                    c = fold_case(c);
                 }
-                
-                if (i < 6 && extended_entries[j].name_part_2[i] == 0) {
+
+                index.slots.emplace(name, value);
+
+                if (use_long_name == 0) {
                     break;
                 }
+            }
+        }
+
+        return true;
+    }
+
+    bool Image::find_entry(const ClusterID directory, const std::u16string &name, Entry &found) {
+        auto index = name_indexes.find(directory);
+
+        if (index == name_indexes.end()) {
+            NameIndex built;
+
+            if (!build_name_index(directory, built)) {
+                return false;
+            }
+
+            index = name_indexes.emplace(directory, std::move(built)).first;
+        }
+
+        std::u16string folded(name);
+
+        for (char16_t &c : folded) {
+            c = fold_case(c);
+        }
+
+        const auto match = index->second.slots.find(folded);
+
+        if (match == index->second.slots.end()) {
+            return false;
+        }
+
+        const std::uint32_t slot = static_cast<std::uint32_t>(match->second);
+        const std::uint32_t long_name_count = static_cast<std::uint32_t>(match->second >> 32);
+
+        found.root = directory;
+        found.cursor_record = (slot + 1) * sizeof(FundamentalEntry);
+        found.discarded_long_name_slots = 0;
+        found.extended_entries.resize(long_name_count);
+
+        // The long name slots come right before the record, maybe in the previous cluster
+        for (std::uint32_t i = 0; i <= long_name_count; i++) {
+            const std::uint32_t position = (slot - long_name_count + i) * sizeof(FundamentalEntry);
+            const std::uint32_t offset = directory ? get_extent_offset(*this, index->second.extents, position)
+                : boot_block.root_directory_region_start() + position;
+
+            void *dest = (i == long_name_count) ? static_cast<void*>(&found.entry) : static_cast<void*>(&found.extended_entries[i]);
+
+            if (offset == 0 || read_at(offset, dest, sizeof(FundamentalEntry)) != sizeof(FundamentalEntry)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool Image::set_successor_cluster(const ClusterID target, const ClusterID next) {
+        if (!write_func || target >= (boot_block.num_blocks_per_fat * boot_block.bytes_per_block) / sizeof(ClusterID)) {
+            return false;
+        }
+
+        if (!write_metadata(boot_block.fat_region_start() + (target * 2), &next, sizeof(ClusterID))) {
+            return false;
+        }
+
+        if (target < fat_cache.size()) {
+            fat_cache[target] = next;
+        }
+
+        return true;
+    }
+
+    bool Image::link_chain(const std::vector<Extent> &extents) {
+        for (std::size_t i = 0; i < extents.size(); i++) {
+            for (std::uint32_t j = 0; j < extents[i].count; j++) {
+                const ClusterID current = static_cast<ClusterID>(extents[i].first + j);
+                ClusterID next = static_cast<ClusterID>(current + 1);
+
+                if (j + 1 == extents[i].count) {
+                    next = (i + 1 == extents.size()) ? ClusterID(CLUSTER_END_OF_CHAIN) : extents[i + 1].first;
+                }
+
+                if (!set_successor_cluster(current, next)) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool Image::free_chain(const ClusterID starting_cluster) {
+        const std::uint32_t cluster_limit = this->cluster_limit();
+
+        ClusterID current = starting_cluster;
+        std::uint32_t visited = 0;
 
-                i = 0;
+        // The visit count guards against cyclic chains
+        while (current >= CLUSTER_FIRST_VALID && current < cluster_limit && visited++ < cluster_limit) {
+            const ClusterID next = get_successor_cluster(current);
 
-                while (extended_entries[j].name_part_3[i] != 0 && i < 2) {
-                    final_name += extended_entries[j].name_part_3[i++];
+            if (!set_successor_cluster(current, CLUSTER_FREE)) {
+                return false;
+            }
+
+            if (discard_func) {
+                if (!freed_extents.empty() && freed_extents.back().first + freed_extents.back().count == current) {
+                    freed_extents.back().count++;
+                } else {
+                    freed_extents.push_back({ current, 1 });
                 }
-                
-                if (i < 2 && extended_entries[j].name_part_3[i] == 0) {
-                    break;
+            }
+
+            current = next;
+        }
+
+        return true;
+    }
+
+    bool Image::flush_range(const std::vector<std::uint32_t> &blocks, const std::uint32_t shift) {
+        const std::uint32_t block_size = boot_block.bytes_per_block;
+        std::vector<std::uint8_t> staging;
+
+        std::size_t i = 0;
+
+        while (i < blocks.size()) {
+            // Gather a run of adjacent blocks so it goes out in one write
+            std::size_t run_end = i + 1;
+            while (run_end < blocks.size() && blocks[run_end] == blocks[run_end - 1] + 1) {
+                run_end++;
+            }
+
+            staging.resize((run_end - i) * block_size);
+
+            for (std::size_t j = i; j < run_end; j++) {
+                const std::vector<std::uint8_t> &content = dirty_blocks[blocks[j]];
+                std::memcpy(staging.data() + (j - i) * block_size, content.data(), block_size);
+            }
+
+            if (!write_at((blocks[i] + shift) * block_size, staging.data(), static_cast<std::uint32_t>(staging.size()))) {
+                return false;
+            }
+
+            i = run_end;
+        }
+
+        return true;
+    }
+
+    bool Image::flush() {
+        if (dirty_blocks.empty()) {
+            return true;
+        }
+
+        const std::uint32_t fat_start = boot_block.num_reserved_blocks;
+        const std::uint32_t fat_end = fat_start + boot_block.num_blocks_per_fat;
+
+        std::vector<std::uint32_t> before_fat;
+        std::vector<std::uint32_t> fat_blocks;
+        std::vector<std::uint32_t> after_fat;
+
+        // The map is ordered, so every list comes out sorted
+        for (const auto &block : dirty_blocks) {
+            if (block.first < fat_start) {
+                before_fat.push_back(block.first);
+            } else if (block.first < fat_end) {
+                fat_blocks.push_back(block.first);
+            } else {
+                after_fat.push_back(block.first);
+            }
+        }
+
+        if (!flush_range(before_fat, 0)) {
+            return false;
+        }
+
+        // Mirror the first FAT to the others, one sequential pass per copy
+        for (std::uint32_t copy = 0; copy < boot_block.num_fat; copy++) {
+            if (!flush_range(fat_blocks, copy * boot_block.num_blocks_per_fat)) {
+                return false;
+            }
+        }
+
+        if (!flush_range(after_fat, 0)) {
+            return false;
+        }
+
+        dirty_blocks.clear();
+
+        if (!freed_extents.empty()) {
+            discard_freed_extents();
+        }
+
+        return true;
+    }
+
+    void Image::discard_freed_extents() {
+        const std::uint32_t cluster_size = bytes_per_cluster();
+
+        for (const Extent &extent : freed_extents) {
+            std::uint32_t run_start = extent.first;
+
+            // Clusters linked again since they were freed hold live data now
+            for (std::uint32_t cluster = extent.first; cluster <= extent.first + extent.count; cluster++) {
+                if (cluster < extent.first + extent.count && get_successor_cluster(static_cast<ClusterID>(cluster)) == CLUSTER_FREE) {
+                    continue;
+                }
+
+                // A failed discard only leaves the old data in place
+                if (cluster != run_start) {
+                    discard_func(userdata, cluster_offset(static_cast<ClusterID>(run_start)), (cluster - run_start) * cluster_size);
+                }
+
+                run_start = cluster + 1;
+            }
+        }
+
+        freed_extents.clear();
+    }
+
+    std::u16string Entry::get_filename() {
+        std::u16string final_name;
+        append_filename(entry, extended_entries.data(), static_cast<std::uint32_t>(extended_entries.size()), final_name);
+
+        return final_name;
+    }
+
+    bool Entry::matches_name(const char16_t *name, const std::size_t length) const {
+        return Fat16::matches_name(entry, extended_entries.data(), static_cast<std::uint32_t>(extended_entries.size()), name, length);
+    }
+
+    static bool long_name_matches(const LongFileNameEntry *long_name, const std::uint32_t long_name_count, const char16_t *name,
+        const std::size_t length) {
+        // Every slot but the last part is full, anything out of that range can't match
+        if (length > long_name_count * 13 || length <= (long_name_count - 1) * 13) {
+            return false;
+        }
+
+        std::size_t position = 0;
+
+        for (std::uint32_t i = long_name_count; i != 0; i--) {
+            const LongFileNameEntry &part = long_name[i - 1];
+            const char16_t units[13] = {
+                part.name_part_1[0], part.name_part_1[1], part.name_part_1[2], part.name_part_1[3], part.name_part_1[4],
+                part.name_part_2[0], part.name_part_2[1], part.name_part_2[2], part.name_part_2[3], part.name_part_2[4],
+                part.name_part_2[5], part.name_part_3[0], part.name_part_3[1]
+            };
+
+            for (const char16_t unit : units) {
+                if (unit == 0) {
+                    return position == length;
+                }
+
+                if (position == length || fold_case(unit) != fold_case(name[position])) {
+                    return false;
                 }
+
+                position++;
+            }
+        }
+
+        return position == length;
+    }
+
+    static bool short_name_matches(const FundamentalEntry &entry, const char16_t *name, const std::size_t length) {
+        std::size_t base_length = sizeof(entry.filename);
+        while (base_length != 0 && entry.filename[base_length - 1] == ' ') {
+            base_length--;
+        }
+
+        std::size_t extension_length = sizeof(entry.filename_ext);
+        while (extension_length != 0 && entry.filename_ext[extension_length - 1] == ' ') {
+            extension_length--;
+        }
+
+        if (length != base_length + (extension_length ? extension_length + 1 : 0)) {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < base_length; i++) {
+            const char16_t c = (i == 0 && entry.filename[0] == 0x05) ? u'\xE5' : static_cast<char16_t>(entry.filename[i]);
+
+            if (fold_case(c) != fold_case(name[i])) {
+                return false;
+            }
+        }
+
+        if (extension_length == 0) {
+            return true;
+        }
+
+        if (name[base_length] != u'.') {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < extension_length; i++) {
+            const char16_t c = static_cast<char16_t>(static_cast<std::uint8_t>(entry.filename_ext[i]));
+
+            if (fold_case(c) != fold_case(name[base_length + 1 + i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool matches_name(const FundamentalEntry &entry, const LongFileNameEntry *long_name, const std::uint32_t long_name_count,
+        const char16_t *name, const std::size_t length) {
+        if (long_name_count != 0 && long_name_matches(long_name, long_name_count, name, length)) {
+            return true;
+        }
+
+        return short_name_matches(entry, name, length);
+    }
+
+    std::uint8_t short_name_checksum(const char *short_name) {
+        std::uint8_t sum = 0;
+
+        for (std::size_t i = 0; i < 11; i++) {
+            sum = static_cast<std::uint8_t>(((sum & 1) << 7) + (sum >> 1) + static_cast<std::uint8_t>(short_name[i]));
+        }
+
+        return sum;
+    }
+
+    std::uint32_t match_long_name(const LongFileNameEntry *slots, const std::uint32_t count, const FundamentalEntry &entry) {
+        static constexpr std::uint8_t LAST_PART = 0x40;
+        static constexpr std::uint8_t MAX_PARTS = 20;
+
+        const std::uint8_t checksum = short_name_checksum(reinterpret_cast<const char*>(entry.filename));
+
+        // Walk back from the record: parts 1, 2, ... until the one flagged as last
+        for (std::uint32_t part = 1; part <= count && part <= MAX_PARTS; part++) {
+            const LongFileNameEntry &slot = slots[count - part];
+
+            if (slot.position == 0xE5 || (slot.position & 0x1F) != part || slot.checksum != checksum) {
+                return 0;
             }
 
-            return final_name;
+            if (slot.position & LAST_PART) {
+                return part;
+            }
+        }
+
+        return 0;
+    }
+
+    char16_t fold_case(const char16_t c) {
+        if ((c >= u'a' && c <= u'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7)) {
+            // ASCII and Latin-1
+            return static_cast<char16_t>(c - 0x20);
+        }
+
+        if (c >= 0x3B1 && c <= 0x3C9 && c != 0x3C2) {
+            // Greek
+            return static_cast<char16_t>(c - 0x20);
+        }
+
+        if (c >= 0x430 && c <= 0x44F) {
+            // Cyrillic
+            return static_cast<char16_t>(c - 0x20);
+        }
+
+        if (c >= 0x450 && c <= 0x45F) {
+            return static_cast<char16_t>(c - 0x50);
         }
 
-        // Use fundamental name.
-        std::string final_name = entry.get_filename() + std::string(entry.filename_ext, 3);
-        while (final_name.length() > 0 && final_name.back() == ' ') final_name.pop_back();
+        return c;
+    }
+
+    std::string utf16_to_utf8(const std::u16string &source) {
+        std::string result;
+        std::size_t i = 0;
+
+        while (i < source.length()) {
+            std::uint32_t codepoint = source[i++];
+
+            if (codepoint >= 0xD800 && codepoint < 0xDC00 && i < source.length()
+                && source[i] >= 0xDC00 && source[i] < 0xE000) {
+                // Surrogate pair
+                codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (source[i++] - 0xDC00);
+            }
+
+            if (codepoint < 0x80) {
+                result += static_cast<char>(codepoint);
+            } else if (codepoint < 0x800) {
+                result += static_cast<char>(0xC0 | (codepoint >> 6));
+                result += static_cast<char>(0x80 | (codepoint & 0x3F));
+            } else if (codepoint < 0x10000) {
+                result += static_cast<char>(0xE0 | (codepoint >> 12));
+                result += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+                result += static_cast<char>(0x80 | (codepoint & 0x3F));
+            } else {
+                result += static_cast<char>(0xF0 | (codepoint >> 18));
+                result += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+                result += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+                result += static_cast<char>(0x80 | (codepoint & 0x3F));
+            }
+        }
+
+        return result;
+    }
+
+    std::u16string utf8_to_utf16(const std::string &source) {
+        std::u16string result;
+        std::size_t i = 0;
+
+        while (i < source.length()) {
+            const std::uint8_t lead = static_cast<std::uint8_t>(source[i]);
+            std::uint32_t codepoint = 0;
+            std::size_t extra = 0;
+
+            if (lead < 0x80) {
+                codepoint = lead;
+            } else if ((lead & 0xE0) == 0xC0) {
+                codepoint = lead & 0x1F;
+                extra = 1;
+            } else if ((lead & 0xF0) == 0xE0) {
+                codepoint = lead & 0x0F;
+                extra = 2;
+            } else {
+                codepoint = lead & 0x07;
+                extra = 3;
+            }
+
+            i++;
+
+            for (std::size_t j = 0; j < extra && i < source.length(); j++, i++) {
+                codepoint = (codepoint << 6) | (static_cast<std::uint8_t>(source[i]) & 0x3F);
+            }
+
+            if (codepoint >= 0x10000) {
+                // Surrogate pair
+                codepoint -= 0x10000;
+                result += static_cast<char16_t>(0xD800 + (codepoint >> 10));
+                result += static_cast<char16_t>(0xDC00 + (codepoint & 0x3FF));
+            } else {
+                result += static_cast<char16_t>(codepoint);
+            }
+        }
 
-        return std::u16string(final_name.begin(), final_name.end());
+        return result;
     }
-}
+}
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include <fat16/directory.h>
+#include <fat16/glob.h>
+
+#include <memory>
+
+namespace Fat16 {
+    static constexpr std::size_t MAX_GLOB_COMPONENTS = 63;
+
+    bool GlobPattern::compile(const std::string &pattern) {
+        components.clear();
+        sets.clear();
+
+        const std::u16string source = utf8_to_utf16(pattern);
+        std::size_t start = 0;
+
+        while (start <= source.length()) {
+            std::size_t end = source.find(u'/', start);
+            if (end == std::u16string::npos) {
+                end = source.length();
+            }
+
+            const std::u16string part = source.substr(start, end - start);
+            start = end + 1;
+
+            if (part.empty()) {
+                continue;
+            }
+
+            Component component;
+            component.any_depth = (part == u"**");
+            component.literal = true;
+
+            for (std::size_t i = 0; i < part.length() && !component.any_depth; i++) {
+                Token token;
+                token.type = TokenType::CHARACTER;
+                token.character = 0;
+                token.set = 0;
+
+                const char16_t c = part[i];
+
+                if (c == u'*') {
+                    token.type = TokenType::ANY_RUN;
+
+                    // A run of stars is one star
+                    while (i + 1 < part.length() && part[i + 1] == u'*') {
+                        i++;
+                    }
+                } else if (c == u'?') {
+                    token.type = TokenType::ANY_ONE;
+                } else if (c == u'[' && part.find(u']', i + 2) != std::u16string::npos) {
+                    CharacterSet set;
+                    set.negated = (part[i + 1] == u'!' || part[i + 1] == u'^');
+
+                    std::size_t j = i + (set.negated ? 2 : 1);
+
+                    // A ']' right after the opening is a member, not the end
+                    do {
+                        char16_t low = part[j];
+                        char16_t high = low;
+
+                        if (j + 2 < part.length() && part[j + 1] == u'-' && part[j + 2] != u']') {
+                            high = part[j + 2];
+                            j += 2;
+                        }
+
+                        set.ranges.push_back({ fold_case(low), fold_case(high) });
+                        j++;
+                    } while (j < part.length() && part[j] != u']');
+
+                    if (j >= part.length()) {
+                        return false;
+                    }
+
+                    token.type = TokenType::SET;
+                    token.set = static_cast<std::uint32_t>(sets.size());
+                    sets.push_back(std::move(set));
+
+                    i = j;
+                } else {
+                    if (c == u'\\' && i + 1 < part.length()) {
+                        i++;
+                    }
+
+                    token.character = fold_case(part[i]);
+                    component.text += part[i];
+                }
+
+                if (token.type != TokenType::CHARACTER) {
+                    component.literal = false;
+                }
+
+                component.tokens.push_back(token);
+            }
+
+            if (components.size() == MAX_GLOB_COMPONENTS) {
+                return false;
+            }
+
+            components.push_back(std::move(component));
+        }
+
+        return !components.empty();
+    }
+
+    bool GlobPattern::match_tokens(const Component &component, const char16_t *name, const std::size_t length) const {
+        const std::vector<Token> &tokens = component.tokens;
+
+        std::size_t token = 0;
+        std::size_t position = 0;
+
+        // Where to resume after the last star, if what follows it fails
+        std::size_t star_token = tokens.size();
+        std::size_t star_position = 0;
+
+        while (position < length) {
+            if (token < tokens.size()) {
+                const Token &current = tokens[token];
+
+                if (current.type == TokenType::ANY_RUN) {
+                    star_token = token++;
+                    star_position = position;
+                    continue;
+                }
+
+                const char16_t c = fold_case(name[position]);
+                bool matched = (current.type == TokenType::ANY_ONE);
+
+                if (current.type == TokenType::CHARACTER) {
+                    matched = (c == current.character);
+                } else if (current.type == TokenType::SET) {
+                    const CharacterSet &set = sets[current.set];
+
+                    for (const std::pair<char16_t, char16_t> &range : set.ranges) {
+                        if (c >= range.first && c <= range.second) {
+                            matched = true;
+                            break;
+                        }
+                    }
+
+                    matched = (matched != set.negated);
+                }
+
+                if (matched) {
+                    token++;
+                    position++;
+                    continue;
+                }
+            }
+
+            if (star_token == tokens.size()) {
+                return false;
+            }
+
+            // Let the star take one more character
+            token = star_token + 1;
+            position = ++star_position;
+        }
+
+        while (token < tokens.size() && tokens[token].type == TokenType::ANY_RUN) {
+            token++;
+        }
+
+        return token == tokens.size();
+    }
+
+    std::uint64_t GlobPattern::initial_states() const {
+        std::uint64_t states = 1;
+
+        // "**" may match no directory at all
+        for (std::size_t i = 0; i < components.size() && components[i].any_depth; i++) {
+            states |= std::uint64_t(1) << (i + 1);
+        }
+
+        return states;
+    }
+
+    std::uint64_t GlobPattern::advance(const std::uint64_t states, const EntryView &view, std::u16string &scratch) const {
+        std::uint64_t next = 0;
+        bool name_decoded = false;
+
+        for (std::size_t i = 0; i < components.size(); i++) {
+            if (((states >> i) & 1) == 0) {
+                continue;
+            }
+
+            const Component &component = components[i];
+
+            if (component.any_depth) {
+                next |= std::uint64_t(1) << i;
+                continue;
+            }
+
+            bool matched = false;
+
+            if (component.literal) {
+                matched = view.matches_name(component.text);
+            } else {
+                if (!name_decoded) {
+                    scratch.clear();
+                    append_filename(*view.entry, view.long_name, view.long_name_count, scratch);
+                    name_decoded = true;
+                }
+
+                matched = match_tokens(component, scratch.data(), scratch.length());
+            }
+
+            if (matched) {
+                next |= std::uint64_t(1) << (i + 1);
+            }
+        }
+
+        // Going past a "**" costs nothing
+        for (std::size_t i = 0; i < components.size(); i++) {
+            if (((next >> i) & 1) && components[i].any_depth) {
+                next |= std::uint64_t(1) << (i + 1);
+            }
+        }
+
+        return next;
+    }
+
+    bool find(Image &img, const GlobPattern &pattern, FindResultFunc result_func, void *userdata) {
+        struct Pending {
+            std::shared_ptr<const WalkPath> path;
+            ClusterID cluster;
+            std::uint64_t states;
+        };
+
+        if (img.fat_cache.empty()) {
+            img.cache_fat();
+        }
+
+        const std::uint64_t inner_states = (std::uint64_t(1) << pattern.component_count()) - 1;
+
+        std::shared_ptr<WalkPath> root = std::make_shared<WalkPath>();
+        root->depth = 0;
+
+        std::vector<Pending> pending;
+        pending.push_back({ std::move(root), 0, pattern.initial_states() });
+
+        std::vector<Pending> subdirectories;
+        std::vector<bool> visited(img.cluster_limit(), false);
+
+        DirectoryBuffer buffer;
+        std::u16string scratch;
+
+        while (!pending.empty()) {
+            const Pending current = std::move(pending.back());
+            pending.pop_back();
+
+            if (!buffer.read(img, current.cluster)) {
+                return false;
+            }
+
+            subdirectories.clear();
+
+            std::uint32_t slot = 0;
+            DirectoryRecord record;
+
+            while (buffer.next_record(slot, record)) {
+                EntryView view;
+                view.entry = buffer.get_record(record.slot);
+                view.long_name = buffer.get_long_name(record);
+                view.long_name_count = record.long_name_count;
+                view.record_offset = buffer.get_slot_offset(img, record.slot);
+                view.parent = current.path.get();
+
+                const std::uint64_t next = pattern.advance(current.states, view, scratch);
+
+                if (pattern.is_match(next) && !result_func(userdata, view)) {
+                    return true;
+                }
+
+                const ClusterID cluster = view.entry->starting_cluster;
+
+                // Pruned unless part of the pattern is left to match inside
+                if (!view.is_directory() || (next & inner_states) == 0 || cluster < CLUSTER_FIRST_VALID
+                    || cluster >= visited.size() || visited[cluster]) {
+                    continue;
+                }
+
+                visited[cluster] = true;
+
+                std::shared_ptr<WalkPath> path = std::make_shared<WalkPath>();
+                path->parent = current.path;
+                path->name = view.get_filename();
+                path->depth = current.path->depth + 1;
+
+                subdirectories.push_back({ std::move(path), cluster, next & inner_states });
+            }
+
+            // Reversed, so the first subdirectory is the next one read
+            pending.insert(pending.end(), subdirectories.rbegin(), subdirectories.rend());
+        }
+
+        return true;
+    }
+}
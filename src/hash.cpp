@@ -0,0 +1,565 @@
+#include <fat16/hash.h>
+#include <fat16/walker.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAT16_HAS_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace Fat16 {
+    static constexpr std::uint32_t CRC32_POLYNOMIAL = 0xEDB88320;
+
+    struct Crc32Tables {
+        std::uint32_t table[8][256];
+
+        explicit Crc32Tables() {
+            for (std::uint32_t i = 0; i < 256; i++) {
+                std::uint32_t crc = i;
+
+                for (int bit = 0; bit < 8; bit++) {
+                    crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLYNOMIAL : 0);
+                }
+
+                table[0][i] = crc;
+            }
+
+            // table[n] advances a byte that still has n zero bytes to go through
+            for (std::uint32_t i = 0; i < 256; i++) {
+                for (int n = 1; n < 8; n++) {
+                    table[n][i] = (table[n - 1][i] >> 8) ^ table[0][table[n - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+
+    static const Crc32Tables &get_crc32_tables() {
+        static const Crc32Tables tables;
+        return tables;
+    }
+
+    /**
+     * \brief Slicing by 8, on the inverted CRC.
+     */
+    static std::uint32_t crc32_scalar(std::uint32_t crc, const std::uint8_t *data, std::size_t size) {
+        const Crc32Tables &tables = get_crc32_tables();
+        const std::uint32_t (&t)[8][256] = tables.table;
+
+        while (size >= 8) {
+            std::uint32_t low;
+            std::uint32_t high;
+
+            std::memcpy(&low, data, 4);
+            std::memcpy(&high, data + 4, 4);
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+            low = __builtin_bswap32(low);
+            high = __builtin_bswap32(high);
+#endif
+
+            low ^= crc;
+
+            crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+                ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+
+            data += 8;
+            size -= 8;
+        }
+
+        while (size-- != 0) {
+            crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+        }
+
+        return crc;
+    }
+
+#if defined(FAT16_HAS_X86_DISPATCH)
+    /**
+     * \brief Fold with carry-less multiplies, on the inverted CRC.
+     *
+     * From "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel.
+     * Takes at least 64 bytes, a multiple of 16.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static std::uint32_t crc32_pclmul(const std::uint32_t crc, const std::uint8_t *data, std::size_t size) {
+        // Bit reflected constants: x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) mod P, x^64 mod P
+        const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+        const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+        const __m128i k5k0 = _mm_set_epi64x(0, 0x0163CD6124);
+
+        // P and the Barrett constant, floor(x^64 / P)
+        const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+        const __m128i low_32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+        __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+        __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+        __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+        __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+        data += 64;
+        size -= 64;
+
+        // Four independent lanes, 64 bytes a round
+        while (size >= 64) {
+            const __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+            const __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+            const __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+            const __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+            x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00)));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10)));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20)));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30)));
+
+            data += 64;
+            size -= 64;
+        }
+
+        // Fold the lanes into one
+        const __m128i lanes[3] = { x2, x3, x4 };
+
+        for (const __m128i &lane : lanes) {
+            const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, lane), x5);
+        }
+
+        while (size >= 16) {
+            const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data))), x5);
+
+            data += 16;
+            size -= 16;
+        }
+
+        // 128 bits down to 64
+        x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, low_32);
+        x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        // Barrett reduction to 32 bits
+        x2 = _mm_and_si128(x1, low_32);
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+        x2 = _mm_and_si128(x2, low_32);
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        return static_cast<std::uint32_t>(_mm_extract_epi32(x1, 1));
+    }
+#endif
+
+    static bool has_pclmul() {
+#if defined(FAT16_HAS_X86_DISPATCH)
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+    }
+
+    std::uint32_t crc32(const std::uint32_t crc, const void *data, std::size_t size) {
+        static const bool use_pclmul = has_pclmul();
+
+        const std::uint8_t *bytes = static_cast<const std::uint8_t*>(data);
+        std::uint32_t value = ~crc;
+
+#if defined(FAT16_HAS_X86_DISPATCH)
+        if (use_pclmul && size >= 64) {
+            const std::size_t folded = size & ~static_cast<std::size_t>(15);
+
+            value = crc32_pclmul(value, bytes, folded);
+            bytes += folded;
+            size -= folded;
+        }
+#else
+        (void)use_pclmul;
+#endif
+
+        return ~crc32_scalar(value, bytes, size);
+    }
+
+    static const std::uint32_t SHA256_ROUND_CONSTANTS[64] = {
+        0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+        0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+        0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+        0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+        0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+        0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+        0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+        0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+    };
+
+    static inline std::uint32_t rotate_right(const std::uint32_t value, const int count) {
+        return (value >> count) | (value << (32 - count));
+    }
+
+    static void sha256_blocks_scalar(std::uint32_t state[8], const std::uint8_t *data, std::size_t count) {
+        while (count-- != 0) {
+            std::uint32_t w[64];
+
+            for (int i = 0; i < 16; i++) {
+                w[i] = (std::uint32_t(data[i * 4]) << 24) | (std::uint32_t(data[i * 4 + 1]) << 16)
+                    | (std::uint32_t(data[i * 4 + 2]) << 8) | std::uint32_t(data[i * 4 + 3]);
+            }
+
+            for (int i = 16; i < 64; i++) {
+                const std::uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                const std::uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (int i = 0; i < 64; i++) {
+                const std::uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+                const std::uint32_t choice = (e & f) ^ (~e & g);
+                const std::uint32_t t1 = h + s1 + choice + SHA256_ROUND_CONSTANTS[i] + w[i];
+                const std::uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+                const std::uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + s0 + majority;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+
+            data += 64;
+        }
+    }
+
+#if defined(FAT16_HAS_X86_DISPATCH)
+    /**
+     * \brief Two rounds per SHA256RNDS2, the message schedule with SHA256MSG1/MSG2.
+     *
+     * The state is kept as ABEF and CDGH, the order the instructions want.
+     */
+    __attribute__((target("sha,sse4.1")))
+    static void sha256_blocks_shani(std::uint32_t state[8], const std::uint8_t *data, std::size_t count) {
+        const __m128i byte_swap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+        __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        while (count-- != 0) {
+            const __m128i abef = state0;
+            const __m128i cdgh = state1;
+
+            __m128i w[4];
+
+            // 16 groups of 4 rounds. Group g uses w[g % 4], the schedule refills it for group g + 4
+#pragma GCC unroll 16
+            for (int g = 0; g < 16; g++) {
+                if (g < 4) {
+                    w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + g * 16)), byte_swap);
+                }
+
+                __m128i message = _mm_add_epi32(w[g % 4],
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(SHA256_ROUND_CONSTANTS + g * 4)));
+
+                state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+
+                if (g >= 3 && g < 15) {
+                    const __m128i &current = w[g % 4];
+                    __m128i &next = w[(g + 1) % 4];
+
+                    next = _mm_add_epi32(next, _mm_alignr_epi8(current, w[(g + 3) % 4], 4));
+                    next = _mm_sha256msg2_epu32(next, current);
+                }
+
+                message = _mm_shuffle_epi32(message, 0x0E);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+
+                if (g >= 1 && g < 13) {
+                    w[(g + 3) % 4] = _mm_sha256msg1_epu32(w[(g + 3) % 4], w[g % 4]);
+                }
+            }
+
+            state0 = _mm_add_epi32(state0, abef);
+            state1 = _mm_add_epi32(state1, cdgh);
+
+            data += 64;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+        state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+    }
+#endif
+
+    typedef void (*Sha256BlocksFunc)(std::uint32_t state[8], const std::uint8_t *data, std::size_t count);
+
+    static Sha256BlocksFunc pick_sha256_blocks() {
+#if defined(FAT16_HAS_X86_DISPATCH)
+        if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+            return sha256_blocks_shani;
+        }
+#endif
+
+        return sha256_blocks_scalar;
+    }
+
+    static void sha256_blocks(std::uint32_t state[8], const std::uint8_t *data, std::size_t count) {
+        static const Sha256BlocksFunc process = pick_sha256_blocks();
+        process(state, data, count);
+    }
+
+    Sha256::Sha256() {
+        reset();
+    }
+
+    void Sha256::reset() {
+        static const std::uint32_t initial_state[8] = {
+            0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+        };
+
+        std::memcpy(state, initial_state, sizeof(state));
+        length = 0;
+    }
+
+    void Sha256::update(const void *data, std::size_t size) {
+        const std::uint8_t *bytes = static_cast<const std::uint8_t*>(data);
+        std::size_t buffered = length % sizeof(block);
+
+        length += size;
+
+        if (buffered != 0) {
+            const std::size_t to_take = std::min(size, sizeof(block) - buffered);
+
+            std::memcpy(block + buffered, bytes, to_take);
+            bytes += to_take;
+            size -= to_take;
+            buffered += to_take;
+
+            if (buffered < sizeof(block)) {
+                return;
+            }
+
+            sha256_blocks(state, block, 1);
+        }
+
+        // Whole blocks straight from the caller's buffer
+        sha256_blocks(state, bytes, size / sizeof(block));
+        bytes += size - size % sizeof(block);
+
+        std::memcpy(block, bytes, size % sizeof(block));
+    }
+
+    void Sha256::finish(std::uint8_t digest[32]) {
+        const std::uint64_t bit_length = length * 8;
+        std::size_t buffered = length % sizeof(block);
+
+        block[buffered++] = 0x80;
+
+        if (buffered > sizeof(block) - 8) {
+            std::memset(block + buffered, 0, sizeof(block) - buffered);
+            sha256_blocks(state, block, 1);
+            buffered = 0;
+        }
+
+        std::memset(block + buffered, 0, sizeof(block) - 8 - buffered);
+
+        for (int i = 0; i < 8; i++) {
+            block[sizeof(block) - 1 - i] = static_cast<std::uint8_t>(bit_length >> (i * 8));
+        }
+
+        sha256_blocks(state, block, 1);
+
+        for (int i = 0; i < 8; i++) {
+            digest[i * 4] = static_cast<std::uint8_t>(state[i] >> 24);
+            digest[i * 4 + 1] = static_cast<std::uint8_t>(state[i] >> 16);
+            digest[i * 4 + 2] = static_cast<std::uint8_t>(state[i] >> 8);
+            digest[i * 4 + 3] = static_cast<std::uint8_t>(state[i]);
+        }
+    }
+
+    bool hash_file(Image &img, const FundamentalEntry &entry, FileDigest &digest, std::vector<std::uint8_t> &buffer) {
+        std::vector<Extent> extents;
+
+        if (entry.file_size != 0 && !img.get_extents(entry.starting_cluster, extents)) {
+            return false;
+        }
+
+        if (buffer.empty()) {
+            buffer.resize(HashOptions().chunk_size);
+        }
+
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        const std::uint32_t chunk_size = static_cast<std::uint32_t>(buffer.size());
+
+        std::uint32_t crc = 0;
+        Sha256 sha;
+
+        std::uint32_t size_left = entry.file_size;
+
+        for (const Extent &extent : extents) {
+            if (size_left == 0) {
+                break;
+            }
+
+            std::uint32_t offset = img.cluster_offset(extent.first);
+            std::uint32_t extent_left = static_cast<std::uint32_t>(std::min<std::uint64_t>(size_left,
+                std::uint64_t(extent.count) * cluster_size));
+
+            size_left -= extent_left;
+
+            // Each chunk goes through both digests while it is still in cache
+            while (extent_left != 0) {
+                const std::uint32_t size = std::min(extent_left, chunk_size);
+
+                if (img.read_at(offset, buffer.data(), size) != size) {
+                    return false;
+                }
+
+                crc = crc32(crc, buffer.data(), size);
+                sha.update(buffer.data(), size);
+
+                offset += size;
+                extent_left -= size;
+            }
+        }
+
+        if (size_left != 0) {
+            return false;
+        }
+
+        digest.crc32 = crc;
+        sha.finish(digest.sha256);
+
+        return true;
+    }
+
+    namespace {
+        struct FileListing {
+            std::mutex lock;
+            std::vector<HashedFile> files;
+        };
+    }
+
+    static WalkAction list_file(void *userdata, const EntryView &view, const std::uint32_t worker) {
+        (void)worker;
+
+        if (view.is_directory()) {
+            return WalkAction::CONTINUE;
+        }
+
+        HashedFile file;
+        file.path = view.parent->to_string();
+
+        if (!file.path.empty()) {
+            file.path += u'/';
+        }
+
+        file.path += view.get_filename();
+        file.entry = *view.entry;
+        file.record_offset = view.record_offset;
+        file.valid = false;
+
+        FileListing &listing = *static_cast<FileListing*>(userdata);
+        std::lock_guard<std::mutex> guard(listing.lock);
+
+        listing.files.push_back(std::move(file));
+        return WalkAction::CONTINUE;
+    }
+
+    bool hash_files(Image &img, HashResultFunc result_func, void *userdata, const HashOptions &options) {
+        FileListing listing;
+
+        WalkOptions walk_options;
+        walk_options.threads = options.threads;
+
+        if (!walk(img, list_file, &listing, walk_options)) {
+            return false;
+        }
+
+        std::vector<HashedFile> &files = listing.files;
+
+        std::sort(files.begin(), files.end(), [](const HashedFile &a, const HashedFile &b) {
+            return a.path < b.path;
+        });
+
+        // Handed out in cluster order, so neighbouring files are read one after the other
+        std::vector<std::uint32_t> order(files.size());
+
+        for (std::uint32_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+
+        std::sort(order.begin(), order.end(), [&files](const std::uint32_t a, const std::uint32_t b) {
+            return files[a].entry.starting_cluster < files[b].entry.starting_cluster;
+        });
+
+        std::uint32_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+
+        // Reads would share the image cursor otherwise
+        if (threads == 0 || !img.read_at_func) {
+            threads = 1;
+        }
+
+        std::atomic<std::size_t> next_file(0);
+
+        auto run_worker = [&]() {
+            std::vector<std::uint8_t> buffer(std::max<std::uint32_t>(options.chunk_size, 64));
+
+            for (std::size_t i = next_file++; i < order.size(); i = next_file++) {
+                HashedFile &file = files[order[i]];
+                file.valid = hash_file(img, file.entry, file.digest, buffer);
+            }
+        };
+
+        std::vector<std::thread> workers;
+
+        for (std::uint32_t i = 1; i < threads; i++) {
+            workers.emplace_back(run_worker);
+        }
+
+        run_worker();
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        for (const HashedFile &file : files) {
+            if (!result_func(userdata, file)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
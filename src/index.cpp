@@ -0,0 +1,446 @@
+#include <fat16/index.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FAT16_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Fat16 {
+    static constexpr char INDEX_MAGIC[8] = { 'F', 'A', 'T', '1', '6', 'I', 'D', 'X' };
+    static constexpr std::uint32_t INDEX_VERSION = 1;
+
+    static_assert(sizeof(IndexHeader) % 8 == 0, "Index header must keep the arrays after it aligned.");
+    static_assert(sizeof(IndexEntry) % 8 == 0, "Index entry must keep the arrays after it aligned.");
+
+    static int compare_folded(const char16_t *lhs, const std::size_t lhs_length, const char16_t *rhs, const std::size_t rhs_length) {
+        const std::size_t common = std::min(lhs_length, rhs_length);
+
+        for (std::size_t i = 0; i < common; i++) {
+            const char16_t left = fold_case(lhs[i]);
+            const char16_t right = fold_case(rhs[i]);
+
+            if (left != right) {
+                return (left < right) ? -1 : 1;
+            }
+        }
+
+        return (lhs_length == rhs_length) ? 0 : ((lhs_length < rhs_length) ? -1 : 1);
+    }
+
+    static void hash_bytes(std::uint64_t &hash, const std::uint8_t *data, const std::size_t size) {
+        for (std::size_t i = 0; i < size; i++) {
+            hash ^= data[i];
+            hash *= 0x100000001B3ULL;
+        }
+    }
+
+    MetadataIndex::MetadataIndex()
+        : mapping(nullptr)
+        , mapping_size(0)
+        , header(nullptr)
+        , entries(nullptr)
+        , extents(nullptr)
+        , names(nullptr) {
+    }
+
+    MetadataIndex::~MetadataIndex() {
+        release();
+    }
+
+    void MetadataIndex::release() {
+#if defined(FAT16_HAS_MMAP)
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+
+        mapping = nullptr;
+        mapping_size = 0;
+        owned.clear();
+
+        header = nullptr;
+        entries = nullptr;
+        extents = nullptr;
+        names = nullptr;
+    }
+
+    bool MetadataIndex::attach(const std::uint8_t *data, const std::size_t size) {
+        if (size < sizeof(IndexHeader)) {
+            return false;
+        }
+
+        const IndexHeader *candidate = reinterpret_cast<const IndexHeader*>(data);
+
+        if (std::memcmp(candidate->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || candidate->version != INDEX_VERSION
+            || candidate->entry_count == 0) {
+            return false;
+        }
+
+        const std::uint64_t expected_size = sizeof(IndexHeader)
+            + static_cast<std::uint64_t>(candidate->entry_count) * sizeof(IndexEntry)
+            + static_cast<std::uint64_t>(candidate->extent_count) * sizeof(IndexExtent)
+            + static_cast<std::uint64_t>(candidate->name_length) * sizeof(char16_t);
+
+        if (expected_size != size) {
+            return false;
+        }
+
+        const IndexEntry *candidate_entries = reinterpret_cast<const IndexEntry*>(data + sizeof(IndexHeader));
+
+        // Every reference has to stay in bounds, the accessors don't check again
+        for (std::uint32_t i = 0; i < candidate->entry_count; i++) {
+            const IndexEntry &entry = candidate_entries[i];
+
+            if ((i != 0 && entry.parent >= i)
+                || static_cast<std::uint64_t>(entry.first_child) + entry.child_count > candidate->entry_count
+                || (entry.child_count != 0 && entry.first_child <= i)
+                || static_cast<std::uint64_t>(entry.name_offset) + entry.name_length > candidate->name_length
+                || static_cast<std::uint64_t>(entry.first_extent) + entry.extent_count > candidate->extent_count) {
+                return false;
+            }
+        }
+
+        header = candidate;
+        entries = candidate_entries;
+        extents = reinterpret_cast<const IndexExtent*>(entries + header->entry_count);
+        names = reinterpret_cast<const char16_t*>(extents + header->extent_count);
+
+        return true;
+    }
+
+    bool MetadataIndex::compute_key(Image &img, const std::uint64_t image_size, const std::uint64_t image_mtime, IndexKey &key) {
+        // Boot block, FAT and root directory are contiguous: hash them in one go
+        const std::uint32_t fat_bytes = img.boot_block.num_blocks_per_fat * img.boot_block.bytes_per_block;
+        const std::uint32_t root_start = img.boot_block.root_directory_region_start();
+
+        std::uint64_t hash = 0xCBF29CE484222325ULL;
+        hash_bytes(hash, reinterpret_cast<const std::uint8_t*>(&img.boot_block), sizeof(BootBlock));
+
+        std::vector<std::uint8_t> buffer(fat_bytes);
+
+        if (img.read_at(img.boot_block.fat_region_start(), buffer.data(), fat_bytes) != fat_bytes) {
+            return false;
+        }
+
+        hash_bytes(hash, buffer.data(), buffer.size());
+
+        buffer.resize(img.boot_block.data_region_start() - root_start);
+
+        if (img.read_at(root_start, buffer.data(), static_cast<std::uint32_t>(buffer.size())) != buffer.size()) {
+            return false;
+        }
+
+        hash_bytes(hash, buffer.data(), buffer.size());
+
+        key.image_size = image_size;
+        key.image_mtime = image_mtime;
+        key.metadata_hash = hash;
+
+        return true;
+    }
+
+    bool MetadataIndex::build(Image &img, const IndexKey &key) {
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        std::vector<IndexEntry> built_entries;
+        std::vector<IndexExtent> built_extents;
+        std::u16string pool;
+
+        // Clusters of directories already listed, a corrupt tree could loop otherwise
+        std::set<ClusterID> visited;
+
+        IndexEntry root;
+        std::memset(&root, 0, sizeof(IndexEntry));
+        root.parent = INDEX_NONE;
+        root.file_attributes = static_cast<std::uint8_t>(EntryAttribute::DIRECTORY);
+
+        built_entries.push_back(root);
+
+        struct Child {
+            std::u16string name;
+            IndexEntry entry;
+            std::vector<Extent> runs;
+        };
+
+        std::vector<Child> children;
+
+        // Breadth first, so each directory's children can be appended as one block
+        for (std::uint32_t index = 0; index < built_entries.size(); index++) {
+            if ((built_entries[index].file_attributes & (int)EntryAttribute::DIRECTORY) == 0) {
+                continue;
+            }
+
+            Entry cursor;
+
+            if (index != 0) {
+                Entry parent;
+                parent.entry.file_attributes = built_entries[index].file_attributes;
+                parent.entry.starting_cluster = built_entries[index].starting_cluster;
+
+                if (parent.entry.starting_cluster < CLUSTER_FIRST_VALID || !visited.insert(parent.entry.starting_cluster).second
+                    || !img.get_first_entry_dir(parent, cursor)) {
+                    continue;
+                }
+            }
+
+            children.clear();
+
+            while (img.get_next_entry(cursor)) {
+                const EntryType type = cursor.entry.get_entry_type_from_filename();
+
+                if (type == EntryType::UNUSED) {
+                    break;
+                }
+
+                if (type != EntryType::FILE || (cursor.entry.file_attributes & (int)EntryAttribute::SPECIAL)) {
+                    continue;
+                }
+
+                Child child;
+                child.name = cursor.get_filename();
+
+                std::memset(&child.entry, 0, sizeof(IndexEntry));
+                child.entry.parent = index;
+                child.entry.name_length = static_cast<std::uint16_t>(child.name.length());
+                child.entry.file_attributes = cursor.entry.file_attributes;
+                child.entry.file_size = cursor.entry.file_size;
+                child.entry.starting_cluster = cursor.entry.starting_cluster;
+                child.entry.last_modified_date = cursor.entry.last_modified_date;
+                child.entry.last_modified_time = cursor.entry.last_modified_time;
+                child.entry.record_offset = img.get_entry_offset(cursor);
+
+                if (cursor.entry.starting_cluster != 0) {
+                    // A broken chain still gets the runs found before the break
+                    img.get_extents(cursor.entry.starting_cluster, child.runs);
+                }
+
+                children.push_back(std::move(child));
+            }
+
+            std::sort(children.begin(), children.end(), [](const Child &lhs, const Child &rhs) {
+                return compare_folded(lhs.name.data(), lhs.name.length(), rhs.name.data(), rhs.name.length()) < 0;
+            });
+
+            built_entries[index].first_child = static_cast<std::uint32_t>(built_entries.size());
+            built_entries[index].child_count = static_cast<std::uint32_t>(children.size());
+
+            for (Child &child : children) {
+                child.entry.name_offset = static_cast<std::uint32_t>(pool.length());
+                child.entry.first_extent = static_cast<std::uint32_t>(built_extents.size());
+                child.entry.extent_count = static_cast<std::uint32_t>(child.runs.size());
+
+                pool += child.name;
+
+                for (const Extent &run : child.runs) {
+                    built_extents.push_back({ run.first, run.count });
+                }
+
+                built_entries.push_back(child.entry);
+            }
+        }
+
+        IndexHeader built_header;
+        std::memcpy(built_header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        built_header.version = INDEX_VERSION;
+        built_header.entry_count = static_cast<std::uint32_t>(built_entries.size());
+        built_header.extent_count = static_cast<std::uint32_t>(built_extents.size());
+        built_header.name_length = static_cast<std::uint32_t>(pool.length());
+        built_header.key = key;
+
+        release();
+
+        owned.resize(sizeof(IndexHeader) + built_entries.size() * sizeof(IndexEntry)
+            + built_extents.size() * sizeof(IndexExtent) + pool.length() * sizeof(char16_t));
+
+        std::uint8_t *cursor = owned.data();
+
+        std::memcpy(cursor, &built_header, sizeof(IndexHeader));
+        cursor += sizeof(IndexHeader);
+
+        std::memcpy(cursor, built_entries.data(), built_entries.size() * sizeof(IndexEntry));
+        cursor += built_entries.size() * sizeof(IndexEntry);
+
+        if (!built_extents.empty()) {
+            std::memcpy(cursor, built_extents.data(), built_extents.size() * sizeof(IndexExtent));
+            cursor += built_extents.size() * sizeof(IndexExtent);
+        }
+
+        if (!pool.empty()) {
+            std::memcpy(cursor, pool.data(), pool.length() * sizeof(char16_t));
+        }
+
+        if (!attach(owned.data(), owned.size())) {
+            release();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool MetadataIndex::save(const std::string &path) const {
+        if (!header) {
+            return false;
+        }
+
+        const std::size_t size = sizeof(IndexHeader) + header->entry_count * sizeof(IndexEntry)
+            + header->extent_count * sizeof(IndexExtent) + header->name_length * sizeof(char16_t);
+
+        // Write aside then rename, so a reader never maps a half written index
+        const std::string temp_path = path + ".tmp";
+        FILE *f = std::fopen(temp_path.c_str(), "wb");
+
+        if (!f) {
+            return false;
+        }
+
+        const bool written = (std::fwrite(header, 1, size, f) == size);
+
+        if (std::fclose(f) != 0 || !written) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    bool MetadataIndex::load(const std::string &path, const IndexKey &expected_key) {
+        release();
+
+#if defined(FAT16_HAS_MMAP)
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat info;
+
+        if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(IndexHeader))) {
+            close(fd);
+            return false;
+        }
+
+        void *mapped = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+
+        mapping = mapped;
+        mapping_size = static_cast<std::size_t>(info.st_size);
+
+        const bool attached = attach(static_cast<const std::uint8_t*>(mapping), mapping_size);
+#else
+        FILE *f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+
+        std::fseek(f, 0, SEEK_END);
+        owned.resize(static_cast<std::size_t>(std::ftell(f)));
+        std::fseek(f, 0, SEEK_SET);
+
+        const bool attached = (std::fread(owned.data(), 1, owned.size(), f) == owned.size())
+            && attach(owned.data(), owned.size());
+
+        std::fclose(f);
+#endif
+
+        if (!attached || header->key.image_size != expected_key.image_size || header->key.image_mtime != expected_key.image_mtime
+            || header->key.metadata_hash != expected_key.metadata_hash) {
+            release();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool MetadataIndex::open_or_build(Image &img, const std::string &path, const IndexKey &key) {
+        if (load(path, key)) {
+            return true;
+        }
+
+        if (!build(img, key)) {
+            return false;
+        }
+
+        // Not being able to save only costs the next open a rebuild
+        save(path);
+        return true;
+    }
+
+    std::u16string MetadataIndex::get_name(const std::uint32_t index) const {
+        return std::u16string(names + entries[index].name_offset, entries[index].name_length);
+    }
+
+    std::uint32_t MetadataIndex::find_child(const std::uint32_t directory, const char16_t *name, const std::size_t name_length) const {
+        const IndexEntry &dir = entries[directory];
+
+        std::uint32_t low = dir.first_child;
+        std::uint32_t high = dir.first_child + dir.child_count;
+
+        while (low < high) {
+            const std::uint32_t middle = low + (high - low) / 2;
+            const int order = compare_folded(names + entries[middle].name_offset, entries[middle].name_length, name, name_length);
+
+            if (order == 0) {
+                return middle;
+            }
+
+            if (order < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        return INDEX_NONE;
+    }
+
+    std::uint32_t MetadataIndex::find(const std::u16string &path) const {
+        if (!header) {
+            return INDEX_NONE;
+        }
+
+        std::uint32_t current = 0;
+        std::size_t start = 0;
+
+        while (start < path.length()) {
+            std::size_t end = path.find(u'/', start);
+            if (end == std::u16string::npos) {
+                end = path.length();
+            }
+
+            if (end != start) {
+                if ((entries[current].file_attributes & (int)EntryAttribute::DIRECTORY) == 0) {
+                    return INDEX_NONE;
+                }
+
+                current = find_child(current, path.data() + start, end - start);
+
+                if (current == INDEX_NONE) {
+                    return INDEX_NONE;
+                }
+            }
+
+            start = end + 1;
+        }
+
+        return current;
+    }
+
+    const IndexExtent *MetadataIndex::get_extents(const std::uint32_t index, std::uint32_t &count) const {
+        count = entries[index].extent_count;
+        return extents + entries[index].first_extent;
+    }
+}
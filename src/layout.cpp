@@ -0,0 +1,161 @@
+#include <fat16/layout.h>
+#include <fat16/walker.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace Fat16 {
+    namespace {
+        struct LayoutState {
+            const std::vector<ClusterID> &fat;
+            const std::uint32_t cluster_limit;
+
+            std::unique_ptr<std::atomic<std::uint8_t>[]> usage;     ///< ClusterUsage, set by the first chain through the cluster.
+
+            std::mutex chains_lock;
+            LayoutReport &report;
+
+            explicit LayoutState(const std::vector<ClusterID> &fat, const std::uint32_t cluster_limit, LayoutReport &report)
+                : fat(fat)
+                , cluster_limit(cluster_limit)
+                , usage(new std::atomic<std::uint8_t>[cluster_limit]())
+                , report(report) {
+            }
+
+            bool is_in_range(const ClusterID cluster) const {
+                return cluster >= CLUSTER_FIRST_VALID && cluster < cluster_limit;
+            }
+        };
+    }
+
+    static WalkAction measure_entry(void *userdata, const EntryView &view, const std::uint32_t worker) {
+        (void)worker;
+
+        LayoutState &state = *static_cast<LayoutState*>(userdata);
+        const bool is_directory = view.is_directory();
+        const std::uint8_t usage = static_cast<std::uint8_t>(is_directory ? ClusterUsage::DIRECTORY : ClusterUsage::FILE);
+
+        ChainLayout layout;
+        layout.first = view.entry->starting_cluster;
+        layout.clusters = 0;
+        layout.extents = 0;
+        layout.span = 0;
+
+        ClusterID current = layout.first;
+        ClusterID previous = CLUSTER_FREE;
+        ClusterID lowest = current;
+        ClusterID highest = current;
+
+        // A cluster some chain went through already ends this one, which also bounds loops
+        while (state.is_in_range(current)) {
+            std::uint8_t expected = static_cast<std::uint8_t>(ClusterUsage::FREE);
+
+            if (!state.usage[current].compare_exchange_strong(expected, usage)) {
+                break;
+            }
+
+            if (layout.clusters == 0 || current != previous + 1) {
+                layout.extents++;
+            }
+
+            layout.clusters++;
+            lowest = std::min(lowest, current);
+            highest = std::max(highest, current);
+
+            previous = current;
+            current = state.fat[current];
+        }
+
+        if (layout.clusters == 0) {
+            return WalkAction::CONTINUE;
+        }
+
+        layout.span = highest - lowest + 1u;
+        layout.path = view.parent->to_string();
+
+        if (!layout.path.empty()) {
+            layout.path += u'/';
+        }
+
+        layout.path += view.get_filename();
+
+        std::lock_guard<std::mutex> guard(state.chains_lock);
+        (is_directory ? state.report.directories : state.report.files).push_back(std::move(layout));
+
+        return WalkAction::CONTINUE;
+    }
+
+    static void summarize(std::vector<ChainLayout> &chains, LayoutStats &stats) {
+        std::sort(chains.begin(), chains.end(), [](const ChainLayout &a, const ChainLayout &b) {
+            return a.path < b.path;
+        });
+
+        for (const ChainLayout &chain : chains) {
+            stats.chains++;
+            stats.extents += chain.extents;
+            stats.clusters += chain.clusters;
+            stats.max_extents = std::max(stats.max_extents, chain.extents);
+
+            if (chain.extents > 1) {
+                stats.fragmented++;
+            }
+        }
+    }
+
+    bool analyze_layout(Image &img, LayoutReport &report, const LayoutOptions &options) {
+        report = LayoutReport();
+
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        const std::vector<ClusterID> &fat = img.fat_cache;
+        const std::uint32_t cluster_limit = img.cluster_limit();
+
+        LayoutState state(fat, cluster_limit, report);
+
+        WalkOptions walk_options;
+        walk_options.threads = options.threads;
+
+        const bool walked = walk(img, measure_entry, &state, walk_options);
+
+        summarize(report.files, report.file_stats);
+        summarize(report.directories, report.directory_stats);
+
+        // One pass over the FAT for whatever no chain reached
+        report.usage.resize(cluster_limit, ClusterUsage::RESERVED);
+
+        std::uint32_t free_run = 0;
+
+        for (std::uint32_t cluster = CLUSTER_FIRST_VALID; cluster < cluster_limit; cluster++) {
+            ClusterUsage usage = static_cast<ClusterUsage>(state.usage[cluster].load(std::memory_order_relaxed));
+
+            if (usage == ClusterUsage::FREE) {
+                if (fat[cluster] == CLUSTER_BAD) {
+                    usage = ClusterUsage::BAD;
+                    report.bad_clusters++;
+                } else if (fat[cluster] != CLUSTER_FREE) {
+                    usage = ClusterUsage::LOST;
+                    report.lost_clusters++;
+                }
+            }
+
+            report.usage[cluster] = usage;
+
+            if (usage == ClusterUsage::FREE) {
+                if (free_run++ == 0) {
+                    report.free_runs++;
+                }
+
+                report.free_clusters++;
+                report.largest_free_run = std::max(report.largest_free_run, free_run);
+            } else {
+                free_run = 0;
+            }
+        }
+
+        return walked;
+    }
+}
@@ -0,0 +1,57 @@
+#include <fat16/directory.h>
+#include <fat16/listing.h>
+
+namespace Fat16 {
+    void DirectoryListing::clear() {
+        file_sizes.clear();
+        file_attributes.clear();
+        starting_clusters.clear();
+        last_modified_dates.clear();
+        last_modified_times.clear();
+        record_offsets.clear();
+        name_offsets.clear();
+        names.clear();
+    }
+
+    bool list_directory(Image &img, const ClusterID directory, DirectoryListing &listing) {
+        listing.clear();
+
+        DirectoryBuffer buffer;
+
+        if (!buffer.read(img, directory)) {
+            return false;
+        }
+
+        // Most slots of a directory are in use, size the columns for all of them
+        const std::uint32_t capacity = buffer.slot_count();
+
+        listing.file_sizes.reserve(capacity);
+        listing.file_attributes.reserve(capacity);
+        listing.starting_clusters.reserve(capacity);
+        listing.last_modified_dates.reserve(capacity);
+        listing.last_modified_times.reserve(capacity);
+        listing.record_offsets.reserve(capacity);
+        listing.name_offsets.reserve(capacity + 1);
+
+        std::uint32_t slot = 0;
+        DirectoryRecord record;
+
+        while (buffer.next_record(slot, record)) {
+            const FundamentalEntry &entry = *buffer.get_record(record.slot);
+
+            listing.file_sizes.push_back(entry.file_size);
+            listing.file_attributes.push_back(entry.file_attributes);
+            listing.starting_clusters.push_back(entry.starting_cluster);
+            listing.last_modified_dates.push_back(entry.last_modified_date);
+            listing.last_modified_times.push_back(entry.last_modified_time);
+            listing.record_offsets.push_back(buffer.get_slot_offset(img, record.slot));
+            listing.name_offsets.push_back(static_cast<std::uint32_t>(listing.names.length()));
+
+            append_filename(entry, buffer.get_long_name(record), record.long_name_count, listing.names);
+        }
+
+        listing.name_offsets.push_back(static_cast<std::uint32_t>(listing.names.length()));
+
+        return true;
+    }
+}
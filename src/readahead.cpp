@@ -0,0 +1,267 @@
+#include <fat16/readahead.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace Fat16 {
+    FileReader::FileReader(Image &img, const FundamentalEntry &entry, const ReadaheadOptions &options)
+        : img(img)
+        , options(options)
+        , file_size(entry.file_size)
+        , valid(false)
+        , expected_offset(0)
+        , window(options.initial_window)
+        , streak(0)
+        , request_pending(false)
+        , request_taken(false)
+        , generation(0)
+        , request_offset(0)
+        , request_size(0)
+        , prefetched_until(0)
+        , stopping(false) {
+        std::memset(&stats, 0, sizeof(ReadaheadStats));
+
+        // Resolve the chain once, every read is a plain offset lookup after this
+        if (img.get_extents(entry.starting_cluster, extents)) {
+            std::uint64_t total = 0;
+
+            for (const Extent &extent : extents) {
+                extent_file_offsets.push_back(total);
+                total += static_cast<std::uint64_t>(extent.count) * img.bytes_per_cluster();
+            }
+
+            valid = (total >= file_size);
+        }
+
+        // Concurrent reads need a positional hook, or the worker would move the caller's cursor
+        if (valid && options.background && img.read_at_func) {
+            worker = std::thread(&FileReader::work, this);
+        }
+    }
+
+    FileReader::~FileReader() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+
+            cond.notify_all();
+            worker.join();
+        }
+    }
+
+    bool FileReader::is_valid() const {
+        return valid;
+    }
+
+    std::uint32_t FileReader::read_direct(std::uint8_t *dest, std::uint32_t offset, std::uint32_t size) {
+        if (!valid || offset >= file_size) {
+            return 0;
+        }
+
+        size = std::min(size, file_size - offset);
+
+        const std::uint64_t cluster_size = img.bytes_per_cluster();
+        std::size_t index = std::upper_bound(extent_file_offsets.begin(), extent_file_offsets.end(),
+            static_cast<std::uint64_t>(offset)) - extent_file_offsets.begin() - 1;
+
+        std::uint32_t size_read = 0;
+
+        while (size_read != size && index < extents.size()) {
+            const std::uint64_t offset_in_extent = offset + size_read - extent_file_offsets[index];
+            const std::uint32_t size_to_take = static_cast<std::uint32_t>(std::min<std::uint64_t>(size - size_read,
+                extents[index].count * cluster_size - offset_in_extent));
+
+            const std::uint32_t bytes_read = img.read_at(static_cast<std::uint32_t>(img.cluster_offset(extents[index].first)
+                + offset_in_extent), dest + size_read, size_to_take);
+
+            size_read += bytes_read;
+
+            if (bytes_read != size_to_take) {
+                break;
+            }
+
+            index++;
+        }
+
+        return size_read;
+    }
+
+    std::uint32_t FileReader::take_from_ready(std::uint8_t *dest, std::uint32_t offset, std::uint32_t size) {
+        std::uint32_t served = 0;
+
+        while (!ready.empty() && served != size) {
+            const Segment &segment = ready.front();
+            const std::uint32_t segment_end = segment.offset + static_cast<std::uint32_t>(segment.data.size());
+            const std::uint32_t position = offset + served;
+
+            if (segment_end <= position) {
+                // Consumed already
+                ready.pop_front();
+                continue;
+            }
+
+            if (segment.offset > position) {
+                break;
+            }
+
+            const std::uint32_t size_to_take = std::min(segment_end - position, size - served);
+            std::memcpy(dest + served, segment.data.data() + (position - segment.offset), size_to_take);
+
+            served += size_to_take;
+        }
+
+        return served;
+    }
+
+    void FileReader::schedule(std::unique_lock<std::mutex> &guard) {
+        // Only there to show the lock is held
+        (void)guard;
+
+        if (request_pending || !worker.joinable() || prefetched_until >= file_size) {
+            return;
+        }
+
+        // Keep one window ahead of the reader
+        const std::uint32_t start = std::max(prefetched_until, expected_offset);
+
+        if (start >= file_size || start - expected_offset >= window) {
+            return;
+        }
+
+        request_offset = start;
+        request_size = std::min(window, file_size - start);
+        request_pending = true;
+        prefetched_until = request_offset + request_size;
+        stats.prefetches++;
+
+        cond.notify_all();
+    }
+
+    void FileReader::work() {
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+            cond.wait(guard, [&]() {
+                return stopping || (request_pending && !request_taken);
+            });
+
+            if (stopping) {
+                break;
+            }
+
+            request_taken = true;
+
+            const std::uint32_t taken_generation = generation;
+            Segment segment;
+            segment.offset = request_offset;
+            segment.data.resize(request_size);
+
+            guard.unlock();
+            segment.data.resize(read_direct(segment.data.data(), segment.offset, request_size));
+            guard.lock();
+
+            if (taken_generation == generation) {
+                stats.bytes_prefetched += segment.data.size();
+                ready.push_back(std::move(segment));
+            }
+
+            request_pending = false;
+            request_taken = false;
+
+            cond.notify_all();
+        }
+    }
+
+    std::uint32_t FileReader::read(std::uint8_t *dest_buffer, const std::uint32_t offset, const std::uint32_t size) {
+        if (!valid || offset >= file_size) {
+            return 0;
+        }
+
+        const std::uint32_t size_to_read = std::min(size, file_size - offset);
+        std::unique_lock<std::mutex> guard(lock);
+
+        stats.reads++;
+        stats.bytes_requested += size_to_read;
+
+        const bool sequential = (offset == expected_offset);
+
+        if (sequential) {
+            if (streak++ != 0) {
+                window = std::min(window * 2, options.max_window);
+            }
+        } else {
+            // Random access: whatever was read ahead is useless now
+            ready.clear();
+            generation++;
+            streak = 0;
+            window = options.initial_window;
+            prefetched_until = offset;
+        }
+
+        std::uint32_t served = take_from_ready(dest_buffer, offset, size_to_read);
+
+        // The window we need may still be on its way
+        while (served != size_to_read && request_pending && request_offset <= offset + served
+            && offset + served < request_offset + request_size) {
+            stats.waits++;
+
+            cond.wait(guard, [&]() {
+                return !request_pending;
+            });
+
+            served += take_from_ready(dest_buffer + served, offset + served, size_to_read - served);
+        }
+
+        stats.bytes_from_prefetch += served;
+
+        if (served != size_to_read) {
+            const std::uint32_t position = offset + served;
+            const std::uint32_t size_left = size_to_read - served;
+
+            if (sequential && !worker.joinable()) {
+                // No worker: grab the next window along with this read, one larger request
+                Segment segment;
+                segment.offset = position;
+                segment.data.resize(std::min<std::uint64_t>(static_cast<std::uint64_t>(size_left) + window, file_size - position));
+
+                guard.unlock();
+                segment.data.resize(read_direct(segment.data.data(), position, static_cast<std::uint32_t>(segment.data.size())));
+                guard.lock();
+
+                const std::uint32_t usable = std::min<std::uint32_t>(size_left, static_cast<std::uint32_t>(segment.data.size()));
+                std::memcpy(dest_buffer + served, segment.data.data(), usable);
+                served += usable;
+
+                if (segment.data.size() > usable) {
+                    stats.prefetches++;
+                    stats.bytes_prefetched += segment.data.size() - usable;
+
+                    prefetched_until = position + static_cast<std::uint32_t>(segment.data.size());
+                    ready.push_back(std::move(segment));
+                }
+            } else {
+                guard.unlock();
+                const std::uint32_t bytes_read = read_direct(dest_buffer + served, position, size_left);
+                guard.lock();
+
+                served += bytes_read;
+            }
+        }
+
+        expected_offset = offset + served;
+        prefetched_until = std::max(prefetched_until, expected_offset);
+
+        if (streak != 0) {
+            schedule(guard);
+        }
+
+        return served;
+    }
+
+    ReadaheadStats FileReader::get_stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        return stats;
+    }
+}
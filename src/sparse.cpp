@@ -0,0 +1,395 @@
+#include <fat16/sparse.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FAT16_HAS_POSIX_FD 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Fat16 {
+    // Smallest piece a write is split in to look for zeros. Filesystems allocate at least this much.
+    static constexpr std::uint32_t HOLE_GRANULE = 4096;
+
+    static bool is_zero(const std::uint8_t *data, const std::uint32_t bytes) {
+        static const std::uint8_t zeros[HOLE_GRANULE] = {};
+        return std::memcmp(data, zeros, bytes) == 0;
+    }
+
+    SparseFile::SparseFile()
+        : fd(-1)
+        , writable(false)
+        , cursor(0)
+        , size(0) {
+    }
+
+    SparseFile::~SparseFile() {
+        close();
+    }
+
+    bool SparseFile::open(const char *path, const bool writable) {
+        close();
+
+#if defined(FAT16_HAS_POSIX_FD)
+        fd = ::open(path, writable ? O_RDWR : O_RDONLY);
+
+        struct stat info;
+
+        if (fd < 0 || fstat(fd, &info) != 0 || static_cast<std::uint64_t>(info.st_size) > 0xFFFFFFFFu) {
+            close();
+            return false;
+        }
+
+        this->writable = writable;
+        size = static_cast<std::uint32_t>(info.st_size);
+        map_regions();
+
+        return true;
+#else
+        (void)path;
+        (void)writable;
+        return false;
+#endif
+    }
+
+    void SparseFile::close() {
+#if defined(FAT16_HAS_POSIX_FD)
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+
+        fd = -1;
+        writable = false;
+        cursor = 0;
+        size = 0;
+        data_regions.clear();
+    }
+
+    void SparseFile::map_regions() {
+        data_regions.clear();
+
+#if defined(FAT16_HAS_POSIX_FD) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+        off_t position = 0;
+
+        while (position < static_cast<off_t>(size)) {
+            const off_t data_start = lseek(fd, position, SEEK_DATA);
+
+            if (data_start < 0) {
+                if (errno == ENXIO) {
+                    // Nothing but a hole up to the end
+                    return;
+                }
+
+                break;
+            }
+
+            const off_t data_end = lseek(fd, data_start, SEEK_HOLE);
+
+            if (data_end < 0) {
+                break;
+            }
+
+            add_data(static_cast<std::uint32_t>(data_start), static_cast<std::uint32_t>(std::min<off_t>(data_end, size)));
+            position = data_end;
+        }
+
+        if (position >= static_cast<off_t>(size)) {
+            return;
+        }
+#endif
+
+        // The filesystem can't tell, so everything is taken as data
+        data_regions.clear();
+
+        if (size != 0) {
+            data_regions[0] = size;
+        }
+    }
+
+    void SparseFile::add_data(std::uint32_t start, std::uint32_t end) {
+        auto region = data_regions.upper_bound(start);
+
+        // Merge with the regions it overlaps or touches
+        if (region != data_regions.begin() && std::prev(region)->second >= start) {
+            region = std::prev(region);
+            start = region->first;
+        }
+
+        while (region != data_regions.end() && region->first <= end) {
+            end = std::max(end, region->second);
+            region = data_regions.erase(region);
+        }
+
+        data_regions[start] = end;
+    }
+
+    void SparseFile::remove_data(const std::uint32_t start, const std::uint32_t end) {
+        auto region = data_regions.upper_bound(start);
+
+        if (region != data_regions.begin()) {
+            region = std::prev(region);
+        }
+
+        while (region != data_regions.end() && region->first < end) {
+            if (region->second <= start) {
+                region++;
+                continue;
+            }
+
+            const std::uint32_t region_start = region->first;
+            const std::uint32_t region_end = region->second;
+
+            region = data_regions.erase(region);
+
+            if (region_start < start) {
+                data_regions[region_start] = start;
+            }
+
+            if (region_end > end) {
+                data_regions[end] = region_end;
+                break;
+            }
+        }
+    }
+
+    void SparseFile::attach(Image &img) {
+        img.read_at_func = read_at_hook;
+        img.truncate_func = writable ? truncate_hook : nullptr;
+        img.discard_func = writable ? discard_hook : nullptr;
+    }
+
+    bool SparseFile::is_hole(const std::uint32_t offset, const std::uint32_t bytes) const {
+        auto region = data_regions.upper_bound(offset);
+
+        if (region != data_regions.begin() && std::prev(region)->second > offset) {
+            return false;
+        }
+
+        return region == data_regions.end() || region->first >= offset + bytes;
+    }
+
+    std::uint64_t SparseFile::data_bytes() const {
+        std::uint64_t total = 0;
+
+        for (const auto &region : data_regions) {
+            total += region.second - region.first;
+        }
+
+        return total;
+    }
+
+    std::uint32_t SparseFile::read(void *dest, const std::uint32_t offset, const std::uint32_t bytes) {
+        if (offset >= size) {
+            return 0;
+        }
+
+        const std::uint32_t end = offset + std::min(bytes, size - offset);
+        std::uint8_t *output = static_cast<std::uint8_t*>(dest);
+
+        auto region = data_regions.upper_bound(offset);
+
+        if (region != data_regions.begin() && std::prev(region)->second > offset) {
+            region = std::prev(region);
+        }
+
+        std::uint32_t position = offset;
+
+        while (position < end) {
+            // Holes are zero filled, only data goes to the file
+            const std::uint32_t hole_end = (region == data_regions.end()) ? end : std::min(end, std::max(position, region->first));
+
+            if (hole_end > position) {
+                std::memset(output + (position - offset), 0, hole_end - position);
+                position = hole_end;
+                continue;
+            }
+
+            const std::uint32_t data_end = std::min(end, region->second);
+
+#if defined(FAT16_HAS_POSIX_FD)
+            while (position < data_end) {
+                const ssize_t bytes_read = pread(fd, output + (position - offset), data_end - position, position);
+
+                if (bytes_read < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (bytes_read <= 0) {
+                    return position - offset;
+                }
+
+                position += static_cast<std::uint32_t>(bytes_read);
+            }
+#else
+            return position - offset;
+#endif
+
+            region++;
+        }
+
+        return end - offset;
+    }
+
+    bool SparseFile::write_run(std::uint32_t offset, const std::uint8_t *data, std::uint32_t bytes) {
+        const std::uint32_t start = offset;
+
+#if defined(FAT16_HAS_POSIX_FD)
+        while (bytes != 0) {
+            const ssize_t written = pwrite(fd, data, bytes, offset);
+
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (written <= 0) {
+                return false;
+            }
+
+            data += written;
+            offset += static_cast<std::uint32_t>(written);
+            bytes -= static_cast<std::uint32_t>(written);
+        }
+#else
+        if (bytes != 0) {
+            return false;
+        }
+#endif
+
+        add_data(start, offset);
+        return true;
+    }
+
+    std::uint32_t SparseFile::write(const void *data, const std::uint32_t offset, const std::uint32_t bytes) {
+        if (!writable || bytes == 0) {
+            return 0;
+        }
+
+        const std::uint8_t *source = static_cast<const std::uint8_t*>(data);
+        const std::uint32_t end = offset + bytes;
+
+        std::uint32_t run_start = offset;
+        std::uint32_t position = offset;
+
+        while (position < end) {
+            const std::uint32_t piece_end = std::min(end, (position / HOLE_GRANULE + 1) * HOLE_GRANULE);
+
+            // Zeros over a hole are what's there already
+            if (is_zero(source + (position - offset), piece_end - position) && is_hole(position, piece_end - position)) {
+                if (run_start != position && !write_run(run_start, source + (run_start - offset), position - run_start)) {
+                    return 0;
+                }
+
+                run_start = piece_end;
+            }
+
+            position = piece_end;
+        }
+
+        if (run_start != end && !write_run(run_start, source + (run_start - offset), end - run_start)) {
+            return 0;
+        }
+
+        // Zeros left out at the end still make the file longer
+        if (end > size) {
+#if defined(FAT16_HAS_POSIX_FD)
+            if (run_start == end && ftruncate(fd, end) != 0) {
+                return 0;
+            }
+#endif
+
+            size = end;
+        }
+
+        return bytes;
+    }
+
+    bool SparseFile::truncate(const std::uint32_t new_size) {
+#if defined(FAT16_HAS_POSIX_FD)
+        if (!writable || ftruncate(fd, new_size) != 0) {
+            return false;
+        }
+
+        if (new_size < size) {
+            remove_data(new_size, size);
+        }
+
+        size = new_size;
+        return true;
+#else
+        (void)new_size;
+        return false;
+#endif
+    }
+
+    bool SparseFile::discard(const std::uint32_t offset, const std::uint32_t bytes) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (!writable || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, bytes) != 0) {
+            return false;
+        }
+
+        remove_data(offset, offset + bytes);
+        return true;
+#else
+        (void)offset;
+        (void)bytes;
+        return false;
+#endif
+    }
+
+    std::uint32_t SparseFile::read_hook(void *userdata, void *buffer, std::uint32_t bytes) {
+        SparseFile &file = *static_cast<SparseFile*>(userdata);
+        const std::uint32_t bytes_read = file.read(buffer, file.cursor, bytes);
+
+        file.cursor += bytes_read;
+        return bytes_read;
+    }
+
+    std::uint32_t SparseFile::seek_hook(void *userdata, std::uint32_t offset, int mode) {
+        SparseFile &file = *static_cast<SparseFile*>(userdata);
+
+        switch (mode) {
+        case IMAGE_SEEK_MODE_BEG:
+            file.cursor = offset;
+            break;
+
+        case IMAGE_SEEK_MODE_CUR:
+            file.cursor += offset;
+            break;
+
+        case IMAGE_SEEK_MODE_END:
+            file.cursor = file.size + offset;
+            break;
+
+        default:
+            break;
+        }
+
+        return file.cursor;
+    }
+
+    std::uint32_t SparseFile::write_hook(void *userdata, const void *buffer, std::uint32_t bytes) {
+        SparseFile &file = *static_cast<SparseFile*>(userdata);
+        const std::uint32_t written = file.write(buffer, file.cursor, bytes);
+
+        file.cursor += written;
+        return written;
+    }
+
+    std::uint32_t SparseFile::read_at_hook(void *userdata, void *buffer, std::uint32_t offset, std::uint32_t bytes) {
+        return static_cast<SparseFile*>(userdata)->read(buffer, offset, bytes);
+    }
+
+    bool SparseFile::truncate_hook(void *userdata, std::uint32_t size) {
+        return static_cast<SparseFile*>(userdata)->truncate(size);
+    }
+
+    bool SparseFile::discard_hook(void *userdata, std::uint32_t offset, std::uint32_t bytes) {
+        return static_cast<SparseFile*>(userdata)->discard(offset, bytes);
+    }
+}
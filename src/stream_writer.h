@@ -0,0 +1,93 @@
+#pragma once
+
+#include <fat16/fat16.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace Fat16 {
+    /**
+     * \brief Collect writes into large chunks before handing them to a write callback.
+     *
+     * Callers may also fill staging past used themselves, then move used forward and flush()
+     * once it is full. The first failed write is remembered in failed, nothing is written after.
+     */
+    struct StreamWriter {
+        void *userdata;
+        ImageWriteFunc write_func;
+        std::vector<std::uint8_t> staging;
+        std::size_t used;
+        std::uint64_t total_written;                ///< Bytes handed to the callback so far.
+        bool failed;
+
+        explicit StreamWriter(void *userdata, ImageWriteFunc write_func, const std::size_t buffer_size)
+            : userdata(userdata)
+            , write_func(write_func)
+            , staging(buffer_size)
+            , used(0)
+            , total_written(0)
+            , failed(false) {
+        }
+
+        void flush() {
+            if (used != 0 && !failed) {
+                failed = (write_func(userdata, staging.data(), static_cast<std::uint32_t>(used)) != used);
+            }
+
+            total_written += used;
+            used = 0;
+        }
+
+        void put(const void *data, std::size_t size) {
+            const std::uint8_t *source = static_cast<const std::uint8_t*>(data);
+
+            // Big chunks skip the staging buffer entirely
+            if (size >= staging.size()) {
+                flush();
+
+                if (!failed) {
+                    failed = (write_func(userdata, source, static_cast<std::uint32_t>(size)) != size);
+                }
+
+                total_written += size;
+                return;
+            }
+
+            while (size != 0) {
+                const std::size_t size_to_take = std::min(size, staging.size() - used);
+                std::memcpy(staging.data() + used, source, size_to_take);
+
+                used += size_to_take;
+                source += size_to_take;
+                size -= size_to_take;
+
+                if (used == staging.size()) {
+                    flush();
+                }
+            }
+        }
+
+        void put_zeros(std::uint64_t size) {
+            while (size != 0) {
+                const std::size_t size_to_take = static_cast<std::size_t>(std::min<std::uint64_t>(size, staging.size() - used));
+                std::memset(staging.data() + used, 0, size_to_take);
+
+                used += size_to_take;
+                size -= size_to_take;
+
+                if (used == staging.size()) {
+                    flush();
+                }
+            }
+        }
+
+        /**
+         * \brief Get number of bytes put so far, written or still staged.
+         */
+        std::uint64_t position() const {
+            return total_written + used;
+        }
+    };
+}
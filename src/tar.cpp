@@ -0,0 +1,239 @@
+#include <fat16/tar.h>
+
+#include "stream_writer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace Fat16 {
+    static constexpr std::uint32_t TAR_BLOCK_SIZE = 512;
+    static constexpr std::uint32_t TAR_RECORD_SIZE = TAR_BLOCK_SIZE * 20;
+
+    #pragma pack(push, 1)
+    struct TarHeader {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char checksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[155];
+        char padding[12];
+    };
+    #pragma pack(pop)
+
+    static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "Tar header size doesn't match to what expected.");
+
+    static void put_octal(char *dest, const std::size_t field_size, const std::uint64_t value) {
+        // Right aligned, zero padded, NUL terminated
+        std::snprintf(dest, field_size, "%0*llo", static_cast<int>(field_size - 1), static_cast<unsigned long long>(value));
+    }
+
+    /**
+     * \brief Convert a FAT date and time to seconds since the Unix epoch.
+     */
+    static std::uint64_t fat_time_to_unix(const std::uint16_t date, const std::uint16_t time) {
+        std::int64_t year = 1980 + (date >> 9);
+        const std::uint32_t month = std::max(1, std::min(12, (date >> 5) & 0xF));
+        const std::uint32_t day = std::max(1, date & 0x1F);
+
+        // Days from civil, March based so leap days land at the end of the year
+        year -= (month <= 2) ? 1 : 0;
+
+        const std::int64_t era = year / 400;
+        const std::int64_t year_of_era = year - era * 400;
+        const std::int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        const std::int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+        const std::int64_t days = era * 146097 + day_of_era - 719468;
+
+        return static_cast<std::uint64_t>(days) * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+    }
+
+    namespace {
+    /**
+     * \brief Stream writer that also knows the tar block structure.
+     */
+    struct TarWriter : StreamWriter {
+        explicit TarWriter(void *userdata, ImageWriteFunc write_func, const std::uint32_t buffer_size)
+            : StreamWriter(userdata, write_func, std::max(buffer_size, TAR_RECORD_SIZE)) {
+        }
+
+        void pad_to_block() {
+            put_zeros((TAR_BLOCK_SIZE - position() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+        }
+
+        void put_header(const std::string &name, const char typeflag, const std::uint32_t mode, const std::uint64_t size,
+            const std::uint64_t mtime) {
+            TarHeader header;
+            std::memset(&header, 0, sizeof(TarHeader));
+
+            std::memcpy(header.name, name.data(), std::min(name.length(), sizeof(header.name)));
+            put_octal(header.mode, sizeof(header.mode), mode);
+            put_octal(header.uid, sizeof(header.uid), 0);
+            put_octal(header.gid, sizeof(header.gid), 0);
+            put_octal(header.size, sizeof(header.size), size);
+            put_octal(header.mtime, sizeof(header.mtime), mtime);
+            header.typeflag = typeflag;
+            std::memcpy(header.magic, "ustar", 6);
+            std::memcpy(header.version, "00", 2);
+
+            // The checksum is computed with its own field filled with spaces
+            std::memset(header.checksum, ' ', sizeof(header.checksum));
+
+            std::uint32_t checksum = 0;
+            const std::uint8_t *bytes = reinterpret_cast<const std::uint8_t*>(&header);
+
+            for (std::size_t i = 0; i < sizeof(TarHeader); i++) {
+                checksum += bytes[i];
+            }
+
+            std::snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+            header.checksum[7] = ' ';
+
+            put(&header, sizeof(TarHeader));
+        }
+
+        void put_member_header(const std::string &path, const char typeflag, const std::uint32_t mode, const std::uint64_t size,
+            const std::uint64_t mtime) {
+            const bool plain_ascii = std::all_of(path.begin(), path.end(), [](const char c) {
+                return static_cast<std::uint8_t>(c) < 0x80;
+            });
+
+            if (path.length() >= sizeof(TarHeader::name) || !plain_ascii) {
+                // "<length> path=<path>\n", where the length counts itself
+                const std::string record_body = " path=" + path + "\n";
+                std::size_t length = record_body.length() + 1;
+
+                while (std::to_string(length).length() + record_body.length() != length) {
+                    length = std::to_string(length).length() + record_body.length();
+                }
+
+                const std::string record = std::to_string(length) + record_body;
+
+                put_header("PaxHeaders/" + path.substr(0, 80), 'x', 0644, record.length(), mtime);
+                put(record.data(), record.length());
+                pad_to_block();
+            }
+
+            put_header(path, typeflag, mode, size, mtime);
+        }
+    };
+    }
+
+    static bool export_file(Image &img, TarWriter &out, Entry &entry) {
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+
+        ClusterID current_cluster = entry.entry.starting_cluster;
+        std::uint32_t size_left = entry.entry.file_size;
+
+        while (size_left != 0 && !out.failed) {
+            // Whole clusters only, so the next read can start from a cluster boundary
+            const std::uint32_t space = static_cast<std::uint32_t>(out.staging.size() - out.used);
+            const std::uint32_t size_to_take = (size_left <= space) ? size_left : (space / cluster_size) * cluster_size;
+
+            if (size_to_take == 0) {
+                out.flush();
+                continue;
+            }
+
+            if (img.read_from_cluster(out.staging.data() + out.used, 0, current_cluster, size_to_take) != size_to_take) {
+                return false;
+            }
+
+            out.used += size_to_take;
+            size_left -= size_to_take;
+
+            for (std::uint32_t i = 0; i < size_to_take / cluster_size && size_left != 0; i++) {
+                current_cluster = img.get_successor_cluster(current_cluster);
+            }
+        }
+
+        out.pad_to_block();
+        return !out.failed;
+    }
+
+    static bool export_directory(Image &img, TarWriter &out, Entry cursor, const std::string &prefix,
+        std::vector<bool> &visited, const TarExportOptions &options) {
+        while (img.get_next_entry(cursor)) {
+            const EntryType type = cursor.entry.get_entry_type_from_filename();
+
+            if (type == EntryType::UNUSED) {
+                // End of directory marker
+                break;
+            }
+
+            if (type != EntryType::FILE || (cursor.entry.file_attributes & (int)EntryAttribute::SPECIAL)) {
+                // Deleted, dot entries and volume labels
+                continue;
+            }
+
+            const std::string path = prefix + utf16_to_utf8(cursor.get_filename());
+            const std::uint64_t mtime = fat_time_to_unix(cursor.entry.last_modified_date, cursor.entry.last_modified_time);
+            const bool read_only = (cursor.entry.file_attributes & (int)EntryAttribute::READONLY) != 0;
+
+            if (cursor.entry.file_attributes & (int)EntryAttribute::DIRECTORY) {
+                if (options.include_directories) {
+                    out.put_member_header(path + "/", '5', read_only ? 0555 : 0755, 0, mtime);
+                }
+
+                const ClusterID cluster = cursor.entry.starting_cluster;
+
+                // A corrupt tree could point back at a directory above, go in each only once
+                if (cluster < CLUSTER_FIRST_VALID || cluster >= visited.size() || visited[cluster]) {
+                    continue;
+                }
+
+                visited[cluster] = true;
+
+                Entry child;
+                if (!img.get_first_entry_dir(cursor, child) || !export_directory(img, out, child, path + "/", visited, options)) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            out.put_member_header(path, '0', read_only ? 0444 : 0644, cursor.entry.file_size, mtime);
+
+            if (!export_file(img, out, cursor)) {
+                return false;
+            }
+        }
+
+        return !out.failed;
+    }
+
+    bool export_tar(Image &img, void *userdata, ImageWriteFunc write_func, const TarExportOptions &options) {
+        // Chains are followed a lot, keep them in memory
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        TarWriter out(userdata, write_func, std::max(options.buffer_size, img.bytes_per_cluster()));
+
+        std::vector<bool> visited(img.cluster_limit(), false);
+
+        if (!export_directory(img, out, Entry(), "", visited, options)) {
+            return false;
+        }
+
+        // End of archive is two empty blocks, then the last record is filled up
+        out.put_zeros(TAR_BLOCK_SIZE * 2);
+        out.put_zeros((TAR_RECORD_SIZE - out.position() % TAR_RECORD_SIZE) % TAR_RECORD_SIZE);
+        out.flush();
+
+        return !out.failed;
+    }
+}
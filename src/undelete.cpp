@@ -0,0 +1,375 @@
+#include <fat16/directory.h>
+#include <fat16/undelete.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace Fat16 {
+    static constexpr std::uint8_t DELETED_MARKER = 0xE5;
+    static constexpr std::uint32_t MAX_LONG_NAME_PARTS = 20;
+
+    namespace {
+        struct PendingDirectory {
+            std::u16string path;
+            ClusterID cluster;
+            bool deleted;                           ///< Only its first cluster is read, the chain is gone.
+        };
+
+        struct UndeleteState {
+            Image &img;
+            const std::vector<ClusterID> &fat;
+            const std::uint32_t cluster_limit;
+            const std::uint32_t cluster_size;
+
+            std::vector<bool> given;                ///< Free clusters already handed to a deleted file.
+            std::vector<bool> visited;              ///< Directories queued, a corrupt tree could loop.
+
+            explicit UndeleteState(Image &img, const std::uint32_t cluster_limit)
+                : img(img)
+                , fat(img.fat_cache)
+                , cluster_limit(cluster_limit)
+                , cluster_size(img.bytes_per_cluster())
+                , given(cluster_limit, false)
+                , visited(cluster_limit, false) {
+            }
+
+            bool is_in_range(const ClusterID cluster) const {
+                return cluster >= CLUSTER_FIRST_VALID && cluster < cluster_limit;
+            }
+        };
+    }
+
+    /**
+     * \brief Take free clusters from the first one on, skipping allocated ones, as many as needed.
+     */
+    static void guess_extents(UndeleteState &state, DeletedFile &file, const std::uint32_t clusters_needed) {
+        const ClusterID first = file.entry.starting_cluster;
+
+        file.extents.clear();
+
+        if (clusters_needed == 0) {
+            file.confidence = RecoveryConfidence::HIGH;
+            return;
+        }
+
+        if (!state.is_in_range(first) || state.fat[first] != CLUSTER_FREE) {
+            file.confidence = RecoveryConfidence::NONE;
+            return;
+        }
+
+        std::uint32_t taken = 0;
+        bool skipped = false;
+        bool reused = false;
+
+        for (std::uint32_t cluster = first; cluster < state.cluster_limit && taken < clusters_needed; cluster++) {
+            if (state.fat[cluster] != CLUSTER_FREE) {
+                skipped = true;
+                continue;
+            }
+
+            reused |= state.given[cluster];
+            state.given[cluster] = true;
+
+            if (!file.extents.empty() && file.extents.back().first + file.extents.back().count == cluster) {
+                file.extents.back().count++;
+            } else {
+                file.extents.push_back({ static_cast<ClusterID>(cluster), 1 });
+            }
+
+            taken++;
+        }
+
+        if (taken < clusters_needed || reused) {
+            file.confidence = RecoveryConfidence::LOW;
+        } else {
+            file.confidence = skipped ? RecoveryConfidence::MEDIUM : RecoveryConfidence::HIGH;
+        }
+    }
+
+    static bool is_valid_short_char(const char16_t c) {
+        if ((c >= u'A' && c <= u'Z') || (c >= u'0' && c <= u'9')) {
+            return true;
+        }
+
+        return c < 0x80 && c != 0 && std::strchr("$%'-_@~`!(){}^#&", static_cast<char>(c)) != nullptr;
+    }
+
+    /**
+     * \brief Get the first character a short name made from a long name would have. 0 if there is none.
+     *
+     * Leading dots and spaces are dropped, and a character an 8.3 name can't hold becomes '_'.
+     */
+    static char16_t short_name_first_character(const LongFileNameEntry &first_part) {
+        char16_t characters[13];
+        std::memcpy(characters, first_part.name_part_1, sizeof(first_part.name_part_1));
+        std::memcpy(characters + 5, first_part.name_part_2, sizeof(first_part.name_part_2));
+        std::memcpy(characters + 11, first_part.name_part_3, sizeof(first_part.name_part_3));
+
+        for (const char16_t c : characters) {
+            if (c == 0 || c == 0xFFFF) {
+                break;
+            }
+
+            if (c == u'.' || c == u' ') {
+                continue;
+            }
+
+            const char16_t folded = fold_case(c);
+            return is_valid_short_char(folded) ? folded : u'_';
+        }
+
+        return 0;
+    }
+
+    /**
+     * \brief Find how many of the deleted LFN slots before a deleted record were its name, and its first character.
+     *
+     * Deleting overwrites the first byte of the record and of every slot. The first character
+     * is taken from the long name, and the slots are only kept if the checksum agrees with it:
+     * any character would make most checksums agree.
+     */
+    static std::uint32_t match_deleted_long_name(const LongFileNameEntry *slots, const std::uint32_t count,
+        FundamentalEntry &entry) {
+        if (count == 0) {
+            return 0;
+        }
+
+        // Slots of an older name may come first, keep the ones that agree with the last
+        const std::uint8_t checksum = slots[count - 1].checksum;
+        std::uint32_t matched = 0;
+
+        while (matched < count && matched < MAX_LONG_NAME_PARTS && slots[count - 1 - matched].checksum == checksum) {
+            matched++;
+        }
+
+        const char16_t first_character = short_name_first_character(slots[count - 1]);
+
+        if (first_character == 0) {
+            return 0;
+        }
+
+        char short_name[11];
+        std::memcpy(short_name, entry.filename, sizeof(entry.filename));
+        std::memcpy(short_name + sizeof(entry.filename), entry.filename_ext, sizeof(entry.filename_ext));
+        short_name[0] = static_cast<char>(first_character);
+
+        if (short_name_checksum(short_name) != checksum) {
+            return 0;
+        }
+
+        entry.filename[0] = static_cast<std::uint8_t>(first_character);
+        return matched;
+    }
+
+    /**
+     * \brief Check that a cluster starts with a "." entry, as every directory but the root does.
+     */
+    static bool looks_like_directory(const DirectoryBuffer &buffer) {
+        if (buffer.slot_count() == 0) {
+            return false;
+        }
+
+        const FundamentalEntry &dot = *buffer.get_record(0);
+        return dot.filename[0] == '.' && dot.filename[1] == ' ' && (dot.file_attributes & (int)EntryAttribute::DIRECTORY);
+    }
+
+    static bool read_pending_directory(UndeleteState &state, const PendingDirectory &pending, DirectoryBuffer &buffer) {
+        if (!pending.deleted) {
+            return buffer.read(state.img, pending.cluster);
+        }
+
+        buffer.data.resize(state.cluster_size);
+        buffer.extents.assign(1, { pending.cluster, 1 });
+        buffer.root_offset = 0;
+
+        if (state.img.read_at(state.img.cluster_offset(pending.cluster), buffer.data.data(), state.cluster_size)
+            != state.cluster_size) {
+            return false;
+        }
+
+        buffer.classes.resize(buffer.slot_count());
+        classify_slots(buffer.data.data(), buffer.slot_count(), buffer.classes.data());
+
+        return looks_like_directory(buffer);
+    }
+
+    bool find_deleted_files(Image &img, DeletedFileFunc result_func, void *userdata, const UndeleteOptions &options) {
+        if (img.fat_cache.empty() && !img.cache_fat()) {
+            return false;
+        }
+
+        UndeleteState state(img, img.cluster_limit());
+
+        std::vector<PendingDirectory> pending;
+        pending.push_back({ std::u16string(), 0, false });
+
+        DirectoryBuffer buffer;
+        DeletedFile file;
+        bool complete = true;
+
+        while (!pending.empty()) {
+            const PendingDirectory current = std::move(pending.back());
+            pending.pop_back();
+
+            if (!read_pending_directory(state, current, buffer)) {
+                complete = false;
+                continue;
+            }
+
+            const std::uint32_t count = buffer.slot_count();
+            const std::uint32_t first_subdirectory = static_cast<std::uint32_t>(pending.size());
+
+            // Run of LFN slots right before the current slot
+            std::uint32_t long_name_slot = 0;
+            std::uint32_t long_name_count = 0;
+
+            for (std::uint32_t slot = 0; slot < count && buffer.classes[slot] != SLOT_END; slot++) {
+                const std::uint8_t slot_class = buffer.classes[slot];
+
+                if (slot_class == SLOT_LONG_NAME) {
+                    if (reinterpret_cast<const LongFileNameEntry*>(buffer.get_record(slot))->padding != 0) {
+                        long_name_count = 0;
+                    } else if (long_name_count++ == 0) {
+                        long_name_slot = slot;
+                    }
+
+                    continue;
+                }
+
+                const std::uint32_t run_slot = long_name_slot;
+                const std::uint32_t run_count = long_name_count;
+
+                long_name_count = 0;
+
+                // Live entries only matter in deleted directories, everything in those is lost
+                const bool is_deleted = (slot_class == SLOT_DELETED);
+
+                if (!is_deleted && !(slot_class == SLOT_ENTRY && current.deleted)) {
+                    const FundamentalEntry &record = *buffer.get_record(slot);
+
+                    if (slot_class == SLOT_ENTRY && (record.file_attributes & (int)EntryAttribute::DIRECTORY)
+                        && state.is_in_range(record.starting_cluster) && !state.visited[record.starting_cluster]) {
+                        const LongFileNameEntry *slots = reinterpret_cast<const LongFileNameEntry*>(buffer.get_record(run_slot));
+                        const std::uint32_t matched = run_count ? match_long_name(slots, run_count, record) : 0;
+
+                        PendingDirectory subdirectory;
+                        subdirectory.path = current.path;
+
+                        if (!subdirectory.path.empty()) {
+                            subdirectory.path += u'/';
+                        }
+
+                        append_filename(record, slots + (run_count - matched), matched, subdirectory.path);
+                        subdirectory.cluster = record.starting_cluster;
+                        subdirectory.deleted = false;
+
+                        state.visited[record.starting_cluster] = true;
+                        pending.push_back(std::move(subdirectory));
+                    }
+
+                    continue;
+                }
+
+                file.entry = *buffer.get_record(slot);
+
+                if (file.entry.file_attributes & (int)EntryAttribute::SPECIAL) {
+                    // A deleted volume label
+                    continue;
+                }
+
+                // Deleted LFN slots lost their sequence numbers too, live ones are checked as usual
+                const LongFileNameEntry *slots = reinterpret_cast<const LongFileNameEntry*>(buffer.get_record(run_slot));
+                std::uint32_t matched = 0;
+
+                if (is_deleted) {
+                    std::uint32_t deleted_count = 0;
+
+                    while (deleted_count < run_count && slots[run_count - 1 - deleted_count].position == DELETED_MARKER) {
+                        deleted_count++;
+                    }
+
+                    matched = match_deleted_long_name(slots + (run_count - deleted_count), deleted_count, file.entry);
+                    file.name_restored = (matched != 0);
+
+                    if (!file.name_restored) {
+                        file.entry.filename[0] = '_';
+                    }
+                } else {
+                    matched = run_count ? match_long_name(slots, run_count, file.entry) : 0;
+                    file.name_restored = true;
+                }
+
+                file.path = current.path;
+
+                if (!file.path.empty()) {
+                    file.path += u'/';
+                }
+
+                append_filename(file.entry, slots + (run_count - matched), matched, file.path);
+
+                file.record_offset = buffer.get_slot_offset(img, slot);
+                file.in_deleted_directory = current.deleted;
+
+                // A directory's size is 0, only its first cluster is sure to be its own
+                const std::uint32_t clusters_needed = file.is_directory() ? 1 : static_cast<std::uint32_t>(
+                    (std::uint64_t(file.entry.file_size) + state.cluster_size - 1) / state.cluster_size);
+
+                guess_extents(state, file, clusters_needed);
+
+                if (!result_func(userdata, file)) {
+                    return complete;
+                }
+
+                const ClusterID cluster = file.entry.starting_cluster;
+
+                if (file.is_directory() && options.scan_deleted_directories && file.confidence != RecoveryConfidence::NONE
+                    && !state.visited[cluster]) {
+                    state.visited[cluster] = true;
+                    pending.push_back({ file.path, cluster, true });
+                }
+            }
+
+            // The first subdirectory found is the next one scanned
+            std::reverse(pending.begin() + first_subdirectory, pending.end());
+        }
+
+        return complete;
+    }
+
+    std::uint32_t read_deleted_file(Image &img, const DeletedFile &file, std::uint8_t *dest, const std::uint32_t offset,
+        const std::uint32_t size) {
+        const std::uint32_t cluster_size = img.bytes_per_cluster();
+        const std::uint32_t file_size = file.is_directory() ? cluster_size : file.entry.file_size;
+
+        if (offset >= file_size) {
+            return 0;
+        }
+
+        std::uint32_t size_left = std::min(size, file_size - offset);
+        std::uint32_t position = offset;
+        std::uint32_t total = 0;
+
+        while (size_left != 0) {
+            const std::uint32_t image_offset = get_extent_offset(img, file.extents, position);
+
+            if (image_offset == 0) {
+                break;
+            }
+
+            // Extents may not be contiguous, so read up to the end of the cluster at most
+            const std::uint32_t to_read = std::min(size_left, cluster_size - position % cluster_size);
+            const std::uint32_t bytes_read = img.read_at(image_offset, dest + total, to_read);
+
+            total += bytes_read;
+
+            if (bytes_read != to_read) {
+                break;
+            }
+
+            position += to_read;
+            size_left -= to_read;
+        }
+
+        return total;
+    }
+}
@@ -0,0 +1,246 @@
+#include <fat16/directory.h>
+#include <fat16/walker.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Fat16 {
+    namespace {
+        struct WalkTask {
+            std::shared_ptr<const WalkPath> path;
+            ClusterID cluster;                      ///< First cluster of the directory. 0 for the root.
+        };
+
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<WalkTask> tasks;             ///< The owner works at the back, thieves take from the front.
+        };
+
+        struct WalkState {
+            Image &img;
+            WalkVisitFunc visitor;
+            void *userdata;
+            const WalkOptions &options;
+
+            std::vector<WorkQueue> queues;
+            std::atomic<std::uint32_t> pending;     ///< Directories queued or being read.
+            std::atomic<bool> stopping;
+            std::atomic<bool> failed;
+
+            std::mutex visited_lock;
+            std::vector<bool> visited;              ///< Directory clusters already queued, a corrupt tree could loop.
+
+            std::mutex idle_lock;
+            std::condition_variable idle;
+
+            explicit WalkState(Image &img, WalkVisitFunc visitor, void *userdata, const WalkOptions &options,
+                const std::uint32_t threads)
+                : img(img)
+                , visitor(visitor)
+                , userdata(userdata)
+                , options(options)
+                , queues(threads)
+                , pending(0)
+                , stopping(false)
+                , failed(false)
+                , visited(img.cluster_limit(), false) {
+            }
+        };
+    }
+
+    std::u16string WalkPath::to_string() const {
+        std::size_t length = 0;
+
+        for (const WalkPath *node = this; node->parent; node = node->parent.get()) {
+            length += node->name.length() + 1;
+        }
+
+        // Filled from the end, the walk up meets the last component first
+        std::u16string result(length ? length - 1 : 0, u'/');
+        std::size_t end = result.length();
+
+        for (const WalkPath *node = this; node->parent; node = node->parent.get()) {
+            end -= node->name.length();
+            result.replace(end, node->name.length(), node->name);
+
+            if (end != 0) {
+                end--;
+            }
+        }
+
+        return result;
+    }
+
+    std::u16string EntryView::get_filename() const {
+        std::u16string name;
+        append_filename(*entry, long_name, long_name_count, name);
+
+        return name;
+    }
+
+    static void push_task(WalkState &state, const std::uint32_t worker, WalkTask &&task) {
+        state.pending++;
+
+        {
+            std::lock_guard<std::mutex> guard(state.queues[worker].lock);
+            state.queues[worker].tasks.push_back(std::move(task));
+        }
+
+        std::lock_guard<std::mutex> guard(state.idle_lock);
+        state.idle.notify_one();
+    }
+
+    static bool take_task(WalkState &state, const std::uint32_t worker, WalkTask &task) {
+        {
+            // Newest first from our own queue, it's the part of the tree we just looked at
+            std::lock_guard<std::mutex> guard(state.queues[worker].lock);
+
+            if (!state.queues[worker].tasks.empty()) {
+                task = std::move(state.queues[worker].tasks.back());
+                state.queues[worker].tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (std::size_t i = 1; i < state.queues.size(); i++) {
+            WorkQueue &victim = state.queues[(worker + i) % state.queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+
+            // Oldest from someone else's, it's the highest in the tree so the most work
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static void walk_directory(WalkState &state, const std::uint32_t worker, const WalkTask &task, DirectoryBuffer &buffer) {
+        // Read the whole directory at once, records are then looked at in place
+        if (!buffer.read(state.img, task.cluster)) {
+            state.failed = true;
+            return;
+        }
+
+        const std::uint32_t child_depth = task.path->depth + 1;
+
+        std::uint32_t slot = 0;
+        DirectoryRecord record;
+
+        while (!state.stopping && buffer.next_record(slot, record)) {
+            EntryView view;
+            view.entry = buffer.get_record(record.slot);
+            view.long_name = buffer.get_long_name(record);
+            view.long_name_count = record.long_name_count;
+            view.record_offset = buffer.get_slot_offset(state.img, record.slot);
+            view.parent = task.path.get();
+
+            const WalkAction action = state.visitor(state.userdata, view, worker);
+
+            if (action == WalkAction::STOP) {
+                state.stopping = true;
+                break;
+            }
+
+            if (!view.is_directory() || action == WalkAction::SKIP
+                || (state.options.max_depth != 0 && child_depth > state.options.max_depth)) {
+                continue;
+            }
+
+            const ClusterID cluster = view.entry->starting_cluster;
+
+            if (cluster < CLUSTER_FIRST_VALID || cluster >= state.visited.size()) {
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(state.visited_lock);
+
+                if (state.visited[cluster]) {
+                    continue;
+                }
+
+                state.visited[cluster] = true;
+            }
+
+            std::shared_ptr<WalkPath> path = std::make_shared<WalkPath>();
+            path->parent = task.path;
+            path->name = view.get_filename();
+            path->depth = child_depth;
+
+            push_task(state, worker, { std::move(path), cluster });
+        }
+    }
+
+    static void run_worker(WalkState &state, const std::uint32_t worker) {
+        DirectoryBuffer buffer;
+
+        while (true) {
+            WalkTask task;
+
+            if (!take_task(state, worker, task)) {
+                std::unique_lock<std::mutex> guard(state.idle_lock);
+
+                if (state.pending == 0) {
+                    break;
+                }
+
+                // Someone is still reading a directory, it may have more work for us
+                state.idle.wait_for(guard, std::chrono::milliseconds(1));
+                continue;
+            }
+
+            // Once stopped, what's left in the queues is drained without being read
+            if (!state.stopping) {
+                walk_directory(state, worker, task, buffer);
+            }
+
+            if (--state.pending == 0) {
+                std::lock_guard<std::mutex> guard(state.idle_lock);
+                state.idle.notify_all();
+            }
+        }
+    }
+
+    bool walk(Image &img, WalkVisitFunc visitor, void *userdata, const WalkOptions &options) {
+        // Chains are followed from memory after this, the workers only read directories
+        if (img.fat_cache.empty()) {
+            img.cache_fat();
+        }
+
+        std::uint32_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+
+        // Reads would share the image cursor otherwise
+        if (threads == 0 || !img.read_at_func) {
+            threads = 1;
+        }
+
+        WalkState state(img, visitor, userdata, options, threads);
+
+        std::shared_ptr<WalkPath> root = std::make_shared<WalkPath>();
+        root->depth = 0;
+
+        push_task(state, 0, { std::move(root), 0 });
+
+        std::vector<std::thread> workers;
+
+        for (std::uint32_t i = 1; i < threads; i++) {
+            workers.emplace_back(run_worker, std::ref(state), i);
+        }
+
+        run_worker(state, 0);
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        return !state.failed && !state.stopping;
+    }
+}
@@ -0,0 +1,207 @@
+#include <fat16/zerocopy.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FAT16_HAS_POSIX_FD 1
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace Fat16 {
+#if defined(FAT16_HAS_POSIX_FD)
+    enum class CopyMethod {
+        COPY_FILE_RANGE = 0,
+        SENDFILE = 1,
+        SPLICE = 2,
+        READ_WRITE = 3
+    };
+
+    enum class CopyResult {
+        DONE,
+        FAILED,
+        UNSUPPORTED                 ///< Nothing wrong with the data, the method just can't do it here.
+    };
+
+    static bool write_all(const int fd, const std::uint8_t *data, std::size_t size) {
+        while (size != 0) {
+            const ssize_t written = write(fd, data, size);
+
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (written <= 0) {
+                return false;
+            }
+
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+
+        return true;
+    }
+
+    static CopyResult copy_with_read_write(const int in_fd, off_t &offset, const int out_fd, std::uint64_t size) {
+        std::vector<std::uint8_t> buffer(static_cast<std::size_t>(std::min<std::uint64_t>(size, 0x100000)));
+
+        while (size != 0) {
+            const ssize_t bytes_read = pread(in_fd, buffer.data(), static_cast<std::size_t>(std::min<std::uint64_t>(size,
+                buffer.size())), offset);
+
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes_read <= 0 || !write_all(out_fd, buffer.data(), static_cast<std::size_t>(bytes_read))) {
+                return CopyResult::FAILED;
+            }
+
+            offset += bytes_read;
+            size -= static_cast<std::uint64_t>(bytes_read);
+        }
+
+        return CopyResult::DONE;
+    }
+
+#if defined(__linux__)
+    static bool is_unsupported_error(const int error) {
+        return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+    }
+
+    static CopyResult copy_with_kernel(const CopyMethod method, const int in_fd, off_t &offset, const int out_fd,
+        std::uint64_t size) {
+        int pipe_fds[2] = { -1, -1 };
+
+        if (method == CopyMethod::SPLICE && pipe(pipe_fds) != 0) {
+            return CopyResult::UNSUPPORTED;
+        }
+
+        CopyResult result = CopyResult::DONE;
+
+        while (size != 0) {
+            // The kernel takes at most a little under 2 GiB per call anyway
+            const std::size_t size_to_take = static_cast<std::size_t>(std::min<std::uint64_t>(size, 0x40000000));
+            ssize_t copied = 0;
+
+            switch (method) {
+            case CopyMethod::COPY_FILE_RANGE:
+                copied = copy_file_range(in_fd, &offset, out_fd, nullptr, size_to_take, 0);
+                break;
+
+            case CopyMethod::SENDFILE:
+                copied = sendfile(out_fd, in_fd, &offset, size_to_take);
+                break;
+
+            default: {
+                // Through a pipe, which is what splice needs on one side
+                copied = splice(in_fd, &offset, pipe_fds[1], nullptr, std::min<std::size_t>(size_to_take, 0x10000),
+                    SPLICE_F_MOVE);
+
+                for (ssize_t drained = 0; copied > 0 && drained < copied; ) {
+                    const ssize_t moved = splice(pipe_fds[0], nullptr, out_fd, nullptr,
+                        static_cast<std::size_t>(copied - drained), SPLICE_F_MOVE);
+
+                    if (moved < 0 && errno == EINTR) {
+                        continue;
+                    }
+
+                    if (moved <= 0) {
+                        // The data is stuck in the pipe, can't fall back from here
+                        copied = 0;
+                        errno = EIO;
+                        break;
+                    }
+
+                    drained += moved;
+                }
+
+                break;
+            }
+            }
+
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (copied <= 0) {
+                result = (copied < 0 && is_unsupported_error(errno)) ? CopyResult::UNSUPPORTED : CopyResult::FAILED;
+                break;
+            }
+
+            size -= static_cast<std::uint64_t>(copied);
+        }
+
+        if (pipe_fds[0] >= 0) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        }
+
+        return result;
+    }
+#endif
+
+    bool copy_file_to_fd(Image &img, const FundamentalEntry &entry, const int image_fd, const int out_fd) {
+        std::vector<Extent> extents;
+
+        if (!img.get_extents(entry.starting_cluster, extents)) {
+            return false;
+        }
+
+        const std::uint64_t cluster_size = img.bytes_per_cluster();
+        std::uint64_t size_left = entry.file_size;
+
+        // Once a method is refused, it stays refused for the rest of the file
+        CopyMethod method = CopyMethod::COPY_FILE_RANGE;
+
+        for (const Extent &extent : extents) {
+            if (size_left == 0) {
+                break;
+            }
+
+            off_t offset = static_cast<off_t>(img.cluster_offset(extent.first));
+            const off_t run_end = offset + static_cast<off_t>(std::min<std::uint64_t>(extent.count * cluster_size, size_left));
+
+            while (offset != run_end) {
+                CopyResult result = CopyResult::UNSUPPORTED;
+
+#if defined(__linux__)
+                if (method != CopyMethod::READ_WRITE) {
+                    result = copy_with_kernel(method, image_fd, offset, out_fd, static_cast<std::uint64_t>(run_end - offset));
+                } else
+#endif
+                {
+                    result = copy_with_read_write(image_fd, offset, out_fd, static_cast<std::uint64_t>(run_end - offset));
+                }
+
+                if (result == CopyResult::FAILED) {
+                    return false;
+                }
+
+                if (result == CopyResult::UNSUPPORTED) {
+                    method = static_cast<CopyMethod>(static_cast<int>(method) + 1);
+                }
+            }
+
+            size_left -= std::min<std::uint64_t>(extent.count * cluster_size, size_left);
+        }
+
+        // A chain shorter than the file size
+        return size_left == 0;
+    }
+#else
+    bool copy_file_to_fd(Image &img, const FundamentalEntry &entry, const int image_fd, const int out_fd) {
+        (void)img;
+        (void)entry;
+        (void)image_fd;
+        (void)out_fd;
+        return false;
+    }
+#endif
+}